@@ -9,6 +9,7 @@
 #include <stdio.h>
 #include <math.h>
 #include <string.h>
+#include <stdatomic.h>
 
 // you know we're in for a good time right now
 #define when      if
@@ -33,9 +34,34 @@
 #define MIDI_A3_FREQ    440.0 /* no, i won't listen to your A=432Hz bullshit */
 #define VELOCITY_MAX    0x7f  /* 7 bits */
 #define SAMPLE_MAX      0x7FFF /* max output from a single generator */
+#ifndef N_GENERATORS
 #define N_GENERATORS    8 /* number of supported notes playing simultainiously  (polytones), \
                              subject to change, chisel and microcontroller code \
                              should scale from this single variable alone */
+#endif
+#ifndef OSCILLATOR_DDS
+#define OSCILLATOR_DDS  0 /* 1 replaces wavelength_pos with a phase accumulator, see fpga_generator_output() */
+#endif
+#ifndef ENABLE_STATS
+#define ENABLE_STATS    0 /* 1 counts events, packets, voices and clipping on the hot paths, see MicrocontrollerStats */
+#endif
+#ifndef ENABLE_TRACE
+#define ENABLE_TRACE    0 /* 1 hands the note, voice, envelope and SPI events to the trace hooks, see TraceEventType */
+#endif
+
+// a statement which is only compiled in with ENABLE_STATS, for the counters
+#if ENABLE_STATS
+#define STATS(...) __VA_ARGS__
+#else
+#define STATS(...)
+#endif
+
+// the same for the trace hooks
+#if ENABLE_TRACE
+#define TRACE(...) __VA_ARGS__
+#else
+#define TRACE(...)
+#endif
 
 typedef unsigned int    uint;
 typedef unsigned char   byte;
@@ -55,8 +81,13 @@ enum Instrument { // we can expand this as much as we want
     TRIANGLE = 1,
     SAWTOOTH = 2,
     SINE     = 3,
+    // band-limited versions of the first three, read from the wavetables. New timbres go after these
+    WAVETABLE_SQUARE   = 4,
+    WAVETABLE_TRIANGLE = 5,
+    WAVETABLE_SAWTOOTH = 6,
 };
 typedef byte Instrument;
+#define N_WAVETABLE_INSTRUMENTS 3 /* from WAVETABLE_SQUARE on */
 
 typedef struct Envelope { // either preset or controlled by knobs/buttons on the PCB
     Time   attack;
@@ -87,10 +118,38 @@ typedef struct MicrocontrollerGeneratorState {
     Velocity     velocity;          // to know which pitchwheel to use
 } __attribute__((packed)) MicrocontrollerGeneratorState;
 
+// The SPI packets, the first byte being the packet type:
+//   1: global state update      MicrocontrollerGlobalState
+//   2: generator update         ushort generator_index, byte reset_note_lifetime, MicrocontrollerGeneratorState
+//   3: multi generator update   ushort first_generator, byte n_mask_bytes,
+//                               byte update_mask[n_mask_bytes], byte reset_mask[n_mask_bytes],
+//                               MicrocontrollerGeneratorState for every bit set in update_mask, in increasing order
+// In the masks bit i%8 of byte i/8 stands for generator first_generator+i.
+// Type 3 carries all the generator updates which happen on the same sample
+// tick, like chords, in a single SPI transaction.
+
 // the following two types are the internal state of the FPGA
 
 typedef MicrocontrollerGlobalState FPGAGlobalState;
 
+enum EnvelopePhase {
+    ENVELOPE_ATTACK  = 0,
+    ENVELOPE_DECAY   = 1,
+    ENVELOPE_SUSTAIN = 2,
+    ENVELOPE_RELEASE = 3,
+    ENVELOPE_DONE    = 4, // the release has ended, silent
+};
+typedef byte EnvelopePhase;
+
+typedef struct FPGAEnvelopeSteps {
+    // derived from the envelope in FPGAGlobalState whenever it changes, see fpga_update_envelope_steps()
+    ushort scaled_sustain;          // the sustain scaled from 8 to 16 bits
+    ushort attack_step;             // 0xffff / attack
+    ushort attack_step_remainder;   // 0xffff % attack
+    ushort decay_step;              // (0xffff - scaled_sustain) / decay
+    ushort decay_step_remainder;    // (0xffff - scaled_sustain) % decay
+} FPGAEnvelopeSteps;
+
 typedef struct FPGAGeneratorState {
     MicrocontrollerGeneratorState data; // packet from microcontroller stored here
     // the following is registeres inside each generator:
@@ -100,8 +159,29 @@ typedef struct FPGAGeneratorState {
     WTime note_life;
     WTime wavelength_pos;
 
+    // The wavelength of the current note with its pitchwheel applied, in the same scale as wavelength_pos.
+    // It is recalculated by the SPI handler only when the note or the pitchwheel of its channel changes
+    uint wavelength;
+    uint wavelength_reciprocal; // ceil(2^32 / wavelength), turns wavelength_pos into a phase with a multiplication
+
+    // With OSCILLATOR_DDS these replace the three above. The phase is a 32 bit fraction of a period,
+    // advanced by phase_increment every sample. The increment is recalculated when the wavelength would be
+    uint phase;
+    uint phase_increment;
+
+    // the row of fpga_wavetables for the note and instrument, chosen along with the wavelength
+    ushort wavetable;
+
     // used to know where the release section if the envelope begins at
     ushort last_active_envelope_effect;
+
+    // The envelope, stepped along with note_life. See fpga_load_envelope() for what they hold
+    EnvelopePhase envelope_phase;
+    ushort envelope_effect;                  // the output of the envelope
+    Time   envelope_counter;                 // samples left of the attack, decay or release
+    ushort envelope_remainder;               // envelope_effect is the quotient of a division, this is its remainder
+    ushort envelope_release_step;            // last_active_envelope_effect / release
+    ushort envelope_release_step_remainder;  // last_active_envelope_effect % release
 } __attribute__((packed)) FPGAGeneratorState;
 
 
@@ -140,26 +220,199 @@ const uint BUTTON_INDEX_TO_PIN_MAP[] = { // change this as needed on the actual
 const uint BUTTON_COUNT = sizeof(BUTTON_INDEX_TO_PIN_MAP) / sizeof(uint);
 
 
+// The events of ENABLE_TRACE, for following the generators through a song.
+// They are rare compared to the samples, a few per note, so the hooks are
+// plain calls. Implemented by the simulator, see simulator/trace.c
+enum TraceEventType {
+    TRACE_NOTE_ON        = 0, // a note-on midi event, before a generator is picked for it
+    TRACE_NOTE_OFF       = 1,
+    TRACE_VOICE_ALLOCATE = 2, // a vacant generator picked for a note-on
+    TRACE_VOICE_STEAL    = 3, // a generator picked for a note-on, cutting off the note it held
+    TRACE_VOICE_DROP     = 4, // a note-on ignored for lack of generators
+    TRACE_VOICE_RELEASE  = 5, // a generator let go by a note-off
+    TRACE_ENVELOPE_PHASE = 6, // a generator on the FPGA entering an envelope phase, or restarting it on a note
+    TRACE_SPI_APPLY      = 7, // the FPGA handling an SPI packet
+    N_TRACE_EVENT_TYPES,
+};
+typedef byte TraceEventType;
+
+#define TRACE_NO_GENERATOR 0xffff
+
+// The microcontroller doesn't know the sample clock, its events are stamped
+// by the hook. The FPGA passes the sample the event happened on. The value
+// is the velocity, the envelope phase or the SPI packet type
+void trace_microcontroller_event(TraceEventType type, uint generator_index, byte channel, byte note, byte velocity);
+void trace_fpga_event(uint64_t sample, TraceEventType type, uint generator_index, byte channel, byte note, byte value, ushort length);
+
+
 // microcontroller state
 
-static MicrocontrollerGlobalState    microcontroller_global_generator_state;
-static MicrocontrollerGeneratorState microcontroller_generator_states[N_GENERATORS];
+#define MICROCONTROLLER_BUSY_WORDS ((N_GENERATORS + 63) / 64)
+#define MICROCONTROLLER_MAX_MASK_BYTES 32 // 256 generators per multi generator update
+#ifndef MIDI_RX_RING_SIZE
+#define MIDI_RX_RING_SIZE 256 /* bytes buffered between the UART interrupt and the main loop, a power of two */
+#endif
+
+// How a generator is picked for a note-on:
+enum VoicePolicy {
+    VOICE_POLICY_ROUND_ROBIN    = 0, // the next vacant generator after the last one picked, drops the note if all of them are held
+    VOICE_POLICY_OLDEST_RELEASE = 1, // an unused generator, else the one released the longest ago. Drops the note if all of them are held
+    VOICE_POLICY_STEAL          = 2, // like VOICE_POLICY_OLDEST_RELEASE, but steals the oldest held note instead of dropping
+};
+typedef byte VoicePolicy;
+
+typedef struct VoiceStats {
+    size_t n_stolen;  // held notes cut off to make room for a note-on
+    size_t n_dropped; // note-ons ignored for lack of generators
+} VoiceStats;
+
+enum VoiceState {
+    VOICE_UNUSED   = 0, // not played since reset
+    VOICE_RELEASED = 1,
+    VOICE_HELD     = 2,
+};
+typedef struct VoiceQueue {
+    ushort head; // 1 + the generator index, 0 when empty
+    ushort tail;
+} VoiceQueue;
+
+typedef struct SpiStats {
+    size_t n_packets;
+    size_t n_bytes;
+    size_t n_uncoalesced_bytes; // what n_bytes would have been with a packet for every generator update
+    size_t n_queued_updates;    // generator updates queued for coalescing
+} SpiStats;
+
+// The bytes received by the UART, on their way from its interrupt to the main
+// loop. A single producer, single consumer ring: the interrupt only ever writes
+// head and the main loop only ever writes tail, so neither has to lock the other
+// out. Both run free and are masked on access
+typedef struct MidiRxRing {
+    byte        bytes[MIDI_RX_RING_SIZE];
+    atomic_uint head;
+    atomic_uint tail;
+} MidiRxRing;
+
+// The message being assembled from the received bytes, see microcontroller_parse_midi_byte()
+typedef struct MidiParser {
+    byte data[3];
+    byte length;         // of the message so far, 0 between messages
+    byte expected;       // the length of the message in progress
+    byte running_status; // the status of the last channel message, 0 for none
+    bool in_sysex;       // skipping the data bytes of a system exclusive message
+} MidiParser;
+
+typedef struct MidiInputStats {
+    size_t n_bytes;         // parsed
+    size_t n_dropped_bytes; // received while the ring was full, written by the interrupt
+    size_t n_skipped_bytes; // system exclusive data, and data bytes without a status
+} MidiInputStats;
+
+// The counters of ENABLE_STATS, for finding out why a render sounds wrong or is
+// slow. Unlike the two above they cost something on every event and packet, so
+// they stay 0 unless compiled in. The FPGA has its own, see FPGAStats
+typedef struct MicrocontrollerStats {
+    size_t n_midi_events[16];     // by the upper nibble of the status byte, the ignored types included
+    size_t n_invalid_midi_events; // with a data byte which has its top bit set
+    size_t n_drum_events;         // notes on channel 9, which are ignored
+    size_t n_spi_packets[4];      // by packet type
+    size_t n_spi_bytes[4];
+    size_t n_held_voices;         // generators holding a note
+    size_t peak_held_voices;
+} MicrocontrollerStats;
+
+// This endpoint is responsible for pushing data over SPI to the FPGA. Implemented by the simulator
+typedef void (*SpiPacketFunction)(void* user, const byte* data, size_t length);
+
+// All of the microcontroller's state. There is only ever one on the PCB, but
+// the simulator runs several at once, so every function takes the one it works on
+typedef struct Microcontroller {
+    MicrocontrollerGlobalState    global_generator_state;
+    MicrocontrollerGeneratorState generator_states[N_GENERATORS];
+
+    // lookups, so that neither note-on nor note-off have to scan all the generators:
+
+    // 1 + the index of the lowest enabled generator playing a note, 0 if there is none.
+    // The rest of them are linked in increasing order through next_note_generator,
+    // these chains are only longer than one when a key is struck again before it is released
+    ushort note_generators[N_MIDI_CHANNELS][N_MIDI_KEYS];
+    ushort next_note_generator[N_GENERATORS];
+
+    // A bitmap of the enabled generators, with a bit set in the summary for every
+    // word which is full. The next vacant generator is then found with two
+    // count-trailing-zeros, for up to 64*64 generators. Using it as the free list
+    // keeps the exact round-robin order of scanning all the generators.
+    uint64_t busy_generators[MICROCONTROLLER_BUSY_WORDS];
+    uint64_t full_busy_words[(MICROCONTROLLER_BUSY_WORDS + 63) / 64];
+    int      round_robin_from; // where the search for the next vacant generator starts
+
+    VoicePolicy voice_policy;
+    VoiceStats  voice_stats;
+
+    // The voice queues, in the order the voices are cheapest to take: the unused
+    // generators, then the released ones by when they were released, then the held
+    // ones by when they were struck. The ones released the longest ago are the
+    // most likely to be done with their release. Every generator is in exactly one
+    // of these, so picking one is constant time.
+    VoiceQueue voice_queues[3]; // indexed by VoiceState, the VOICE_UNUSED one stays empty
+    ushort     voice_prev [N_GENERATORS];
+    ushort     voice_next [N_GENERATORS];
+    byte       voice_state[N_GENERATORS];
+    size_t     unused_voices_from; // no generator below this one is VOICE_UNUSED
+
+    // Generator updates are queued up until the sample tick advances when this is set,
+    // then sent as multi generator update packets. See microcontroller_flush_generator_updates()
+    bool     coalesce_generator_updates;
+    uint64_t queued_generators[MICROCONTROLLER_BUSY_WORDS]; // a bit set for every queued generator
+    uint64_t queued_resets    [MICROCONTROLLER_BUSY_WORDS]; // and whether its note_life should be reset
+    size_t   queued_words_from; // the range of words with bits set
+    size_t   queued_words_to;
+
+    // the raw UART input, for when the midi events don't arrive whole. See microcontroller_poll_midi_input()
+    MidiRxRing     midi_rx;
+    MidiParser     midi_parser;
+    MidiInputStats midi_input_stats;
+
+    SpiStats             spi_stats;
+    MicrocontrollerStats stats;
+
+    SpiPacketFunction send_spi_packet;
+    void*             spi_user; // passed on to send_spi_packet
+} Microcontroller;
+
+// resets the microcontroller, packets will be sent through send_spi_packet
+void microcontroller_init(Microcontroller* mcu, SpiPacketFunction send_spi_packet, void* spi_user) {
+    memset(mcu, 0, sizeof(Microcontroller));
+    mcu->voice_policy      = VOICE_POLICY_ROUND_ROBIN;
+    mcu->queued_words_from = MICROCONTROLLER_BUSY_WORDS;
+    mcu->send_spi_packet   = send_spi_packet;
+    mcu->spi_user          = spi_user;
+}
+
+static void microcontroller_send_counted_spi_packet(Microcontroller* mcu, const byte* data, size_t length, size_t uncoalesced_length) {
+    mcu->spi_stats.n_packets++;
+    mcu->spi_stats.n_bytes             += length;
+    mcu->spi_stats.n_uncoalesced_bytes += uncoalesced_length;
+    STATS(mcu->stats.n_spi_packets[data[0] & 3]++;)
+    STATS(mcu->stats.n_spi_bytes  [data[0] & 3] += length;)
+    mcu->send_spi_packet(mcu->spi_user, data, length);
+}
 
-// This endpoint is responsible for pushing data over SPI to the FPGA
-void microcontroller_send_spi_packet(const byte* data, size_t length); // intentionally left undefined. To be implemented by the simulator
+void microcontroller_flush_generator_updates(Microcontroller* mcu);
 
-// The following two functions sends update packets to the FPGA
-void microcontroller_send_global_state_update() {
+// The following functions sends update packets to the FPGA
+void microcontroller_send_global_state_update(Microcontroller* mcu) {
+    microcontroller_flush_generator_updates(mcu); // keep the packets in order
     byte data[1 + sizeof(MicrocontrollerGlobalState)];
 
     data[0] = 1; // global_state update
 
-    memcpy(data+1, &microcontroller_global_generator_state, sizeof(MicrocontrollerGlobalState));
+    memcpy(data+1, &mcu->global_generator_state, sizeof(MicrocontrollerGlobalState));
 
-    microcontroller_send_spi_packet((byte*)data, sizeof(data));
+    microcontroller_send_counted_spi_packet(mcu, (byte*)data, sizeof(data), sizeof(data));
 }
 
-void microcontroller_send_generator_update(ushort generator_index, bool reset_note_lifetime) {
+void microcontroller_send_generator_update(Microcontroller* mcu, ushort generator_index, bool reset_note_lifetime) {
     // set reset_note_lifetime to true when sending note-on events
     byte data[2 + sizeof(ushort) + sizeof(MicrocontrollerGeneratorState)];
 
@@ -167,40 +420,204 @@ void microcontroller_send_generator_update(ushort generator_index, bool reset_no
 
     *(ushort*)(&data[1]) = generator_index;
     data[3] = (byte) reset_note_lifetime;
-    memcpy(data+2+sizeof(ushort), &microcontroller_generator_states[generator_index], sizeof(MicrocontrollerGeneratorState));
+    memcpy(data+2+sizeof(ushort), &mcu->generator_states[generator_index], sizeof(MicrocontrollerGeneratorState));
+
+    microcontroller_send_counted_spi_packet(mcu, data, sizeof(data), sizeof(data));
+}
+
+// Sends the generator update right away, or queues it when coalescing. Queuing
+// the same generator twice sends its latest state once, resetting if either did.
+void microcontroller_queue_generator_update(Microcontroller* mcu, ushort generator_index, bool reset_note_lifetime) {
+    if (!mcu->coalesce_generator_updates) {
+        microcontroller_send_generator_update(mcu, generator_index, reset_note_lifetime);
+        return;
+    }
+    size_t word = generator_index / 64;
+    mcu->queued_generators[word] |= 1ull << (generator_index % 64);
+    if (reset_note_lifetime) mcu->queued_resets[word] |= 1ull << (generator_index % 64);
+    if (word <  mcu->queued_words_from) mcu->queued_words_from = word;
+    if (word >= mcu->queued_words_to)   mcu->queued_words_to   = word + 1;
+    mcu->spi_stats.n_queued_updates++;
+    mcu->spi_stats.n_uncoalesced_bytes += 2 + sizeof(ushort) + sizeof(MicrocontrollerGeneratorState);
+}
+
+// sends the queued generators from first to last (inclusive) as a single packet
+static void microcontroller_send_queued_generator_updates(Microcontroller* mcu, size_t first, size_t last) {
+    byte data[4 + 2*MICROCONTROLLER_MAX_MASK_BYTES + 8*MICROCONTROLLER_MAX_MASK_BYTES*sizeof(MicrocontrollerGeneratorState)];
+    if (first == last) { // a normal generator update is smaller
+        data[0] = 2;
+        *(ushort*)(&data[1]) = first;
+        data[3] = (mcu->queued_resets[first / 64] >> (first % 64)) & 1;
+        memcpy(data+2+sizeof(ushort), &mcu->generator_states[first], sizeof(MicrocontrollerGeneratorState));
+        microcontroller_send_counted_spi_packet(mcu, data, 2 + sizeof(ushort) + sizeof(MicrocontrollerGeneratorState), 0);
+        return;
+    }
 
-    microcontroller_send_spi_packet(data, sizeof(data));
+    first -= first % 8;
+    size_t n_mask_bytes = (last - first) / 8 + 1;
+    byte*  update_mask  = data + 4;
+    byte*  reset_mask   = update_mask + n_mask_bytes;
+    byte*  record       = reset_mask  + n_mask_bytes;
+
+    data[0] = 3; // multi generator update
+    *(ushort*)(&data[1]) = first;
+    data[3] = n_mask_bytes;
+    memset(update_mask, 0, 2 * n_mask_bytes);
+    for (size_t generator_index = first; generator_index <= last; generator_index++) {
+        uint64_t bit = 1ull << (generator_index % 64);
+        if (!(mcu->queued_generators[generator_index / 64] & bit)) continue;
+        size_t i = generator_index - first;
+        update_mask[i / 8] |= 1 << (i % 8);
+        if (mcu->queued_resets[generator_index / 64] & bit) reset_mask[i / 8] |= 1 << (i % 8);
+        memcpy(record, &mcu->generator_states[generator_index], sizeof(MicrocontrollerGeneratorState));
+        record += sizeof(MicrocontrollerGeneratorState);
+    }
+    microcontroller_send_counted_spi_packet(mcu, data, record - data, 0);
 }
 
-// this is just a helper function:
+// Sends the queued generator updates. To be called when the sample tick
+// advances, and before anything else is sent. Generators close to each other
+// are grouped into multi generator updates. A generator only joins the packet
+// when the mask bytes it adds make it cheaper than a packet of its own, so
+// this never puts more bytes on the wire than sending them one by one.
+void microcontroller_flush_generator_updates(Microcontroller* mcu) {
+    size_t first = 0, last = 0, n_in_packet = 0;
+    for (size_t word = mcu->queued_words_from; word < mcu->queued_words_to; word++) {
+        for (uint64_t bits = mcu->queued_generators[word]; bits; bits &= bits - 1) {
+            size_t generator_index = word * 64 + __builtin_ctzll(bits);
+            // joining costs a record and 2 bytes per mask byte added, a packet of its own costs 4 bytes more than a record.
+            // The first join also turns a normal generator update into a multi generator update, which is 2 bytes more
+            size_t max_added_mask_bytes = (n_in_packet == 1) ? 1 : 2;
+            if (n_in_packet && (
+                generator_index / 8 - last / 8 > max_added_mask_bytes
+                || generator_index - (first - first % 8) >= 8 * MICROCONTROLLER_MAX_MASK_BYTES
+            )) {
+                microcontroller_send_queued_generator_updates(mcu, first, last);
+                n_in_packet = 0;
+            }
+            if (!n_in_packet) first = generator_index;
+            last = generator_index;
+            n_in_packet++;
+        }
+    }
+    if (n_in_packet) microcontroller_send_queued_generator_updates(mcu, first, last);
+
+    for (size_t word = mcu->queued_words_from; word < mcu->queued_words_to; word++) {
+        mcu->queued_generators[word] = 0;
+        mcu->queued_resets[word]     = 0;
+    }
+    mcu->queued_words_from = MICROCONTROLLER_BUSY_WORDS;
+    mcu->queued_words_to   = 0;
+}
+
+// these are just helper functions:
+
+static void microcontroller_set_generator_busy(Microcontroller* mcu, uint generator_index, bool busy) {
+    size_t   word = generator_index / 64;
+    uint64_t bit  = 1ull << (generator_index % 64);
+    if (busy) mcu->busy_generators[word] |=  bit;
+    else      mcu->busy_generators[word] &= ~bit;
 
-int microcontroller_find_vacant_generator_channel() {
+    if (mcu->busy_generators[word] == ~0ull) mcu->full_busy_words[word / 64] |=   1ull << (word % 64);
+    else                                                mcu->full_busy_words[word / 64] &= ~(1ull << (word % 64));
+}
+
+// the lowest index >= from of a vacant generator, or -1 if there is none
+static int microcontroller_find_vacant_generator_from(Microcontroller* mcu, uint from) {
+    size_t   word   = from / 64;
+    uint64_t vacant = ~mcu->busy_generators[word] & (~0ull << (from % 64));
+    if (!vacant) { // skip ahead to the next word which isn't full
+        if (++word >= MICROCONTROLLER_BUSY_WORDS) return -1;
+        size_t   summary  = word / 64;
+        uint64_t not_full = ~mcu->full_busy_words[summary] & (~0ull << (word % 64));
+        while (!not_full && ++summary < sizeof(mcu->full_busy_words) / sizeof(uint64_t)) {
+            not_full = ~mcu->full_busy_words[summary];
+        }
+        if (!not_full) return -1;
+        word = summary * 64 + __builtin_ctzll(not_full);
+        if (word >= MICROCONTROLLER_BUSY_WORDS) return -1;
+        vacant = ~mcu->busy_generators[word];
+    }
+    size_t generator_index = word * 64 + __builtin_ctzll(vacant);
+    return (generator_index < N_GENERATORS) ? (int)generator_index : -1; // the padding bits of the last word are never busy
+}
+
+int microcontroller_find_vacant_generator_channel(Microcontroller* mcu) {
     // we need to assign notes to generators in a round-robin fashion to avoid
     // overruling the generators which are still generating the release sound too much
-    static int starting_pos = 0;
-    int pos = starting_pos;
-    while (microcontroller_generator_states[pos].enabled) {
-        pos++;
-        if (pos >= N_GENERATORS) pos = 0;
-        if (pos == starting_pos) return -1;
-    }
-    starting_pos = (pos+1) % N_GENERATORS;
+    int pos = microcontroller_find_vacant_generator_from(mcu, mcu->round_robin_from);
+    if (pos == -1) pos = microcontroller_find_vacant_generator_from(mcu, 0); // wrap around
+    if (pos == -1) return -1;
+    mcu->round_robin_from = (pos+1) % N_GENERATORS;
     return pos;
 }
 
-// The following three functions are our input handlers:
+// moves a generator to the back of the queue for its new state
+static void microcontroller_set_voice_state(Microcontroller* mcu, uint generator_index, byte state) {
+    ushort prev = mcu->voice_prev[generator_index];
+    ushort next = mcu->voice_next[generator_index];
+    if (mcu->voice_state[generator_index] != VOICE_UNUSED) {
+        VoiceQueue* queue = &mcu->voice_queues[mcu->voice_state[generator_index]];
+        if (prev) mcu->voice_next[prev - 1] = next; else queue->head = next;
+        if (next) mcu->voice_prev[next - 1] = prev; else queue->tail = prev;
+    }
+
+    VoiceQueue* queue = &mcu->voice_queues[state];
+    mcu->voice_prev[generator_index] = queue->tail;
+    mcu->voice_next[generator_index] = 0;
+    if (queue->tail) mcu->voice_next[queue->tail - 1] = generator_index + 1; else queue->head = generator_index + 1;
+    queue->tail = generator_index + 1;
+    STATS(mcu->stats.n_held_voices += (state == VOICE_HELD) - (mcu->voice_state[generator_index] == VOICE_HELD);)
+    STATS(if (mcu->stats.n_held_voices > mcu->stats.peak_held_voices) mcu->stats.peak_held_voices = mcu->stats.n_held_voices;)
+    mcu->voice_state[generator_index] = state;
+}
+
+// picks the generator for a note-on according to mcu->voice_policy, -1 if the note is to be dropped.
+// *stolen is set when the generator is still holding a note
+static int microcontroller_allocate_voice(Microcontroller* mcu, bool* stolen) {
+    *stolen = false;
+    if (mcu->voice_policy == VOICE_POLICY_ROUND_ROBIN) {
+        return microcontroller_find_vacant_generator_channel(mcu);
+    }
+
+    // the round-robin policy might have used some of them, so this skips ahead. Amortized constant time
+    while (mcu->unused_voices_from < N_GENERATORS
+        && mcu->voice_state[mcu->unused_voices_from] != VOICE_UNUSED
+    ) mcu->unused_voices_from++;
+
+    if (mcu->unused_voices_from < N_GENERATORS)  return mcu->unused_voices_from;
+    if (mcu->voice_queues[VOICE_RELEASED].head) return mcu->voice_queues[VOICE_RELEASED].head - 1;
+    if (mcu->voice_policy == VOICE_POLICY_STEAL && mcu->voice_queues[VOICE_HELD].head) {
+        *stolen = true;
+        return mcu->voice_queues[VOICE_HELD].head - 1;
+    }
+    return -1;
+}
+
+// removes a held generator from the generators playing its note
+static void microcontroller_unlink_note_generator(Microcontroller* mcu, uint generator_index) {
+    MicrocontrollerGeneratorState* state = &mcu->generator_states[generator_index];
+    ushort* link = &mcu->note_generators[state->channel_index & (N_MIDI_CHANNELS-1)][state->note_index & (N_MIDI_KEYS-1)];
+    while (*link && (uint)(*link - 1) != generator_index) link = &mcu->next_note_generator[*link - 1];
+    if (*link) *link = mcu->next_note_generator[generator_index];
+}
+
+// The following functions are our input handlers:
 
-void microcontroller_handle_midi_event(const byte *data, size_t length) {
-    // The UART interrupt handler should call this function when it has recieved a full midi event
+void microcontroller_handle_midi_event(Microcontroller* mcu, const byte *data, size_t length) {
+    // Handles a complete midi event, as assembled by microcontroller_parse_midi_byte()
 
     byte status_byte    = data[0];
     byte packet_type    = (status_byte & 0xF0) >> 4;
     byte type_specifier = (status_byte & 0x0F);
+    STATS(mcu->stats.n_midi_events[packet_type]++;)
 
     // validate packet:
     for (size_t i = 0; i < length; i++)
-        if (!( ((data[i] & 0x80) == 0) || (i == 0) ))
+        if (!( ((data[i] & 0x80) == 0) || (i == 0) )) {
+            STATS(mcu->stats.n_invalid_midi_events++;)
             return; // ignore invalid packets
+        }
 
     // interpret and handle packet:
     switch (packet_type) {
@@ -212,24 +629,28 @@ void microcontroller_handle_midi_event(const byte *data, size_t length) {
             NoteIndex    note     = data[1];
             Velocity     velocity = data[2];
 
-            if (channel == 9) return; // ignore drums
-
-            // find the sound generator currenty playing this note (we should perhaps keep an index/lookup)
-            uint idx = 0; // sound_generator_index
-            while (idx < N_GENERATORS && !(
-                microcontroller_generator_states[idx].enabled
-                && microcontroller_generator_states[idx].note_index    == note
-                && microcontroller_generator_states[idx].channel_index == channel
-            )) idx++;
-            if (idx >= N_GENERATORS) return; // none found, probably due to the note-on being ignored due to lack of generators
+            if (channel == 9) { // ignore drums
+                STATS(mcu->stats.n_drum_events++;)
+                return;
+            }
 
-            microcontroller_generator_states[idx].enabled       = false;
-            microcontroller_generator_states[idx].note_index    = note;
-            microcontroller_generator_states[idx].channel_index = channel;
+            // find the sound generator currenty playing this note, the lowest one if there are several
+            ushort* playing = &mcu->note_generators[channel][note & (N_MIDI_KEYS-1)];
+            TRACE(trace_microcontroller_event(TRACE_NOTE_OFF, TRACE_NO_GENERATOR, channel, note, velocity);)
+            if (!*playing) return; // none found, probably due to the note-on being ignored due to lack of generators
+            uint idx = *playing - 1; // sound_generator_index
+            TRACE(trace_microcontroller_event(TRACE_VOICE_RELEASE, idx, channel, note, velocity);)
+            *playing = mcu->next_note_generator[idx];
+            microcontroller_set_generator_busy(mcu, idx, false);
+            microcontroller_set_voice_state(mcu, idx, VOICE_RELEASED);
+
+            mcu->generator_states[idx].enabled       = false;
+            mcu->generator_states[idx].note_index    = note;
+            mcu->generator_states[idx].channel_index = channel;
             if (velocity != 0) { // to not kill of the release
-                microcontroller_generator_states[idx].velocity      = velocity;
+                mcu->generator_states[idx].velocity      = velocity;
             }
-            microcontroller_send_generator_update(idx, true);
+            microcontroller_queue_generator_update(mcu, idx, true);
         }
         break; case 0b1001: { // note-on event
             assert(length == 3);
@@ -237,20 +658,43 @@ void microcontroller_handle_midi_event(const byte *data, size_t length) {
             NoteIndex    note     = data[1];
             Velocity     velocity = data[2];
 
-            if (channel == 9) return; // ignore drums
+            if (channel == 9) { // ignore drums
+                STATS(mcu->stats.n_drum_events++;)
+                return;
+            }
             if (velocity == 0) goto note_off_event; // people suck at following the midi standard
 
             // find vacant sound generator
-            int idx = microcontroller_find_vacant_generator_channel();
-            if (idx == -1) return; // out of generators
+            TRACE(trace_microcontroller_event(TRACE_NOTE_ON, TRACE_NO_GENERATOR, channel, note, velocity);)
+            bool stolen;
+            int idx = microcontroller_allocate_voice(mcu, &stolen);
+            if (idx == -1) { // out of generators
+                mcu->voice_stats.n_dropped++;
+                TRACE(trace_microcontroller_event(TRACE_VOICE_DROP, TRACE_NO_GENERATOR, channel, note, velocity);)
+                return;
+            }
+            TRACE(trace_microcontroller_event(stolen ? TRACE_VOICE_STEAL : TRACE_VOICE_ALLOCATE, idx, channel, note, velocity);)
+            if (stolen) { // it gets cut off by the update below, its note-off will find nothing
+                microcontroller_unlink_note_generator(mcu, idx);
+                mcu->voice_stats.n_stolen++;
+            } else {
+                microcontroller_set_generator_busy(mcu, idx, true);
+            }
+            microcontroller_set_voice_state(mcu, idx, VOICE_HELD);
+
+            // link it into the generators playing this note, in increasing order
+            ushort* link = &mcu->note_generators[channel][note & (N_MIDI_KEYS-1)];
+            while (*link && *link - 1 < idx) link = &mcu->next_note_generator[*link - 1];
+            mcu->next_note_generator[idx] = *link;
+            *link = idx + 1;
 
             // TODO: set instrument, probably just have it as a global variable
             // or in a array like the pitchwheels
-            microcontroller_generator_states[idx].enabled       = true;
-            microcontroller_generator_states[idx].note_index    = note;
-            microcontroller_generator_states[idx].channel_index = channel;
-            microcontroller_generator_states[idx].velocity      = velocity;
-            microcontroller_send_generator_update(idx, true);
+            mcu->generator_states[idx].enabled       = true;
+            mcu->generator_states[idx].note_index    = note;
+            mcu->generator_states[idx].channel_index = channel;
+            mcu->generator_states[idx].velocity      = velocity;
+            microcontroller_queue_generator_update(mcu, idx, true);
 
         }
         break; case 0b1010: /*IGNORE*/ // Polyphonic Key Pressure (Aftertouch) event
@@ -263,17 +707,94 @@ void microcontroller_handle_midi_event(const byte *data, size_t length) {
             short decoded = ((data[2]&0x7F) << 7 | (data[1]&0x7F)) - 0x2000;
             sbyte pitchwheel = decoded >> 6;
 
-            microcontroller_global_generator_state.pitchwheels[channel] = pitchwheel;
-            microcontroller_send_global_state_update();
+            mcu->global_generator_state.pitchwheels[channel] = pitchwheel;
+            microcontroller_send_global_state_update(mcu);
         }
         break; case 0b1111: /*IGNORE*/ // System Exclusive event
         break; default: break;         // unknown - ignored
     }
 }
 
+// The midi input, split in two halves. The UART receive interrupt hands every
+// byte to microcontroller_uart_receive_byte(), which only stores it, and the
+// main loop calls microcontroller_poll_midi_input() to parse what has arrived.
+// Bytes received while the ring is full are lost, like they would be in a UART
+// with nobody reading it.
+
+// called by the UART receive interrupt. Constant time, returns false if the byte was dropped
+bool microcontroller_uart_receive_byte(Microcontroller* mcu, byte b) {
+    MidiRxRing* ring = &mcu->midi_rx;
+    uint        head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+    if (head - atomic_load_explicit(&ring->tail, memory_order_acquire) == MIDI_RX_RING_SIZE) {
+        mcu->midi_input_stats.n_dropped_bytes++;
+        return false;
+    }
+    ring->bytes[head & (MIDI_RX_RING_SIZE-1)] = b;
+    atomic_store_explicit(&ring->head, head + 1, memory_order_release);
+    return true;
+}
+
+// Feeds one received byte to the parser, and handles the midi event it completes, if any:
+//   * realtime bytes (0xF8 and up) are events of their own, which may show up
+//     anywhere, even between the bytes of another event. They leave it be
+//   * a channel status byte becomes the running status, the events after it
+//     with the same status may leave it out and start with their data bytes
+//   * system exclusive and system common cancel the running status. The data
+//     bytes of system exclusive are skipped, until 0xF7 or any other status
+//   * data bytes without a status to go with are skipped, as when plugged in mid-event
+//   * a status byte cuts off the event in progress
+void microcontroller_parse_midi_byte(Microcontroller* mcu, byte b) {
+    MidiParser* parser = &mcu->midi_parser;
+    mcu->midi_input_stats.n_bytes++;
+
+    when (b >= 0xF8) {
+        microcontroller_handle_midi_event(mcu, &b, 1);
+        return;
+    }
+    elsewhen (b & 0x80) {
+        parser->running_status = (b < 0xF0) ? b : 0;
+        parser->in_sysex       = (b == 0xF0);
+        parser->length         = 0;
+        if (b == 0xF0 || b == 0xF7) return; // the start and end of system exclusive aren't events
+        switch (b >> 4) {
+            break; case 0xC: case 0xD: parser->expected = 2;
+            break; case 0xF:           parser->expected = (b == 0xF2) ? 3 : (b == 0xF1 || b == 0xF3) ? 2 : 1;
+            break; default:            parser->expected = 3;
+        }
+    }
+    elsewhen (parser->in_sysex || (!parser->length && !parser->running_status)) {
+        mcu->midi_input_stats.n_skipped_bytes++;
+        return;
+    }
+    elsewhen (!parser->length) { // running status
+        parser->data[parser->length++] = parser->running_status;
+    }
+
+    parser->data[parser->length++] = b;
+    if (parser->length == parser->expected) {
+        parser->length = 0;
+        microcontroller_handle_midi_event(mcu, parser->data, parser->expected);
+    }
+}
+
+// called by the main loop, handles the midi events in the bytes received since the
+// last call. Returns the number of bytes parsed
+size_t microcontroller_poll_midi_input(Microcontroller* mcu) {
+    MidiRxRing* ring = &mcu->midi_rx;
+    uint        tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+    uint        head = atomic_load_explicit(&ring->head, memory_order_acquire);
+    size_t      n    = head - tail;
+    for (; tail != head; tail++) {
+        byte b = ring->bytes[tail & (MIDI_RX_RING_SIZE-1)];
+        atomic_store_explicit(&ring->tail, tail + 1, memory_order_release); // frees the slot for the interrupt right away
+        microcontroller_parse_midi_byte(mcu, b);
+    }
+    return n;
+}
+
 bool microcontroller_poll_pcb_button_state(uint button_id); // polls the button index for its state, returns true if it is currently held down
 
-void microcontroller_handle_button_event() { // called when any button is either pushed down or released
+void microcontroller_handle_button_event(Microcontroller* mcu) { // called when any button is either pushed down or released
     // TODO: how/where do we handle debounce?
     // The IO interrupt handler should call this function
 
@@ -281,73 +802,73 @@ void microcontroller_handle_button_event() { // called when any button is either
         bool button_pushed_down = microcontroller_poll_pcb_button_state(BUTTON_INDEX_TO_PIN_MAP[button_index]);
         switch (button_index) {
             break; case 0: { // note button 1
-                microcontroller_handle_midi_event((button_pushed_down)
+                microcontroller_handle_midi_event(mcu, (button_pushed_down)
                     ? (const byte*)"\x90\x30\x7f"  // C4 note on,  midi channel 0
                     : (const byte*)"\x80\x30\x00", // C4 note off, midi channel 0
                     3);
             }
             break; case 1: { // note button 2
-                microcontroller_handle_midi_event((button_pushed_down)
+                microcontroller_handle_midi_event(mcu, (button_pushed_down)
                     ? (const byte*)"\x90\x31\x7f"  // C#4 note on,  midi channel 0
                     : (const byte*)"\x80\x31\x00", // C#4 note off, midi channel 0
                     3);
             }
             break; case 2: { // note button 3
-                microcontroller_handle_midi_event((button_pushed_down)
+                microcontroller_handle_midi_event(mcu, (button_pushed_down)
                     ? (const byte*)"\x90\x32\x7f"  // D4 note on,  midi channel 0
                     : (const byte*)"\x80\x32\x00", // D4 note off, midi channel 0
                     3);
             }
             break; case 3: { // note button 4
-                microcontroller_handle_midi_event((button_pushed_down)
+                microcontroller_handle_midi_event(mcu, (button_pushed_down)
                     ? (const byte*)"\x90\x33\x7f"  // D#4 note on,  midi channel 0
                     : (const byte*)"\x80\x33\x00", // D#4 note off, midi channel 0
                     3);
             }
             break; case 4: { // note button 5
-                microcontroller_handle_midi_event((button_pushed_down)
+                microcontroller_handle_midi_event(mcu, (button_pushed_down)
                     ? (const byte*)"\x90\x34\x7f"  // E4 note on,  midi channel 0
                     : (const byte*)"\x80\x34\x00", // E4 note off, midi channel 0
                     3);
             }
             break; case 5: { // note button 6
-                microcontroller_handle_midi_event((button_pushed_down)
+                microcontroller_handle_midi_event(mcu, (button_pushed_down)
                     ? (const byte*)"\x90\x35\x7f"  // F4 note on,  midi channel 0
                     : (const byte*)"\x80\x35\x00", // F4 note off, midi channel 0
                     3);
             }
             break; case 6: { // note button 7
-                microcontroller_handle_midi_event((button_pushed_down)
+                microcontroller_handle_midi_event(mcu, (button_pushed_down)
                     ? (const byte*)"\x90\x36\x7f"  // F#4 note on,  midi channel 0
                     : (const byte*)"\x80\x36\x00", // F#4 note off, midi channel 0
                     3);
             }
             break; case 7: { // note button 8
-                microcontroller_handle_midi_event((button_pushed_down)
+                microcontroller_handle_midi_event(mcu, (button_pushed_down)
                     ? (const byte*)"\x90\x37\x7f"  // G4 note on,  midi channel 0
                     : (const byte*)"\x80\x37\x00", // G4 note off, midi channel 0
                     3);
             }
             break; case 8: { // note button 9
-                microcontroller_handle_midi_event((button_pushed_down)
+                microcontroller_handle_midi_event(mcu, (button_pushed_down)
                     ? (const byte*)"\x90\x38\x7f"  // G#4 note on,  midi channel 0
                     : (const byte*)"\x80\x38\x00", // G#4 note off, midi channel 0
                     3);
             }
             break; case 9: { // note button 10
-                microcontroller_handle_midi_event((button_pushed_down)
+                microcontroller_handle_midi_event(mcu, (button_pushed_down)
                     ? (const byte*)"\x90\x39\x7f"  // A4 note on,  midi channel 0
                     : (const byte*)"\x80\x39\x00", // A4 note off, midi channel 0
                     3);
             }
             break; case 10: { // note button 11
-                microcontroller_handle_midi_event((button_pushed_down)
+                microcontroller_handle_midi_event(mcu, (button_pushed_down)
                     ? (const byte*)"\x90\x3a\x7f"  // A#4 note on,  midi channel 0
                     : (const byte*)"\x80\x3a\x00", // A#4 note off, midi channel 0
                     3);
             }
             break; case 11: { // note button 12
-                microcontroller_handle_midi_event((button_pushed_down)
+                microcontroller_handle_midi_event(mcu, (button_pushed_down)
                     ? (const byte*)"\x90\x3b\x7f"  // B4 note on,  midi channel 0
                     : (const byte*)"\x80\x3b\x00", // B4 note off, midi channel 0
                     3);
@@ -401,51 +922,557 @@ void microcontroller_handle_button_event() { // called when any button is either
 // ...     ) for generator in generators if generator.enabled
 // ... )
 
-// TODO: get rid of the remaining floats
-//       one solution is to convert everything to ints, and just scale it up by
-//       like 1000 or something to get 3 decimals of accuracy.
-//       If we use 1024 as the coefficient, then we can bitshift the result of a
-//       multiplication to maintain the scale, which is basically free on the fpga.
+// Floats are only used to fill in the lookup tables in fpga_init_roms(), which
+// corresponds to generating ROMs when elaborating the chisel design.
+
+
+// the counters of ENABLE_STATS on the FPGA side, see MicrocontrollerStats
+typedef struct FPGAStats {
+    size_t   peak_active_generators; // the most generators sounding at once, releases included
+    uint64_t n_clipped_samples;      // mixed samples beyond the range of a WSample after the headroom shift
+} FPGAStats;
+
+// All of the FPGA's registers. Like with the microcontroller, the simulator
+// runs several at once. The ROMs further down are shared by all of them
+typedef struct FPGA {
+    FPGAGlobalState    global_state;
+    FPGAGeneratorState generators[N_GENERATORS];
+    FPGAEnvelopeSteps  envelope_steps; // see the envelope below
+
+    // the active generator list, see below
+    uint64_t sample_count;                      // samples rendered so far
+    ushort   active_generators[N_GENERATORS];   // indices of the active generators, in no particular order
+    size_t   n_active_generators;
+    ushort   active_slot[N_GENERATORS];         // 1 + position in active_generators, 0 when idle
+    uint64_t idle_since[N_GENERATORS];          // sample_count when note_life was last brought up to date
+    uint64_t wakeup[N_GENERATORS];              // sample_count at which an idle generator wraps into its release
+    uint64_t next_wakeup;                       // the earliest of wakeup
+
+    FPGAStats stats;
+} FPGA;
+
+
+// The envelope. The level used to be worked out from note_life every sample,
+// which took a division by NOTE_LIFE_COEFF and another by the length of the
+// phase. That was the hot spot of the simulator, and would be the most
+// expensive logic of each generator on the FPGA. Instead each generator keeps
+// its envelope level in a register, and steps it along with note_life:
+//   * the phases end when a counter of the samples left in them runs out,
+//     instead of comparing note_life against them
+//   * within the attack, decay and release the level goes linearly. It is kept
+//     as the quotient and remainder of what the old formula divided, so a step
+//     adds a precomputed increment to both and carries the remainder over,
+//     like Bresenham's line algorithm. This stays bit-exact with dividing
+// The increments of the attack and decay only depend on the global envelope,
+// and are computed when a global state packet changes it. The release depends
+// on the level it starts at, so its increment is computed when the generator
+// packet of the note-off arrives. fpga_load_envelope() which does these
+// divisions never runs per sample, except when note_life wraps around.
+
+static void fpga_update_envelope_steps(FPGA* fpga) {
+    Envelope env = fpga->global_state.envelope;
+    FPGAEnvelopeSteps* steps = &fpga->envelope_steps;
+    steps->scaled_sustain = (env.sustain << 8) | env.sustain;
+    when (env.attack) {
+        steps->attack_step           = 0xffff / env.attack;
+        steps->attack_step_remainder = 0xffff % env.attack;
+    }
+    when (env.decay) {
+        steps->decay_step            = (0xffff - steps->scaled_sustain) / env.decay;
+        steps->decay_step_remainder  = (0xffff - steps->scaled_sustain) % env.decay;
+    }
+}
+
+// sets the envelope registers of a generator from its note_life, using the
+// formulas the level used to be calculated with every sample
+static void fpga_load_envelope(FPGA* fpga, FPGAGeneratorState* generator) {
+    uint life = generator->note_life / NOTE_LIFE_COEFF;
+    Envelope env = fpga->global_state.envelope;
+    ushort scaled_sustain = fpga->envelope_steps.scaled_sustain;
+    ushort last = generator->last_active_envelope_effect;
+
+    EnvelopePhase phase;
+    uint counter   = 0;
+    uint dividend  = 0;
+    uint divisor   = 1;
+    uint offset    = 0;
+    when (!generator->data.enabled) { // release phase
+        when (life < env.release) { // assuming note_life was reset on note_off
+            phase    = ENVELOPE_RELEASE;
+            counter  = env.release - life;
+            dividend = last * counter;   // effect = last * (release - life) / release
+            divisor  = env.release;
+            generator->envelope_release_step           = last / env.release;
+            generator->envelope_release_step_remainder = last % env.release;
+        } otherwise {
+            phase    = ENVELOPE_DONE;
+        }
+    } elsewhen (life < env.attack) { // attack phase
+        phase    = ENVELOPE_ATTACK;
+        counter  = env.attack - life;
+        dividend = 0xffff * life;        // effect = 0xffff * life / attack
+        divisor  = env.attack;
+    } elsewhen (life < env.attack + env.decay) { // decay phase
+        // x between [0, r), output should go linearly from a to b
+        // x*(b-a)/r + a
+        //  is equal to
+        // (r-x)*(a-b)/r + b
+        phase    = ENVELOPE_DECAY;
+        counter  = env.decay - (life - env.attack);
+        dividend = counter * (0xffff - scaled_sustain);
+        divisor  = env.decay;
+        offset   = scaled_sustain;
+    } otherwise { // sustain phase
+        phase    = ENVELOPE_SUSTAIN;
+        offset   = scaled_sustain;
+    }
+    generator->envelope_phase     = phase;
+    generator->envelope_counter   = counter;
+    generator->envelope_effect    = dividend / divisor + offset;
+    generator->envelope_remainder = dividend % divisor;
+}
+
+#if ENABLE_TRACE
+// traces the envelope phase of a generator if it isn't the old one, or always when restarted by a note
+static void fpga_trace_envelope_phase(FPGA* fpga, uint generator_index, EnvelopePhase old_phase, bool restarted, uint64_t sample) {
+    const FPGAGeneratorState* generator = &fpga->generators[generator_index];
+    when (restarted || generator->envelope_phase != old_phase) {
+        trace_fpga_event(sample, TRACE_ENVELOPE_PHASE, generator_index,
+            generator->data.channel_index, generator->data.note_index, generator->envelope_phase, 0);
+    }
+}
+#endif
+
+// steps the envelope registers of a generator whose note_life was just stepped
+static inline __attribute__((always_inline))
+void fpga_step_envelope(FPGA* fpga, FPGAGeneratorState* generator) {
+    Envelope env = fpga->global_state.envelope;
+    const FPGAEnvelopeSteps* steps = &fpga->envelope_steps;
+
+    when (generator->note_life < NOTE_LIFE_COEFF) { // it wrapped around, the carry out of the note_life adder
+        fpga_load_envelope(fpga, generator);
+        return;
+    }
+
+    switch (generator->envelope_phase) {
+        break; case ENVELOPE_ATTACK: {
+            when (--generator->envelope_counter == 0) { // into the decay, at the peak
+                generator->envelope_phase     = (env.decay) ? ENVELOPE_DECAY : ENVELOPE_SUSTAIN;
+                generator->envelope_counter   = env.decay;
+                generator->envelope_effect    = (env.decay) ? 0xffff : steps->scaled_sustain;
+                generator->envelope_remainder = 0;
+            } otherwise {
+                uint remainder = generator->envelope_remainder + steps->attack_step_remainder;
+                generator->envelope_effect += steps->attack_step;
+                when (remainder >= env.attack) {
+                    remainder -= env.attack;
+                    generator->envelope_effect++;
+                }
+                generator->envelope_remainder = remainder;
+            }
+        }
+        break; case ENVELOPE_DECAY: {
+            when (--generator->envelope_counter == 0) {
+                generator->envelope_phase  = ENVELOPE_SUSTAIN;
+                generator->envelope_effect = steps->scaled_sustain;
+            } otherwise {
+                generator->envelope_effect -= steps->decay_step;
+                when (generator->envelope_remainder < steps->decay_step_remainder) {
+                    generator->envelope_remainder += env.decay - steps->decay_step_remainder;
+                    generator->envelope_effect--;
+                } otherwise {
+                    generator->envelope_remainder -= steps->decay_step_remainder;
+                }
+            }
+        }
+        break; case ENVELOPE_RELEASE: {
+            when (--generator->envelope_counter == 0) {
+                generator->envelope_phase  = ENVELOPE_DONE;
+                generator->envelope_effect = 0;
+            } otherwise {
+                generator->envelope_effect -= generator->envelope_release_step;
+                when (generator->envelope_remainder < generator->envelope_release_step_remainder) {
+                    generator->envelope_remainder += env.release - generator->envelope_release_step_remainder;
+                    generator->envelope_effect--;
+                } otherwise {
+                    generator->envelope_remainder -= generator->envelope_release_step_remainder;
+                }
+            }
+        }
+        break; default: break; // the sustain holds its level, and done stays silent
+    }
+}
+
+
+// The active generator list. This is not something the FPGA has, all of its
+// generators run in parallel and the idle ones simply output 0. In software we
+// only want to spend time on the generators which are sounding, since
+// N_GENERATORS can be pushed into the thousands. A generator is active while it
+// is enabled or in its release stage. The idle ones are not stepped at all,
+// instead note_life and wavelength_pos are brought up to date when the
+// generator is touched again, which is exact since they only count up while idle.
+//
+// An idle generator also comes back when its note_life wraps around into the
+// release stage (after ~2.7 hours at 44.1kHz with NOTE_LIFE_COEFF 10), or when
+// a global state packet increases the release time. Both are handled to stay
+// bit-exact with stepping every generator.
+
+// steps the oscillator of a generator n samples ahead, wrapping around is left to fpga_generator_output()
+static inline __attribute__((always_inline))
+void fpga_advance_oscillator(FPGAGeneratorState* generator, uint n) {
+#if OSCILLATOR_DDS
+    generator->phase          += n * generator->phase_increment;
+#else
+    generator->wavelength_pos += n * NOTE_LIFE_COEFF;
+#endif
+}
+
+// brings the registers of an idle generator up to date
+static void fpga_catch_up_generator(FPGA* fpga, uint generator_index) {
+    when (!fpga->active_slot[generator_index]) {
+        FPGAGeneratorState* generator = &fpga->generators[generator_index];
+        uint steps = fpga->sample_count - fpga->idle_since[generator_index];
+        generator->note_life += steps * NOTE_LIFE_COEFF;
+        fpga_advance_oscillator(generator, steps);
+        fpga->idle_since[generator_index] = fpga->sample_count;
+    }
+}
 
+// the number of samples until the generator is active, 0 if the next one. UINT64_MAX for never
+static uint64_t fpga_samples_until_active(FPGA* fpga, const FPGAGeneratorState* generator) {
+    when (generator->data.enabled) return 0;
+    uint64_t release_life = (uint64_t)fpga->global_state.envelope.release * NOTE_LIFE_COEFF;
+    when (release_life == 0) return UINT64_MAX;
 
-// The FPGA shared state
-static FPGAGlobalState    fpga_global_state;
-static FPGAGeneratorState fpga_generators[N_GENERATORS];
+    uint64_t life = (uint64_t)generator->note_life + NOTE_LIFE_COEFF; // after the next step
+    when ((WTime)life < release_life) return 0;
 
+    // it only gets back into the release stage when note_life wraps around,
+    // which it always lands within NOTE_LIFE_COEFF of
+    uint64_t wrap = ((life >> 32) + 1) << 32;
+    return (wrap - life + NOTE_LIFE_COEFF - 1) / NOTE_LIFE_COEFF;
+}
 
+// puts an up to date generator in or out of the active list
+static void fpga_schedule_generator(FPGA* fpga, uint generator_index) {
+    uint64_t wait = fpga_samples_until_active(fpga, &fpga->generators[generator_index]);
+    ushort   slot = fpga->active_slot[generator_index];
+
+    when (wait == 0) {
+        when (!slot) {
+            fpga->active_generators[fpga->n_active_generators++] = generator_index;
+            fpga->active_slot[generator_index] = fpga->n_active_generators;
+            TRACE(EnvelopePhase phase = fpga->generators[generator_index].envelope_phase;)
+            fpga_load_envelope(fpga, &fpga->generators[generator_index]); // it wasn't stepped while idle
+            TRACE(fpga_trace_envelope_phase(fpga, generator_index, phase, false, fpga->sample_count);)
+        }
+    } otherwise {
+        when (slot) { // swap in the last one
+            ushort last = fpga->active_generators[--fpga->n_active_generators];
+            fpga->active_generators[slot - 1] = last;
+            fpga->active_slot[last] = slot;
+            fpga->active_slot[generator_index] = 0;
+            // stepped one sample at a time it goes idle the sample before its release counter runs out, trace it as done
+            TRACE(FPGAGeneratorState* generator = &fpga->generators[generator_index];)
+            TRACE(when (generator->envelope_phase != ENVELOPE_DONE) trace_fpga_event(fpga->sample_count, TRACE_ENVELOPE_PHASE,
+                generator_index, generator->data.channel_index, generator->data.note_index, ENVELOPE_DONE, 0);)
+        }
+        fpga->idle_since[generator_index] = fpga->sample_count;
+        fpga->wakeup[generator_index] = (wait == UINT64_MAX) ? UINT64_MAX : fpga->sample_count + wait;
+        when (fpga->wakeup[generator_index] < fpga->next_wakeup) {
+            fpga->next_wakeup = fpga->wakeup[generator_index];
+        }
+    }
+}
+
+// must be called before rendering, returns how many of the n samples can be
+// rendered before the active list needs attention again
+size_t fpga_begin_block(FPGA* fpga, size_t n) {
+    when (fpga->sample_count >= fpga->next_wakeup) {
+        fpga->next_wakeup = UINT64_MAX;
+        for (size_t generator_idx = 0; generator_idx < N_GENERATORS; generator_idx++) {
+            when (fpga->active_slot[generator_idx]) continue;
+            when (fpga->wakeup[generator_idx] <= fpga->sample_count) {
+                fpga_catch_up_generator(fpga, generator_idx);
+                fpga_schedule_generator(fpga, generator_idx);
+            } elsewhen (fpga->wakeup[generator_idx] < fpga->next_wakeup) {
+                fpga->next_wakeup = fpga->wakeup[generator_idx];
+            }
+        }
+    }
+    when (n > fpga->next_wakeup - fpga->sample_count) {
+        n = fpga->next_wakeup - fpga->sample_count;
+    }
+    STATS(when (fpga->n_active_generators > fpga->stats.peak_active_generators) fpga->stats.peak_active_generators = fpga->n_active_generators;)
+    return n;
+}
+
+// must be called after rendering n samples, retires the generators whose release ended
+void fpga_end_block(FPGA* fpga, size_t n) {
+    fpga->sample_count += n;
+    for (size_t i = fpga->n_active_generators; i-- > 0;) {
+        uint generator_idx = fpga->active_generators[i];
+        when (!fpga->generators[generator_idx].data.enabled) {
+            fpga_schedule_generator(fpga, generator_idx);
+        }
+    }
+}
+
+// brings every idle generator up to date, for when fpga->generators is inspected directly
+void fpga_catch_up_idle_generators(FPGA* fpga) {
+    for (size_t generator_idx = 0; generator_idx < N_GENERATORS; generator_idx++) {
+        fpga_catch_up_generator(fpga, generator_idx);
+    }
+}
+
+// When no generator is active the adder outputs 0 until one wakes up, or until
+// an SPI packet arrives. This skips up to n samples of that silence without
+// rendering them, returning how many were skipped. It is exact, the idle
+// generators are brought up to date when they are touched again like always
+size_t fpga_skip_silence(FPGA* fpga, size_t n) {
+    n = fpga_begin_block(fpga, n);
+    when (fpga->n_active_generators) return 0;
+    fpga->sample_count += n;
+    return n;
+}
 
-// this should be lookup table, only 128 possible input values
+
+// This is a ROM on the FPGA, there are only 128 possible input values. Filled in by fpga_init_roms()
+static uint fpga_note_freq_table[N_MIDI_KEYS];
+static uint fpga_note_phase_increment_table[N_MIDI_KEYS]; // the same for OSCILLATOR_DDS, in 2^32 per period per sample
+
+// only used to fill in fpga_note_freq_table, this never runs per sample
 uint fpga_note_index_to_freq(NoteIndex note_index) {
     return round((1<<FREQ_SHIFT) * MIDI_A3_FREQ * pow(2.0, (note_index - MIDI_A3_INDEX) / 12.f));
 }
 
+// only used to fill in fpga_note_phase_increment_table
+uint fpga_note_index_to_phase_increment(NoteIndex note_index) {
+    return round(4294967296.0 * MIDI_A3_FREQ * pow(2.0, (note_index - MIDI_A3_INDEX) / 12.0) / SAMPLE_RATE);
+}
+
 uint freq_to_wavelength_in_samples(uint freq) {
     return (SAMPLE_RATE << FREQ_SHIFT) * NOTE_LIFE_COEFF / freq;
 }
 
-Sample fpga_apply_envelope(Sample sample, FPGAGeneratorState* generator) {
-    uint life = generator->note_life / NOTE_LIFE_COEFF;
-    Envelope env = fpga_global_state.envelope; // just a shorthand reference, no register intended in chisel
-    ushort scaled_sustain = (env.sustain << 8) | env.sustain; // scale from 8 to 16 bits
+// (int)((pow(2, 2.0/12.0) - pow(2.0, -2.0/12.0)) * (1<<8)), the pitchwheel bends +-2 semitones
+#define PITCHWHEEL_LINEAR_SCALE 59
 
-    ushort envelope_effect; // this is a Wire
-    when (!generator->data.enabled) { // release phase
-        when (life < env.release) { // assuming note_life was reset on note_off
-            envelope_effect = generator->last_active_envelope_effect * (env.release - life) / env.release;
-        } otherwise {
-            envelope_effect = 0;
+// The wavelength of a note bent by a pitchwheel. This divides, but it only
+// runs in the SPI handler when either the note or the pitchwheel changes
+uint fpga_calculate_wavelength(NoteIndex note_index, sbyte pitchwheel) {
+    uint freq = fpga_note_freq_table[note_index & (N_MIDI_KEYS-1)];
+
+    // old pitchwheel implementation
+    //float note_offset = 2.0 * ((float)(fpga->global_state.pitchwheels[generator->data.channel_index])) / 128.0;
+    //uint freq_coeff = round(pow(2.0, note_offset/12.0) * (1 << FREQ_SHIFT));
+    ///freq = ((unsigned long long)(freq) * freq_coeff) >> FREQ_SHIFT;
+
+    int magic_linear_scale  = PITCHWHEEL_LINEAR_SCALE;
+    int magic_linear_offset = (1<<16);
+    uint freq_coeff
+        = pitchwheel
+        * magic_linear_scale
+        + magic_linear_offset;
+    freq = ((unsigned long long)(freq) * freq_coeff) >> (16);
+
+    return freq_to_wavelength_in_samples(freq);
+}
+
+// The phase increment of a note bent by a pitchwheel, for OSCILLATOR_DDS. The
+// same linear pitchwheel as above, but with no division at all
+uint fpga_calculate_phase_increment(NoteIndex note_index, sbyte pitchwheel) {
+    uint freq_coeff = pitchwheel * PITCHWHEEL_LINEAR_SCALE + (1<<16);
+    return ((unsigned long long)fpga_note_phase_increment_table[note_index & (N_MIDI_KEYS-1)] * freq_coeff) >> 16;
+}
+
+// The SINE instrument reads a quarter wave lookup table, which is a ROM on the FPGA.
+// The phase is a 32 bit fraction of a period: 2 bits of quadrant, SINE_LUT_BITS
+// of table index and SINE_INTERPOLATION_BITS between neighbouring entries.
+//
+// Worst case error against round(SAMPLE_MAX * sin(2 * PI * wavelength_pos / wavelength)),
+// measured over every note and position with `main.out -E`:
+//     SINE_LUT_BITS   interpolated   nearest entry
+//         4              40 LSB        1608 LSB
+//         6               3 LSB         403 LSB
+//         8               2 LSB         101 LSB
+//        10               2 LSB          26 LSB
+#ifndef SINE_LUT_BITS
+#define SINE_LUT_BITS           8   /* the quarter wave has (1 << SINE_LUT_BITS) entries, at most 15 */
+#endif
+#ifndef SINE_LUT_INTERPOLATE
+#define SINE_LUT_INTERPOLATE    1   /* linearly interpolate between entries, otherwise use the nearest one */
+#endif
+#define SINE_LUT_SIZE           (1 << SINE_LUT_BITS)
+#define SINE_INTERPOLATION_BITS 15
+#if SINE_LUT_BITS > 15
+#error "SINE_LUT_BITS + SINE_INTERPOLATION_BITS must fit in the 30 bit quarter phase"
+#endif
+
+// one extra entry for the peak, and one so that interpolating at the peak stays in bounds
+static Sample fpga_sine_table[SINE_LUT_SIZE + 2];
+
+Sample fpga_sine_lookup(uint phase) {
+    uint quadrant = phase >> 30;
+    uint pos      = (phase >> (30 - SINE_LUT_BITS - SINE_INTERPOLATION_BITS)) & ((SINE_LUT_SIZE << SINE_INTERPOLATION_BITS) - 1);
+    when (quadrant & 1) { // falling quarters read the table backwards
+        pos = (SINE_LUT_SIZE << SINE_INTERPOLATION_BITS) - pos;
+    }
+    uint index    = pos >> SINE_INTERPOLATION_BITS;
+    int  fraction = pos & ((1 << SINE_INTERPOLATION_BITS) - 1);
+
+#if SINE_LUT_INTERPOLATE
+    int delta = fpga_sine_table[index + 1] - fpga_sine_table[index];
+    int value = fpga_sine_table[index] + ((delta * fraction + (1 << (SINE_INTERPOLATION_BITS - 1))) >> SINE_INTERPOLATION_BITS);
+#else
+    int value = fpga_sine_table[index + (fraction >> (SINE_INTERPOLATION_BITS - 1))];
+#endif
+
+    return (quadrant & 2) ? -value : value;
+}
+
+// The wavetable instruments. SQUARE, TRIANGLE and SAWTOOTH are made of every
+// harmonic up to infinity, and the ones above half the sample rate fold back
+// down as aliasing, which is loud on high notes. Their wavetable versions are
+// summed from the Fourier series instead, without the harmonics above Nyquist.
+// How many fit depends on the note, so every instrument has a table per octave
+// of notes (mip tables), the higher octaves with fewer harmonics. A generator
+// picks its row when its note changes, then reads it with its phase like the
+// SINE instrument reads its table. These are ROMs on the FPGA as well.
+//
+// An instrument is nothing but its harmonics in fpga_wavetable_harmonic(), so
+// a new timbre is one more table and no new per sample logic. Every one of
+// them costs the same per sample.
+#ifndef WAVETABLE_BITS
+#define WAVETABLE_BITS           11  /* a table has (1 << WAVETABLE_BITS) entries over one period, at most 17 */
+#endif
+#define WAVETABLE_SIZE           (1 << WAVETABLE_BITS)
+#define WAVETABLE_N_OCTAVES      ((N_MIDI_KEYS + 11) / 12)
+#define WAVETABLE_MAX_HARMONIC   (WAVETABLE_SIZE / 2 - 1) /* the most a table can hold without aliasing in itself */
+#define WAVETABLE_FRACTION_BITS  15
+#if WAVETABLE_BITS > 17
+#error "WAVETABLE_BITS + WAVETABLE_FRACTION_BITS must fit in the 32 bit phase"
+#endif
+
+// one extra entry per row, a copy of the first, so that interpolating at the end stays in bounds
+static Sample fpga_wavetables[N_WAVETABLE_INSTRUMENTS * WAVETABLE_N_OCTAVES][WAVETABLE_SIZE + 1];
+
+// the amplitude of the sine at k times the frequency of the note. They start
+// and go the same way as the waveforms of fpga_wavelength_waveform()
+double fpga_wavetable_harmonic(Instrument instrument, uint k) {
+    switch (instrument) {
+        case WAVETABLE_SQUARE:   return (k % 2) ? 4 / (PI * k) : 0;
+        case WAVETABLE_TRIANGLE: return (k % 2) ? ((k % 4 == 1) ? -8 : 8) / (PI * PI * k * k) : 0; // starting downwards
+        case WAVETABLE_SAWTOOTH: return -2 / (PI * k);
+        default:                 return 0;
+    }
+}
+
+// the highest harmonic below Nyquist for every note of an octave, with the pitchwheel all the way up
+static uint fpga_wavetable_octave_harmonics(size_t octave) {
+    size_t top_note = octave * 12 + 11;
+    double freq     = MIDI_A3_FREQ * pow(2.0, ((int)top_note - MIDI_A3_INDEX) / 12.0) * (1 + 127.0 * PITCHWHEEL_LINEAR_SCALE / 65536);
+    uint   n        = SAMPLE_RATE / 2 / freq;
+    when (n < 1) n = 1; // just the fundamental, it has to sound
+    return (n < WAVETABLE_MAX_HARMONIC) ? n : WAVETABLE_MAX_HARMONIC;
+}
+
+// sums the harmonics of an instrument which fit in an octave over a period
+static void fpga_sum_wavetable(Instrument instrument, size_t octave, const double* sines, double* row) {
+    uint n_harmonics = fpga_wavetable_octave_harmonics(octave);
+    memset(row, 0, WAVETABLE_SIZE * sizeof(double));
+    for (uint k = 1; k <= n_harmonics; k++) {
+        double amplitude = fpga_wavetable_harmonic(instrument, k);
+        when (amplitude == 0) continue;
+        for (size_t i = 0; i < WAVETABLE_SIZE; i++) row[i] += amplitude * sines[(k * i) & (WAVETABLE_SIZE - 1)];
+    }
+}
+
+// only used by fpga_init_roms(). Each instrument is scaled once to fit in a
+// Sample, the octave which peaks the highest filling it, so that all of its
+// octaves have the same harmonics at the same level. The peak depends on the
+// harmonics left out, the fundamental of a square alone goes up to 4/PI
+static void fpga_fill_wavetables() {
+    static double sines[WAVETABLE_SIZE];
+    static double row[WAVETABLE_SIZE];
+    for (size_t i = 0; i < WAVETABLE_SIZE; i++) sines[i] = sin(2 * PI * i / WAVETABLE_SIZE);
+
+    for (size_t t = 0; t < N_WAVETABLE_INSTRUMENTS; t++) {
+        double peak = 0;
+        for (size_t octave = 0; octave < WAVETABLE_N_OCTAVES; octave++) {
+            fpga_sum_wavetable(WAVETABLE_SQUARE + t, octave, sines, row);
+            for (size_t i = 0; i < WAVETABLE_SIZE; i++) when (fabs(row[i]) > peak) peak = fabs(row[i]);
         }
-    } elsewhen (life < env.attack) { // attack phase
-        envelope_effect = 0xffff * life / env.attack;
-    } elsewhen (life < env.attack + env.decay) { // decay phase
-        // x between [0, r), output should go linearly from a to b
-        // x*(b-a)/r + a
-        //  is equal to
-        // (r-x)*(a-b)/r + b
-        envelope_effect =  (env.decay - (life - env.attack)) * (0xffff - scaled_sustain) / env.decay + scaled_sustain;
-    } otherwise { // sustain phase
-        envelope_effect = scaled_sustain;
+        double scale = SAMPLE_MAX / peak;
+        for (size_t octave = 0; octave < WAVETABLE_N_OCTAVES; octave++) {
+            fpga_sum_wavetable(WAVETABLE_SQUARE + t, octave, sines, row);
+            Sample* table = fpga_wavetables[t * WAVETABLE_N_OCTAVES + octave];
+            for (size_t i = 0; i < WAVETABLE_SIZE; i++) table[i] = round(row[i] * scale);
+            table[WAVETABLE_SIZE] = table[0];
+        }
+    }
+}
+
+// which row of fpga_wavetables a note plays from, 0 for the other instruments
+static inline ushort fpga_wavetable_row(Instrument instrument, NoteIndex note_index) {
+    when ((uint)(instrument - WAVETABLE_SQUARE) < N_WAVETABLE_INSTRUMENTS) {
+        return (instrument - WAVETABLE_SQUARE) * WAVETABLE_N_OCTAVES + (note_index & (N_MIDI_KEYS-1)) / 12;
+    }
+    return 0;
+}
+
+// reads a row at a 32 bit fraction of a period, interpolating between the entries
+Sample fpga_wavetable_lookup(ushort wavetable, uint phase) {
+    const Sample* table = fpga_wavetables[wavetable];
+    uint index    = phase >> (32 - WAVETABLE_BITS);
+    int  fraction = (phase >> (32 - WAVETABLE_BITS - WAVETABLE_FRACTION_BITS)) & ((1 << WAVETABLE_FRACTION_BITS) - 1);
+    int  delta    = table[index + 1] - table[index];
+    return table[index] + ((delta * fraction + (1 << (WAVETABLE_FRACTION_BITS - 1))) >> WAVETABLE_FRACTION_BITS);
+}
+
+static void fpga_update_generator_wavelength(FPGA* fpga, FPGAGeneratorState* generator) {
+#if OSCILLATOR_DDS
+    generator->phase_increment = fpga_calculate_phase_increment(
+        generator->data.note_index,
+        fpga->global_state.pitchwheels[generator->data.channel_index]);
+#else
+    generator->wavelength = fpga_calculate_wavelength(
+        generator->data.note_index,
+        fpga->global_state.pitchwheels[generator->data.channel_index]);
+    generator->wavelength_reciprocal = ((1ull << 32) + generator->wavelength - 1) / generator->wavelength;
+#endif
+    generator->wavetable = fpga_wavetable_row(generator->data.instrument, generator->data.note_index);
+}
+
+// Fills in the lookup tables, which are shared by every FPGA context since they
+// never change. Must be called once before the first fpga_init()
+void fpga_init_roms() {
+    for (size_t note_index = 0; note_index < N_MIDI_KEYS; note_index++) {
+        fpga_note_freq_table[note_index] = fpga_note_index_to_freq(note_index);
+        fpga_note_phase_increment_table[note_index] = fpga_note_index_to_phase_increment(note_index);
     }
+    for (size_t i = 0; i <= SINE_LUT_SIZE; i++) {
+        fpga_sine_table[i] = round(SAMPLE_MAX * sin(PI / 2 * i / SINE_LUT_SIZE));
+    }
+    fpga_sine_table[SINE_LUT_SIZE + 1] = fpga_sine_table[SINE_LUT_SIZE];
+    fpga_fill_wavetables();
+}
+
+// Resets the registers of an FPGA and the cached ones which depend on the
+// lookup tables. Must be called before the first SPI packet is handled
+void fpga_init(FPGA* fpga) {
+    memset(fpga, 0, sizeof(FPGA));
+    fpga->next_wakeup = UINT64_MAX;
+    fpga_update_envelope_steps(fpga);
+    for (size_t generator_idx = 0; generator_idx < N_GENERATORS; generator_idx++) {
+        fpga_update_generator_wavelength(fpga, &fpga->generators[generator_idx]);
+        fpga_schedule_generator(fpga, generator_idx);
+    }
+}
+
+// the level comes from the envelope registers, stepped by fpga_step_envelope()
+Sample fpga_apply_envelope(Sample sample, FPGAGeneratorState* generator) {
+    ushort envelope_effect = generator->envelope_effect;
 
     when(generator->data.enabled) {
         // this is to know at which volume the release should begin at
@@ -456,15 +1483,82 @@ Sample fpga_apply_envelope(Sample sample, FPGAGeneratorState* generator) {
 
 
 // This represets the FPGA's SPI input handler
-void fpga_handle_spi_packet(const byte* data, size_t length) {
+// writes a MicrocontrollerGeneratorState received over SPI into a generator
+static void fpga_write_generator_state(FPGA* fpga, ushort generator_index, const byte* state, bool reset_note_lifetime) {
+    fpga_catch_up_generator(fpga, generator_index);
+
+    // write each byte into where they belong, this could perhaps be a bit more hardcoded on the FPGA on where the wires go
+    byte* generator_data_ptr = (byte*)&fpga->generators[generator_index].data;
+    for (size_t i = 0; i < sizeof(MicrocontrollerGeneratorState); i++) {
+        *(generator_data_ptr + i) = *(state + i);
+    }
+    fpga_update_generator_wavelength(fpga, &fpga->generators[generator_index]);
+
+    when (reset_note_lifetime) {
+        fpga->generators[generator_index].note_life = 0; // make sure this doesn't conflict with the incrmentation after generating a sample
+        fpga->generators[generator_index].wavelength_pos = 0;
+        fpga->generators[generator_index].phase = 0;
+    }
+    TRACE(EnvelopePhase phase = fpga->generators[generator_index].envelope_phase;)
+    TRACE(bool was_active = fpga->active_slot[generator_index];)
+    when (fpga->active_slot[generator_index]) {
+        fpga_load_envelope(fpga, &fpga->generators[generator_index]);
+    }
+    fpga_schedule_generator(fpga, generator_index); // which loads the envelope if it becomes active
+    TRACE(when (was_active) fpga_trace_envelope_phase(fpga, generator_index, phase, reset_note_lifetime, fpga->sample_count);)
+}
+
+void fpga_handle_spi_packet(FPGA* fpga, const byte* data, size_t length) {
     byte packet_type = data[0];
+    TRACE(trace_fpga_event(fpga->sample_count, TRACE_SPI_APPLY, TRACE_NO_GENERATOR, 0, 0, packet_type, length);)
 
     when(packet_type == 1) { // global_state update
         when(length >= 1 + sizeof(MicrocontrollerGlobalState)) {
 
+            sbyte old_pitchwheels[N_MIDI_CHANNELS];
+            memcpy(old_pitchwheels, fpga->global_state.pitchwheels, sizeof(old_pitchwheels));
+
+            Envelope old_envelope = fpga->global_state.envelope;
+
             // write each byte into where they belong, this could perhaps be a bit more hardcoded on the FPGA on where the wires go
             for (size_t i = 0; i < sizeof(MicrocontrollerGlobalState); i++) {
-                *(((byte*)&fpga_global_state) + i) = *(data + 1 + i);
+                *(((byte*)&fpga->global_state) + i) = *(data + 1 + i);
+            }
+
+            when (memcmp(&old_envelope, &fpga->global_state.envelope, sizeof(Envelope))) {
+                fpga_update_envelope_steps(fpga);
+                for (size_t i = 0; i < fpga->n_active_generators; i++) {
+                    TRACE(EnvelopePhase phase = fpga->generators[fpga->active_generators[i]].envelope_phase;)
+                    fpga_load_envelope(fpga, &fpga->generators[fpga->active_generators[i]]);
+                    TRACE(fpga_trace_envelope_phase(fpga, fpga->active_generators[i], phase, false, fpga->sample_count);)
+                }
+            }
+
+            // a longer release might bring finished notes back into their release stage
+            when (fpga->global_state.envelope.release != old_envelope.release) {
+                for (size_t generator_idx = 0; generator_idx < N_GENERATORS; generator_idx++) {
+                    when (!fpga->active_slot[generator_idx]) {
+                        fpga_catch_up_generator(fpga, generator_idx);
+                        fpga_schedule_generator(fpga, generator_idx);
+                    }
+                }
+            }
+
+            // only the generators playing on a channel with a moved pitchwheel need a new wavelength
+            ushort changed_channels = 0;
+            for (size_t channel = 0; channel < N_MIDI_CHANNELS; channel++) {
+                when (old_pitchwheels[channel] != fpga->global_state.pitchwheels[channel]) {
+                    changed_channels |= 1 << channel;
+                }
+            }
+            when (changed_channels) {
+                for (size_t generator_idx = 0; generator_idx < N_GENERATORS; generator_idx++) {
+                    FPGAGeneratorState* generator = &fpga->generators[generator_idx];
+                    when (generator->data.channel_index < N_MIDI_CHANNELS
+                    &&   (changed_channels >> generator->data.channel_index) & 1) {
+                        fpga_update_generator_wavelength(fpga, generator);
+                    }
+                }
             }
         }
     }
@@ -473,16 +1567,26 @@ void fpga_handle_spi_packet(const byte* data, size_t length) {
 
             ushort generator_index = *(ushort*)(data+1);
             bool reset_note_lifetime = (bool)data[3];
-
-            // write each byte into where they belong, this could perhaps be a bit more hardcoded on the FPGA on where the wires go
-            byte* generator_data_ptr = (byte*)&fpga_generators[generator_index].data;
-            for (size_t i = 0; i < sizeof(MicrocontrollerGeneratorState); i++) {
-                *(generator_data_ptr + i) = *(data + 2 + sizeof(ushort) + i);
-            }
-
-            when (reset_note_lifetime) {
-                fpga_generators[generator_index].note_life = 0; // make sure this doesn't conflict with the incrmentation after generating a sample
-                fpga_generators[generator_index].wavelength_pos = 0;
+            fpga_write_generator_state(fpga, generator_index, data + 2 + sizeof(ushort), reset_note_lifetime);
+        }
+    }
+    elsewhen (packet_type == 3) { // multi generator update
+        when (length >= 2 + sizeof(ushort) && length >= 2 + sizeof(ushort) + 2 * (size_t)data[3]) {
+
+            ushort      first_generator = *(ushort*)(data+1);
+            size_t      n_mask_bytes    = data[3];
+            const byte* update_mask     = data + 2 + sizeof(ushort);
+            const byte* reset_mask      = update_mask + n_mask_bytes;
+            const byte* record          = reset_mask  + n_mask_bytes;
+
+            for (size_t i = 0; i < 8 * n_mask_bytes; i++) {
+                when ((update_mask[i / 8] >> (i % 8)) & 1) {
+                    when (record + sizeof(MicrocontrollerGeneratorState) > data + length) break; // truncated
+                    when (first_generator + i < N_GENERATORS) {
+                        fpga_write_generator_state(fpga, first_generator + i, record, (reset_mask[i / 8] >> (i % 8)) & 1);
+                    }
+                    record += sizeof(MicrocontrollerGeneratorState);
+                }
             }
         }
     }
@@ -490,94 +1594,288 @@ void fpga_handle_spi_packet(const byte* data, size_t length) {
 }
 
 
-// this represents a single generator module, which there are N_GENERATORS of on the FPGA
-WSample fpga_generate_sample_from_generator(uint generator_index) {
-    FPGAGeneratorState* generator = &fpga_generators[generator_index]; // just a reference, not a copy
-
+// steps the note_life and wavelength_pos registers of a generator, returns
+// true when it is enabled or during it's envelope release stage
+static inline bool fpga_step_generator(FPGA* fpga, FPGAGeneratorState* generator) {
     // make sure this is only stepped up once per sample, meaning we might need
     // some kind of enable pin, because using multiple clock domains is a nightmare
     generator->note_life      += NOTE_LIFE_COEFF;
-    generator->wavelength_pos += NOTE_LIFE_COEFF;
-
-    // when enabled or during it's envelope release stage
-    when (generator->data.enabled || (generator->note_life / NOTE_LIFE_COEFF) < fpga_global_state.envelope.release) {
-        uint freq = fpga_note_index_to_freq(generator->data.note_index);
-
-        // old pitchwheel implementation
-        //float note_offset = 2.0 * ((float)(fpga_global_state.pitchwheels[generator->data.channel_index])) / 128.0;
-        //uint freq_coeff = round(pow(2.0, note_offset/12.0) * (1 << FREQ_SHIFT));
-        ///freq = ((unsigned long long)(freq) * freq_coeff) >> FREQ_SHIFT;
-
-        int magic_linear_scale  = ((int)((pow(2, 2.0/12.0) - pow(2.0, -2.0/12.0))*(1<<8)));
-        int magic_linear_offset = (1<<16);
-        uint freq_coeff
-            = fpga_global_state.pitchwheels[generator->data.channel_index]
-            * magic_linear_scale
-            + magic_linear_offset;
-        freq = ((unsigned long long)(freq) * freq_coeff) >> (16);
-
-        // this is not a LUT
-        uint wavelength = freq_to_wavelength_in_samples(freq);
-
-        // due to the way registers work, the chisel version requires the +1
-        // here, feel free to tweak the operator instead
-        when (generator->wavelength_pos/*+1*/ >= wavelength) {
-            // this replaces our modulo of note_life, but it also accounts for
-            // changing wavelengths due to it's accumulating nature.
-            // sin(2 * pi * f * t) would likely see a discontinuous edge if f changes
-            generator->wavelength_pos -= wavelength;
-        }
+    fpga_advance_oscillator(generator, 1);
+    fpga_step_envelope(fpga, generator);
 
-        Sample sample;
-        when (generator->data.instrument == SQUARE) {
-            //when (((generator->note_life * 2) / wavelength) % 2 == 1) {
-            when ((generator->wavelength_pos << 1) >= wavelength) {
-                sample = -SAMPLE_MAX;
-            } otherwise {
-                sample = SAMPLE_MAX;
-            }
-        }
-        elsewhen (generator->data.instrument == TRIANGLE) {
-            // if x has a wavelength of 4:
-            //     f(x) = abs((x+1) % 4 - 2) - 1
-            int half    = wavelength>>1;
-            int quarter = wavelength>>2;
-            int pos;
-            when (generator->wavelength_pos > half + quarter) {
-                pos = generator->wavelength_pos - half - quarter;
-            } otherwise {
-                pos = generator->wavelength_pos + quarter;
-            }
-            sample = (abs(pos - half) - quarter) * SAMPLE_MAX / quarter;
-        }
-        elsewhen (generator->data.instrument == SAWTOOTH) {
-            //sample = ((generator->note_life % wavelength) * 2 - wavelength) * SAMPLE_MAX  / wavelength;
-            sample = (generator->wavelength_pos * 2 - wavelength) * SAMPLE_MAX  / wavelength;
+    return generator->data.enabled || generator->envelope_phase == ENVELOPE_RELEASE;
+}
+
+// the waveforms of the wavelength_pos oscillator, from a position within the wavelength
+static inline __attribute__((always_inline))
+Sample fpga_wavelength_waveform(uint wavelength_pos, uint wavelength, uint wavelength_reciprocal, Instrument instrument, ushort wavetable) {
+    Sample sample = 0;
+    when (instrument == SQUARE) {
+        //when (((generator->note_life * 2) / wavelength) % 2 == 1) {
+        when ((wavelength_pos << 1) >= wavelength) {
+            sample = -SAMPLE_MAX;
+        } otherwise {
+            sample = SAMPLE_MAX;
         }
-        elsewhen (generator->data.instrument == SINE) {
-            // todo: convert float to integer
-            // sin(2*pi*x) should be a lookup-table, that ought to suffice
-            sample = round(SAMPLE_MAX * sin(2 * PI * generator->note_life / wavelength));
+    }
+    elsewhen (instrument == TRIANGLE) {
+        // if x has a wavelength of 4:
+        //     f(x) = abs((x+1) % 4 - 2) - 1
+        int half    = wavelength>>1;
+        int quarter = wavelength>>2;
+        int pos;
+        when (wavelength_pos > half + quarter) {
+            pos = wavelength_pos - half - quarter;
+        } otherwise {
+            pos = wavelength_pos + quarter;
         }
+        sample = (abs(pos - half) - quarter) * SAMPLE_MAX / quarter;
+    }
+    elsewhen (instrument == SAWTOOTH) {
+        //sample = ((generator->note_life % wavelength) * 2 - wavelength) * SAMPLE_MAX  / wavelength;
+        sample = (wavelength_pos * 2 - wavelength) * SAMPLE_MAX  / wavelength;
+    }
+    elsewhen (instrument == SINE) {
+        // a multiplier turns the position into a phase, no divider needed
+        sample = fpga_sine_lookup(wavelength_pos * wavelength_reciprocal);
+    }
+    elsewhen ((uint)(instrument - WAVETABLE_SQUARE) < N_WAVETABLE_INSTRUMENTS) { // the same phase reads any of them
+        sample = fpga_wavetable_lookup(wavetable, wavelength_pos * wavelength_reciprocal);
+    }
+    return sample;
+}
+
+// The waveforms of the phase accumulator oscillator (OSCILLATOR_DDS). They are
+// shaped from the bits of the phase, the only multiplications are by SAMPLE_MAX
+// which is a constant. They start and go the same way as the ones above
+static inline __attribute__((always_inline))
+Sample fpga_phase_waveform(uint phase, Instrument instrument, ushort wavetable) {
+    Sample sample = 0;
+    when (instrument == SQUARE) { // the top bit is which half of the period we are in
+        sample = (phase >> 31) ? -SAMPLE_MAX : SAMPLE_MAX;
+    }
+    elsewhen (instrument == TRIANGLE) {
+        // a quarter period ahead, then the upper half folded down by inverting it,
+        // which goes from 0 up to 2^31 and back over the period
+        uint shifted = phase + (1u << 30);
+        uint folded  = shifted ^ -(shifted >> 31);
+        sample = (((int)((1u << 30) - folded) >> 15) * SAMPLE_MAX) >> 15;
+    }
+    elsewhen (instrument == SAWTOOTH) { // the phase is the sawtooth already
+        sample = (((int)(phase >> 16) - 0x8000) * SAMPLE_MAX) >> 15;
+    }
+    elsewhen (instrument == SINE) {
+        sample = fpga_sine_lookup(phase);
+    }
+    elsewhen ((uint)(instrument - WAVETABLE_SQUARE) < N_WAVETABLE_INSTRUMENTS) {
+        sample = fpga_wavetable_lookup(wavetable, phase);
+    }
+    return sample;
+}
+
+// the output of a stepped generator which is active. The instrument is passed
+// separately so that the block renderer can decide it once per block
+static inline __attribute__((always_inline))
+WSample fpga_generator_output(FPGAGeneratorState* generator, Instrument instrument) {
+#if OSCILLATOR_DDS
+    Sample sample = fpga_phase_waveform(generator->phase, instrument, generator->wavetable); // the phase wraps around by itself
+#else
+    uint wavelength = generator->wavelength;
+
+    // due to the way registers work, the chisel version requires the +1
+    // here, feel free to tweak the operator instead
+    when (generator->wavelength_pos/*+1*/ >= wavelength) {
+        // this replaces our modulo of note_life, but it also accounts for
+        // changing wavelengths due to it's accumulating nature.
+        // sin(2 * pi * f * t) would likely see a discontinuous edge if f changes
+        generator->wavelength_pos -= wavelength;
+    }
+    Sample sample = fpga_wavelength_waveform(generator->wavelength_pos, wavelength, generator->wavelength_reciprocal, instrument, generator->wavetable);
+#endif
+
+    // this doesn't have to be a separate module, it can be inlined into the generator
+    return fpga_apply_envelope(sample, generator) * generator->data.velocity;// / VELOCITY_MAX;
+}
 
-        // this doesn't have to be a separate module, it can be inlined into the generator
-        return fpga_apply_envelope(sample, generator) * generator->data.velocity;// / VELOCITY_MAX;
+// this represents a single generator module, which there are N_GENERATORS of on the FPGA
+WSample fpga_generate_sample_from_generator(FPGA* fpga, uint generator_index) {
+    FPGAGeneratorState* generator = &fpga->generators[generator_index]; // just a reference, not a copy
+
+    TRACE(EnvelopePhase phase = generator->envelope_phase;)
+    bool active = fpga_step_generator(fpga, generator);
+    TRACE(fpga_trace_envelope_phase(fpga, generator_index, phase, false, fpga->sample_count);)
+    when (active) {
+        return fpga_generator_output(generator, generator->data.instrument);
     } otherwise {
         return 0;
     }
 }
 
 
+// the final mix of the adder, shared by the per-sample and the block renderer
+static inline WSample fpga_mix_generators(FPGA* fpga, WSample sum) {
+    STATS(int64_t mixed = (int64_t)(sum / VELOCITY_MAX) * fpga->global_state.master_volume;)
+    STATS(fpga->stats.n_clipped_samples += mixed > (INT32_MAX >> 4) || mixed < (INT32_MIN >> 4);)
+    return (sum / VELOCITY_MAX) * fpga->global_state.master_volume << 4; // 4 bits headroom
+}
+
 // This represents the 'adder' module, which combines the sound from all the generators
-WSample fpga_generate_sound_sample() { // is run once per sound sample
+WSample fpga_generate_sound_sample(FPGA* fpga) { // is run once per sound sample
     WSample out = 0;
+    fpga_begin_block(fpga, 1);
 
-    // this is trivial to do in parallel
-    for (size_t generator_idx = 0; generator_idx < N_GENERATORS; generator_idx++) {
-        out += fpga_generate_sample_from_generator(generator_idx);
+    // this is trivial to do in parallel. The idle generators would output 0
+    for (size_t i = 0; i < fpga->n_active_generators; i++) {
+        out += fpga_generate_sample_from_generator(fpga, fpga->active_generators[i]);
+    }
+
+    fpga_end_block(fpga, 1);
+    return fpga_mix_generators(fpga, out);
+}
+
+
+// The block renderer. This is not something the FPGA does, but it lets the
+// simulator render long songs quickly while staying bit-exact with calling
+// fpga_generate_sound_sample() once per sample. It is only valid as long as no
+// SPI packet arrives inside the block, so render up to the next event at most.
+
+#define FPGA_BLOCK_SIZE 1024 /* max samples accumulated in one go, the accumulator lives on the stack */
+
+// The kernels of the block renderer, one for every combination of instrument
+// and envelope phase. Each one renders a span of samples within which the phase
+// can't end and note_life can't wrap around, so neither is checked per sample:
+// the envelope steps by the rules of its phase alone, its carries and borrows
+// are added rather than branched on, and the waveform is fixed. A generator is
+// dispatched to a kernel once per block, and again only when its phase ends
+// within the block. The sample it ends on goes through fpga_step_generator().
+static inline __attribute__((always_inline))
+void fpga_render_span_as(const FPGA* fpga, FPGAGeneratorState* generator, WSample* acc, size_t n, Instrument instrument, EnvelopePhase phase) {
+    FPGAGeneratorState local = *generator; // the registers live in locals for the whole span
+    Envelope env = fpga->global_state.envelope;
+    const FPGAEnvelopeSteps* steps = &fpga->envelope_steps;
+
+    when (phase == ENVELOPE_DONE) { // silent, only the counters move
+        local.note_life += n * NOTE_LIFE_COEFF;
+        fpga_advance_oscillator(&local, n);
+        *generator = local;
+        return;
+    }
+    for (size_t i = 0; i < n; i++) {
+        local.note_life += NOTE_LIFE_COEFF;
+        fpga_advance_oscillator(&local, 1);
+        when (phase == ENVELOPE_ATTACK) {
+            uint remainder = local.envelope_remainder + steps->attack_step_remainder;
+            uint carry     = remainder >= env.attack;
+            local.envelope_effect   += steps->attack_step + carry;
+            local.envelope_remainder = remainder - (env.attack & -carry);
+        } elsewhen (phase == ENVELOPE_DECAY) {
+            uint borrow = local.envelope_remainder < steps->decay_step_remainder;
+            local.envelope_effect   -= steps->decay_step + borrow;
+            local.envelope_remainder = local.envelope_remainder - steps->decay_step_remainder + (env.decay & -borrow);
+        } elsewhen (phase == ENVELOPE_RELEASE) {
+            uint borrow = local.envelope_remainder < local.envelope_release_step_remainder;
+            local.envelope_effect   -= local.envelope_release_step + borrow;
+            local.envelope_remainder = local.envelope_remainder - local.envelope_release_step_remainder + (env.release & -borrow);
+        }
+        acc[i] += fpga_generator_output(&local, instrument);
     }
+    when (phase != ENVELOPE_SUSTAIN) local.envelope_counter -= n;
+    *generator = local;
+}
+
+typedef void (*FpgaSpanKernel)(const FPGA* fpga, FPGAGeneratorState* generator, WSample* acc, size_t n);
+
+#define FPGA_SPAN_KERNEL(instrument, phase) fpga_render_span_##instrument##_##phase
+#define FPGA_DEFINE_SPAN_KERNEL(instrument, phase) \
+    static void FPGA_SPAN_KERNEL(instrument, phase)(const FPGA* fpga, FPGAGeneratorState* generator, WSample* acc, size_t n) { \
+        fpga_render_span_as(fpga, generator, acc, n, instrument, phase); \
+    }
+#define FPGA_SPAN_KERNEL_ENTRY(instrument, phase) [instrument][phase] = FPGA_SPAN_KERNEL(instrument, phase),
+
+#define FPGA_FOR_EACH_PHASE(X, instrument) \
+    X(instrument, ENVELOPE_ATTACK) X(instrument, ENVELOPE_DECAY) X(instrument, ENVELOPE_SUSTAIN) X(instrument, ENVELOPE_RELEASE) X(instrument, ENVELOPE_DONE)
+// the wavetable instruments only differ in the row they read, so they share the kernels of WAVETABLE_SQUARE
+#define FPGA_FOR_EACH_SPAN_KERNEL(X) \
+    FPGA_FOR_EACH_PHASE(X, SQUARE) FPGA_FOR_EACH_PHASE(X, TRIANGLE) FPGA_FOR_EACH_PHASE(X, SAWTOOTH) \
+    FPGA_FOR_EACH_PHASE(X, SINE)   FPGA_FOR_EACH_PHASE(X, WAVETABLE_SQUARE)
+
+FPGA_FOR_EACH_SPAN_KERNEL(FPGA_DEFINE_SPAN_KERNEL)
 
-    return (out / VELOCITY_MAX) * fpga_global_state.master_volume << 4; // 4 bits headroom
+static const FpgaSpanKernel fpga_span_kernels[WAVETABLE_SQUARE + 1][ENVELOPE_DONE + 1] = {
+    FPGA_FOR_EACH_SPAN_KERNEL(FPGA_SPAN_KERNEL_ENTRY)
+};
+
+// the kernels of an instrument, indexed by the envelope phase. NULL for unknown instruments, which are stepped per sample
+static const FpgaSpanKernel* fpga_instrument_span_kernels(Instrument instrument) {
+    when (instrument <= SINE) return fpga_span_kernels[instrument];
+    elsewhen ((uint)(instrument - WAVETABLE_SQUARE) < N_WAVETABLE_INSTRUMENTS) return fpga_span_kernels[WAVETABLE_SQUARE];
+    otherwise return NULL;
+}
+
+// the number of samples up to n which a kernel can render, before the
+// envelope phase ends or note_life wraps around. 0 when the next sample
+// has to be stepped by fpga_step_generator()
+static size_t fpga_span_length(const FPGAGeneratorState* generator, size_t n) {
+    size_t until_wrap = (UINT32_MAX - generator->note_life) / NOTE_LIFE_COEFF;
+    when (until_wrap < n) n = until_wrap;
+
+    // an enabled generator is in its attack, decay or sustain, a disabled one
+    // in its release or done. fpga_load_envelope() sees to that
+    switch (generator->envelope_phase) {
+        break; case ENVELOPE_ATTACK: case ENVELOPE_DECAY:
+            when (!generator->data.enabled) return 0;
+            when (generator->envelope_counter - 1u < n) n = generator->envelope_counter - 1u; // the last one changes phase
+        break; case ENVELOPE_SUSTAIN:
+            when (!generator->data.enabled) return 0;
+        break; case ENVELOPE_RELEASE:
+            when (generator->data.enabled) return 0;
+            when (generator->envelope_counter - 1u < n) n = generator->envelope_counter - 1u;
+        break; case ENVELOPE_DONE:
+            when (generator->data.enabled) return 0;
+        break; default: return 0;
+    }
+    return n;
+}
+
+void fpga_accumulate_generator_block(FPGA* fpga, uint generator_index, WSample* acc, size_t n) {
+    FPGAGeneratorState* generator = &fpga->generators[generator_index];
+    const FpgaSpanKernel* kernels = fpga_instrument_span_kernels(generator->data.instrument);
+
+    size_t i = 0;
+    while (i < n) {
+        size_t len = (kernels) ? fpga_span_length(generator, n - i) : 0;
+        when (len) {
+            kernels[generator->envelope_phase](fpga, generator, acc + i, len);
+            i += len;
+        } otherwise { // the phase ends here, or note_life wraps around
+            TRACE(EnvelopePhase phase = generator->envelope_phase;)
+            when (fpga_step_generator(fpga, generator)) {
+                acc[i] += fpga_generator_output(generator, generator->data.instrument);
+            }
+            TRACE(fpga_trace_envelope_phase(fpga, generator_index, phase, false, fpga->sample_count + i);)
+            i++;
+        }
+    }
+}
+
+// renders n samples into out, equivalent to n calls to fpga_generate_sound_sample()
+void fpga_generate_sound_block(FPGA* fpga, WSample* out, size_t n) {
+    WSample acc[FPGA_BLOCK_SIZE];
+    while (n) {
+        size_t len = fpga_begin_block(fpga, (n < FPGA_BLOCK_SIZE) ? n : FPGA_BLOCK_SIZE);
+
+        memset(acc, 0, len * sizeof(WSample));
+        for (size_t i = 0; i < fpga->n_active_generators; i++) {
+            fpga_accumulate_generator_block(fpga, fpga->active_generators[i], acc, len);
+        }
+        for (size_t i = 0; i < len; i++) {
+            out[i] = fpga_mix_generators(fpga, acc[i]);
+        }
+        fpga_end_block(fpga, len);
+
+        out += len;
+        n   -= len;
+    }
 }
 
 
@@ -0,0 +1,147 @@
+// A work-stealing pool for rendering many songs at once in the simulator.
+//
+// Every song is simulated with its own microcontroller and FPGA context, so
+// the songs render in parallel without sharing anything but the flags and the
+// lookup tables of fpga_init_roms(), which are read-only by then. A job is a
+// whole song, and songs differ a lot in length, so splitting them evenly up
+// front leaves threads idle at the end. Instead every thread has a deque of
+// its own: it takes its jobs from the bottom, and when it runs dry it steals
+// from the top of the others. The jobs are dealt out by weight so the heavy
+// ones are at the bottoms and start first, which leaves the light ones at the
+// tops for the thieves to even things out with.
+//
+// A job is seconds of rendering, so a mutex per deque is plenty. No job adds
+// new ones, so a thread is done once every deque is empty.
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define BATCH_MAX_THREADS 256
+
+typedef void (*BatchJobFunction)(void* user, size_t job);
+
+typedef struct BatchDeque {
+    pthread_mutex_t lock;
+    size_t*         jobs;
+    size_t          top;     // thieves take from here
+    size_t          bottom;  // the owner takes from here, one past its next job
+} __attribute__((aligned(64))) BatchDeque;
+
+typedef struct BatchPool {
+    BatchDeque*      deques;
+    size_t           n_threads;
+    BatchJobFunction run;
+    void*            user;
+} BatchPool;
+
+typedef struct BatchWorker {
+    pthread_t  thread;
+    BatchPool* pool;
+    size_t     index;
+    size_t     n_stolen;
+} BatchWorker;
+
+typedef struct BatchStats {
+    size_t n_threads;
+    size_t n_stolen; // jobs run by another thread than the one they were dealt to
+} BatchStats;
+
+typedef struct BatchWeightedJob {
+    uint64_t weight;
+    size_t   job;
+} BatchWeightedJob;
+
+static int batch_compare_weights(const void* a, const void* b) {
+    const BatchWeightedJob* x = a;
+    const BatchWeightedJob* y = b;
+    if (x->weight != y->weight) return (x->weight < y->weight) ? 1 : -1; // heaviest first
+    return (x->job > y->job) - (x->job < y->job);
+}
+
+static bool batch_take(BatchDeque* deque, bool steal, size_t* job) {
+    pthread_mutex_lock(&deque->lock);
+    bool found = deque->top < deque->bottom;
+    if (found) *job = steal ? deque->jobs[deque->top++] : deque->jobs[--deque->bottom];
+    pthread_mutex_unlock(&deque->lock);
+    return found;
+}
+
+static void* batch_worker_main(void* arg) {
+    BatchWorker* worker = arg;
+    BatchPool*   pool   = worker->pool;
+    for (;;) {
+        size_t job;
+        bool   found = batch_take(&pool->deques[worker->index], false, &job);
+        for (size_t i = 1; i < pool->n_threads && !found; i++) { // the next ones first, so the thieves spread out
+            found = batch_take(&pool->deques[(worker->index + i) % pool->n_threads], true, &job);
+            worker->n_stolen += found;
+        }
+        if (!found) return NULL;
+        pool->run(pool->user, job);
+    }
+}
+
+
+// public interface:
+
+// runs run(user, job) for every job below n_jobs, on n_threads threads, or one
+// per cpu for 0. The weights are the expected cost of each job, heavier ones start
+// first. Returns false when the pool couldn't be started
+bool batch_render(size_t n_jobs, const uint64_t* weights, size_t n_threads, BatchJobFunction run, void* user, BatchStats* stats) {
+    if (!n_threads) {
+        long n_cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        n_threads = (n_cpus > 0) ? n_cpus : 1;
+    }
+    if (n_threads > BATCH_MAX_THREADS) n_threads = BATCH_MAX_THREADS;
+    if (n_threads > n_jobs)            n_threads = n_jobs ? n_jobs : 1;
+
+    BatchPool         pool    = {.n_threads = n_threads, .run = run, .user = user};
+    BatchWorker*      workers = calloc(n_threads, sizeof(BatchWorker));
+    BatchWeightedJob* order   = calloc(n_jobs ? n_jobs : 1, sizeof(BatchWeightedJob));
+    pool.deques = aligned_alloc(64, n_threads * sizeof(BatchDeque));
+    bool ok = workers && order && pool.deques;
+    for (size_t t = 0; ok && t < n_threads; t++) {
+        memset(&pool.deques[t], 0, sizeof(BatchDeque));
+        pthread_mutex_init(&pool.deques[t].lock, NULL);
+        ok = (pool.deques[t].jobs = malloc((n_jobs / n_threads + 1) * sizeof(size_t)));
+    }
+    if (!ok) {
+        fprintf(stderr, "error: unable to allocate the batch of %zu jobs\n", n_jobs);
+        exit(1);
+    }
+
+    // dealt out round robin, heaviest first. Each deque is then filled in from
+    // its lightest, so that its owner pops the heaviest off the bottom first
+    for (size_t i = 0; i < n_jobs; i++) order[i] = (BatchWeightedJob){weights ? weights[i] : 0, i};
+    qsort(order, n_jobs, sizeof(BatchWeightedJob), batch_compare_weights);
+    for (size_t i = n_jobs; i-- > 0;) {
+        BatchDeque* deque = &pool.deques[i % n_threads];
+        deque->jobs[deque->bottom++] = order[i].job;
+    }
+
+    // the calling thread is worker 0
+    for (size_t t = 0; t < n_threads; t++) {
+        workers[t].pool  = &pool;
+        workers[t].index = t;
+        if (t && pthread_create(&workers[t].thread, NULL, batch_worker_main, &workers[t])) {
+            fprintf(stderr, "error: unable to start batch thread %zu\n", t);
+            exit(1); // the jobs are dealt out, there is no going back
+        }
+    }
+    batch_worker_main(&workers[0]);
+
+    memset(stats, 0, sizeof(BatchStats));
+    stats->n_threads = n_threads;
+    for (size_t t = 0; t < n_threads; t++) {
+        if (t) pthread_join(workers[t].thread, NULL);
+        stats->n_stolen += workers[t].n_stolen;
+        pthread_mutex_destroy(&pool.deques[t].lock);
+        free(pool.deques[t].jobs);
+    }
+    free(pool.deques);
+    free(workers);
+    free(order);
+    return true;
+}
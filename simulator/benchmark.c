@@ -0,0 +1,266 @@
+// Rendering throughput benchmarks for the FPGA reference model.
+//
+// Micro benchmarks hold a number of notes on a fixed setup and time how long
+// the renderer takes for a stretch of audio, for every combination of:
+//   * instrument
+//   * polyphony, doubling from 1 up to N_GENERATORS
+//   * the envelope zeroed, or the one commented out in main.c
+//   * the pitchwheel of the channel left alone, or moved every
+//     BENCHMARK_PITCHWHEEL_INTERVAL samples like a player bending a note
+// Every case renders in chunks of BENCHMARK_PITCHWHEEL_INTERVAL samples, so
+// the pitchwheel cases only differ in the events handled in between.
+//
+// Macro benchmarks play the bundled midi files through the microcontroller,
+// the same way main.c does, timing the event handling and the rendering.
+//
+// The best of a few repetitions is kept, being the least disturbed by the rest
+// of the machine. Results are written as JSON to stdout, to be kept around and
+// compared between commits, with a readable table on stderr.
+//
+// Build and run from this directory with:
+//     gcc benchmark.c -O2 -lm -lpthread -o benchmark.out && ./benchmark.out > results.json
+// or through simulator.py benchmark
+
+#define _GNU_SOURCE
+#include "../reference_implementation.c"
+#include "midi_file.c"
+#include "simd_render.c"
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <time.h>
+
+#define BENCHMARK_PITCHWHEEL_INTERVAL 256
+#define BENCHMARK_RELEASE_SAMPLES     (SAMPLE_RATE / 4) // longer than any release used here
+
+static const char* benchmark_instrument_names[] = {"square", "triangle", "sawtooth", "sine", "wavetable-square", "wavetable-triangle", "wavetable-sawtooth"};
+static const char* benchmark_songs[] = {"Clock Town.mid", "Led_Zeppelin_-_Stairway_to_Heaven.mid"};
+
+typedef struct BenchmarkResult {
+	uint64_t n_samples;
+	uint64_t n_voice_samples; // the sum of the sounding voices over every sample
+	double   seconds;
+} BenchmarkResult;
+
+const SimdRenderer* renderer = NULL;
+bool first_result            = true;
+Microcontroller mcu;
+FPGA fpga;
+
+
+// hook the two parts of the reference implementation together:
+static void benchmark_send_spi_packet(void* user, const byte* data, size_t length) {
+	fpga_handle_spi_packet(&fpga, data, length);
+}
+
+bool microcontroller_poll_pcb_button_state(uint button_id) {
+	return false;
+}
+
+
+static double benchmark_now() {
+	struct timespec t;
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	return t.tv_sec + t.tv_nsec * 1e-9;
+}
+
+static void benchmark_midi_event(byte status, byte data1, byte data2) {
+	const byte data[3] = {status, data1, data2};
+	microcontroller_handle_midi_event(&mcu, data, 3);
+	microcontroller_flush_generator_updates(&mcu);
+}
+
+// the voices are spread over the keys and channels, avoiding the drum channel
+static void benchmark_voice(size_t voice, byte* channel, byte* key) {
+	*key     = 36 + voice % 48;
+	*channel = voice / 48 % (N_MIDI_CHANNELS - 1);
+	if (*channel >= 9) (*channel)++;
+}
+
+static void benchmark_render(size_t n, BenchmarkResult* result) {
+	static WSample block[FPGA_BLOCK_SIZE];
+	while (n) {
+		size_t len = (n < FPGA_BLOCK_SIZE) ? n : FPGA_BLOCK_SIZE;
+		renderer->render(&fpga, block, len);
+		n -= len;
+		if (result) {
+			result->n_samples       += len;
+			result->n_voice_samples += len * fpga.n_active_generators;
+		}
+	}
+}
+
+static void benchmark_set_envelope(bool enabled) {
+	Envelope* env = &mcu.global_generator_state.envelope;
+	env->attack  = enabled ? 0.025 * SAMPLE_RATE : 0;
+	env->decay   = enabled ? 0.025 * SAMPLE_RATE : 0;
+	env->sustain = enabled ? 0.6 * 0xff : 0x7f;
+	env->release = enabled ? 0.05 * SAMPLE_RATE : 0;
+	microcontroller_send_global_state_update(&mcu);
+}
+
+static BenchmarkResult benchmark_notes(Instrument instrument, size_t polyphony, bool envelope, bool pitchwheel, size_t n_samples) {
+	BenchmarkResult result = {0};
+	for (size_t i = 0; i < N_GENERATORS; i++) mcu.generator_states[i].instrument = instrument;
+	benchmark_set_envelope(envelope);
+	for (size_t voice = 0; voice < polyphony; voice++) {
+		byte channel, key;
+		benchmark_voice(voice, &channel, &key);
+		benchmark_midi_event(0x90 | channel, key, 100);
+	}
+
+	double start = benchmark_now();
+	for (size_t i = 0; i < n_samples; i += BENCHMARK_PITCHWHEEL_INTERVAL) {
+		if (pitchwheel) { // a slow triangle sweep across the whole range
+			uint phase = (i / BENCHMARK_PITCHWHEEL_INTERVAL * 128) % 0x8000;
+			uint bend  = (phase < 0x4000) ? phase : 0x7FFF - phase;
+			for (size_t channel = 0; channel < N_MIDI_CHANNELS; channel++) {
+				if (channel != 9) benchmark_midi_event(0xE0 | channel, bend & 0x7F, bend >> 7);
+			}
+		}
+		size_t len = (n_samples - i < BENCHMARK_PITCHWHEEL_INTERVAL) ? n_samples - i : BENCHMARK_PITCHWHEEL_INTERVAL;
+		benchmark_render(len, &result);
+	}
+	result.seconds = benchmark_now() - start;
+
+	// leave the generators silent and the wheels centered for the next case
+	for (size_t voice = 0; voice < polyphony; voice++) {
+		byte channel, key;
+		benchmark_voice(voice, &channel, &key);
+		benchmark_midi_event(0x80 | channel, key, 0);
+	}
+	for (size_t channel = 0; channel < N_MIDI_CHANNELS; channel++) {
+		if (pitchwheel && channel != 9) benchmark_midi_event(0xE0 | channel, 0x00, 0x40);
+	}
+	benchmark_render(BENCHMARK_RELEASE_SAMPLES, NULL);
+	return result;
+}
+
+static bool benchmark_song(const char* path, BenchmarkResult* result) {
+	MidiFile file;
+	if (!midi_file_open(&file, path)) return false;
+	for (size_t i = 0; i < N_GENERATORS; i++) mcu.generator_states[i].instrument = SQUARE;
+	benchmark_set_envelope(false);
+
+	double start = benchmark_now();
+	MidiFileEvent event;
+	uint64_t n_samples = 0;
+	while (midi_file_next_event(&file, &event)) {
+		if (event.sample > n_samples) {
+			microcontroller_flush_generator_updates(&mcu);
+			benchmark_render(event.sample - n_samples, result);
+			n_samples = event.sample;
+		}
+		if (event.is_midi) microcontroller_handle_midi_event(&mcu, event.data, event.length);
+	}
+	microcontroller_flush_generator_updates(&mcu);
+	result->seconds = benchmark_now() - start;
+	midi_file_close(&file);
+
+	// let whatever is still held go
+	for (size_t channel = 0; channel < N_MIDI_CHANNELS; channel++) {
+		for (size_t key = 0; key < N_MIDI_KEYS; key++) {
+			while (mcu.note_generators[channel][key]) benchmark_midi_event(0x80 | channel, key, 0);
+		}
+		benchmark_midi_event(0xE0 | channel, 0x00, 0x40);
+	}
+	benchmark_render(BENCHMARK_RELEASE_SAMPLES, NULL);
+	return true;
+}
+
+static void benchmark_report(const char* name, const char* parameters, BenchmarkResult* result) {
+	double samples_per_second  = result->n_samples / result->seconds;
+	double ns_per_voice_sample = result->n_voice_samples ? result->seconds * 1e9 / result->n_voice_samples : 0;
+	double realtime            = samples_per_second / SAMPLE_RATE;
+
+	printf("%s\n\t\t{\"name\": \"%s\", %s, \"samples\": %llu, \"voice_samples\": %llu, \"seconds\": %.6f, "
+		"\"samples_per_second\": %.0f, \"ns_per_voice_sample\": %.3f, \"realtime\": %.2f}",
+		first_result ? "" : ",", name, parameters,
+		(unsigned long long)result->n_samples, (unsigned long long)result->n_voice_samples, result->seconds,
+		samples_per_second, ns_per_voice_sample, realtime);
+	fflush(stdout);
+	fprintf(stderr, "%-52s %14.0f %12.3f %10.1fx\n", name, samples_per_second, ns_per_voice_sample, realtime);
+	first_result = false;
+}
+
+
+int main(int argc, char const *argv[]) {
+	const char* renderer_name = "auto";
+	double      seconds       = 2.0; // of audio per micro benchmark
+	size_t      n_repeats     = 3;
+	bool        run_micro     = true;
+	bool        run_macro     = true;
+	for (size_t i = 1; i < argc; i++) {
+		/**/ if (!strcmp(argv[i], "-k") && i+1 < argc) renderer_name = argv[++i];
+		else if (!strcmp(argv[i], "-t") && i+1 < argc) seconds       = atof(argv[++i]);
+		else if (!strcmp(argv[i], "-r") && i+1 < argc) n_repeats     = atoi(argv[++i]);
+		else if (!strcmp(argv[i], "-M"))               run_macro     = false;
+		else if (!strcmp(argv[i], "-S"))               run_micro     = false;
+		else {
+			fprintf(stderr, "usage: %s [-k renderer] [-t seconds of audio per case] [-r repetitions] [-M no macro benchmarks] [-S no micro benchmarks]\n", argv[0]);
+			return 1;
+		}
+	}
+	renderer = simd_select_renderer(renderer_name);
+	if (!renderer) {
+		fprintf(stderr, "error: renderer '%s' is unknown or not supported by this cpu\n", renderer_name);
+		return 1;
+	}
+	if (n_repeats < 1) n_repeats = 1;
+
+	fpga_init_roms();
+	fpga_init(&fpga);
+	microcontroller_init(&mcu, benchmark_send_spi_packet, NULL);
+	mcu.global_generator_state.master_volume = 0xFF >> 1;
+	microcontroller_send_global_state_update(&mcu);
+
+	printf("{\n\t\"renderer\": \"%s\",\n", renderer->name);
+	printf("\t\"config\": {\"SAMPLE_RATE\": %d, \"N_GENERATORS\": %d, \"FPGA_BLOCK_SIZE\": %d, \"SINE_LUT_BITS\": %d, \"SINE_LUT_INTERPOLATE\": %d},\n",
+		SAMPLE_RATE, N_GENERATORS, FPGA_BLOCK_SIZE, SINE_LUT_BITS, SINE_LUT_INTERPOLATE);
+	printf("\t\"results\": [");
+	fprintf(stderr, "renderer %s, best of %zu\n", renderer->name, n_repeats);
+	fprintf(stderr, "%-52s %14s %12s %11s\n", "benchmark", "samples/s", "ns/voice", "realtime");
+
+	size_t n_samples = seconds * SAMPLE_RATE;
+	for (Instrument instrument = 0; instrument < sizeof(benchmark_instrument_names) / sizeof(*benchmark_instrument_names) && run_micro; instrument++) {
+		for (size_t polyphony = 1;; polyphony = (polyphony * 2 < N_GENERATORS) ? polyphony * 2 : N_GENERATORS) {
+			for (byte flags = 0; flags < 4; flags++) {
+				bool envelope   = flags & 1;
+				bool pitchwheel = flags & 2;
+				BenchmarkResult result = {0};
+				for (size_t repeat = 0; repeat < n_repeats; repeat++) {
+					BenchmarkResult attempt = benchmark_notes(instrument, polyphony, envelope, pitchwheel, n_samples);
+					if (!repeat || attempt.seconds < result.seconds) result = attempt;
+				}
+
+				char name[64], parameters[160];
+				snprintf(name, sizeof(name), "%s/%zu%s%s", benchmark_instrument_names[instrument], polyphony,
+					envelope ? "/envelope" : "", pitchwheel ? "/pitchwheel" : "");
+				snprintf(parameters, sizeof(parameters),
+					"\"instrument\": \"%s\", \"polyphony\": %zu, \"envelope\": %s, \"pitchwheel\": %s",
+					benchmark_instrument_names[instrument], polyphony, envelope ? "true" : "false", pitchwheel ? "true" : "false");
+				benchmark_report(name, parameters, &result);
+			}
+			if (polyphony == N_GENERATORS) break;
+		}
+	}
+
+	bool ok = true;
+	for (size_t song = 0; song < sizeof(benchmark_songs) / sizeof(*benchmark_songs) && run_macro; song++) {
+		BenchmarkResult result = {0};
+		for (size_t repeat = 0; repeat < n_repeats && ok; repeat++) {
+			BenchmarkResult attempt = {0};
+			ok = benchmark_song(benchmark_songs[song], &attempt);
+			if (ok && (!repeat || attempt.seconds < result.seconds)) result = attempt;
+		}
+		if (!ok) {
+			fprintf(stderr, "error: unable to play '%s', run this from the simulator directory\n", benchmark_songs[song]);
+			break;
+		}
+		char parameters[160];
+		snprintf(parameters, sizeof(parameters), "\"song\": \"%s\"", benchmark_songs[song]);
+		benchmark_report(benchmark_songs[song], parameters, &result);
+	}
+	printf("\n\t]\n}\n");
+	return ok ? 0 : 1;
+}
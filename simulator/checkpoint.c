@@ -0,0 +1,174 @@
+// Checkpoints of the complete engine state, for seeking into a song and for
+// rendering it in parallel.
+//
+// All of the state of the microcontroller and the FPGA lives in their context
+// structs, and a snapshot is a copy of both. The ROMs filled in by
+// fpga_init_roms() are shared and never change, so they are left out. The SPI
+// callback of the microcontroller is not part of the state, the one it has
+// when restoring is kept.
+//
+// While a song renders from the start, a checkpoint is taken every interval
+// samples and appended to the checkpoint file, together with the number of
+// events of the midi file handled by then. The checkpoint of sample n is the
+// state after n samples were rendered, before the events due at sample n are
+// handled. Restoring it and skipping that many events continues the song
+// exactly where it was, since the renderers are bit-exact however a span of
+// samples is split up.
+//
+// The file is a CheckpointHeader followed by CheckpointRecords of a fixed size,
+// the one of sample n being record n / interval. The snapshots are the raw
+// structs, which only mean something to a simulator built with the same
+// configuration. The header records enough of it to refuse the others.
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#define CHECKPOINT_MAGIC   "SYNTHCKP"
+#define CHECKPOINT_VERSION 2
+
+typedef struct EngineSnapshot {
+	Microcontroller mcu;
+	FPGA            fpga;
+} EngineSnapshot;
+
+typedef struct CheckpointHeader {
+	char     magic[8];
+	uint32_t version;
+	uint32_t record_size;      // changes with N_GENERATORS and the layout of the state
+	uint32_t n_generators;
+	uint32_t sample_rate;
+	uint32_t oscillator_dds;
+	uint32_t voice_policy;     // the flags which change how the song plays
+	uint32_t coalesce;
+	uint32_t reserved;
+	uint64_t interval;         // samples between the checkpoints
+} CheckpointHeader;
+
+typedef struct CheckpointRecord {
+	uint64_t       sample;
+	uint64_t       n_events;   // midi file events handled before it
+	EngineSnapshot state;
+} CheckpointRecord;
+
+typedef struct CheckpointFile {
+	int              fd;
+	CheckpointHeader header;
+	size_t           n_checkpoints;
+	bool             ok;
+} CheckpointFile;
+
+
+static CheckpointHeader checkpoint_expected_header(const Microcontroller* mcu, uint64_t interval) {
+	CheckpointHeader header = {
+		.version        = CHECKPOINT_VERSION,
+		.record_size    = sizeof(CheckpointRecord),
+		.n_generators   = N_GENERATORS,
+		.sample_rate    = SAMPLE_RATE,
+		.oscillator_dds = OSCILLATOR_DDS,
+		.voice_policy   = mcu->voice_policy,
+		.coalesce       = mcu->coalesce_generator_updates,
+		.interval       = interval,
+	};
+	memcpy(header.magic, CHECKPOINT_MAGIC, sizeof(header.magic));
+	return header;
+}
+
+
+// public interface:
+
+void checkpoint_snapshot(EngineSnapshot* snapshot, const Microcontroller* mcu, const FPGA* fpga) {
+	snapshot->mcu  = *mcu;
+	snapshot->fpga = *fpga;
+	snapshot->mcu.send_spi_packet = NULL; // pointers don't mean anything in the file
+	snapshot->mcu.spi_user        = NULL;
+}
+
+void checkpoint_restore(const EngineSnapshot* snapshot, Microcontroller* mcu, FPGA* fpga) {
+	SpiPacketFunction send_spi_packet = mcu->send_spi_packet;
+	void*             spi_user        = mcu->spi_user;
+	*mcu  = snapshot->mcu;
+	*fpga = snapshot->fpga;
+	mcu->send_spi_packet = send_spi_packet;
+	mcu->spi_user        = spi_user;
+}
+
+// creates a checkpoint file, to be filled in every interval samples
+bool checkpoint_create(CheckpointFile* file, const char* path, const Microcontroller* mcu, uint64_t interval) {
+	memset(file, 0, sizeof(CheckpointFile));
+	file->header = checkpoint_expected_header(mcu, interval);
+	file->fd     = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	file->ok     = file->fd >= 0 && write(file->fd, &file->header, sizeof(CheckpointHeader)) == sizeof(CheckpointHeader);
+	if (!file->ok) fprintf(stderr, "error: unable to write the checkpoints to '%s'\n", path);
+	return file->ok;
+}
+
+// appends a checkpoint of the current state
+bool checkpoint_append(CheckpointFile* file, const Microcontroller* mcu, const FPGA* fpga, uint64_t sample, uint64_t n_events) {
+	CheckpointRecord* record = malloc(sizeof(CheckpointRecord));
+	if (!record) return file->ok = false;
+	memset(record, 0, sizeof(CheckpointRecord)); // no uninitialized padding in the file
+	record->sample   = sample;
+	record->n_events = n_events;
+	checkpoint_snapshot(&record->state, mcu, fpga);
+	if (write(file->fd, record, sizeof(CheckpointRecord)) != sizeof(CheckpointRecord)) {
+		perror("error: unable to write a checkpoint");
+		file->ok = false;
+	}
+	file->n_checkpoints++;
+	free(record);
+	return file->ok;
+}
+
+// opens a checkpoint file written by a simulator with the same configuration and flags
+bool checkpoint_open(CheckpointFile* file, const char* path, const Microcontroller* mcu) {
+	memset(file, 0, sizeof(CheckpointFile));
+	file->fd = open(path, O_RDONLY);
+	struct stat st;
+	if (file->fd < 0 || fstat(file->fd, &st) < 0) {
+		fprintf(stderr, "error: unable to open '%s'\n", path);
+		return false;
+	}
+	CheckpointHeader expected = checkpoint_expected_header(mcu, 0);
+	if (pread(file->fd, &file->header, sizeof(CheckpointHeader), 0) != sizeof(CheckpointHeader)
+	|| memcmp(&file->header, &expected, offsetof(CheckpointHeader, interval))
+	|| !file->header.interval) {
+		fprintf(stderr, "error: '%s' was not checkpointed by this build of the simulator with these flags\n", path);
+		close(file->fd);
+		return false;
+	}
+	file->n_checkpoints = (st.st_size - sizeof(CheckpointHeader)) / sizeof(CheckpointRecord);
+	file->ok = file->n_checkpoints > 0;
+	if (!file->ok) {
+		fprintf(stderr, "error: '%s' has no checkpoints\n", path);
+		close(file->fd);
+	}
+	return file->ok;
+}
+
+// the index of the last checkpoint at or before the given sample
+size_t checkpoint_find(const CheckpointFile* file, uint64_t sample) {
+	uint64_t index = sample / file->header.interval;
+	return (index < file->n_checkpoints) ? index : file->n_checkpoints - 1;
+}
+
+bool checkpoint_read(const CheckpointFile* file, size_t index, CheckpointRecord* record) {
+	off_t offset = sizeof(CheckpointHeader) + (off_t)index * sizeof(CheckpointRecord);
+	if (index >= file->n_checkpoints || pread(file->fd, record, sizeof(CheckpointRecord), offset) != sizeof(CheckpointRecord)) {
+		fprintf(stderr, "error: unable to read checkpoint %zu\n", index);
+		return false;
+	}
+	return true;
+}
+
+bool checkpoint_close(CheckpointFile* file) {
+	if (file->fd >= 0 && close(file->fd) < 0) file->ok = false;
+	file->fd = -1;
+	return file->ok;
+}
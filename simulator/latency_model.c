@@ -0,0 +1,231 @@
+// A timing model of the path from a MIDI event to the sound, for the simulator.
+//
+// Normally the simulator applies every SPI packet the moment a MIDI event is
+// handled. This instead models the two serial links in between:
+//   * the MIDI UART, which is the line of uart_input.c. The bytes of an event
+//     queue up behind each other there, and it tells when the last one arrives
+//   * the SPI bus at a given clock, 8 bits per byte, packets queueing up
+//     behind each other the same way
+// The microcontroller handles an event once its last byte has arrived, and
+// sends its packets right away. With -u the event gets there through the byte
+// parser and the receive ring, otherwise it is handed over whole. The FPGA
+// applies a packet at the first sample tick after its last byte is clocked in.
+// Packet application is delayed in the simulation accordingly, so the rendered
+// audio has the latency in it too.
+//
+// The latency of an event is measured from when the MIDI file says the status
+// byte should go out, to the first output sample affected by its first SPI
+// packet. With coalescing (-B), the first packet flushed at the end of a tick
+// counts for every event of that tick which queued a generator update.
+//
+// Time is kept in nanoseconds, like in uart_input.c.
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define LATENCY_N_EVENT_TYPES      8    // status >> 4, minus the high bit
+#define LATENCY_N_BUCKETS          10   // histogram buckets of <1, <2, <4 ... ms
+
+typedef struct LatencyPacket {
+	uint64_t apply_sample;
+	size_t   length;
+	byte*    data;
+} LatencyPacket;
+
+typedef struct LatencyEvent {
+	uint64_t sample;
+	byte     type;
+} LatencyEvent;
+
+typedef struct LatencySeries { // the latencies of one event type, in samples
+	uint64_t* samples;
+	size_t    len;
+	size_t    capacity;
+} LatencySeries;
+
+typedef struct LatencyModel {
+	uint64_t       spi_hz;
+	uint64_t       spi_free_ns;        // when the SPI bus is done sending what it has
+	uint64_t       now_ns;             // when the microcontroller handles what it is handling
+
+	// the packets in flight, applied in order since they share a bus
+	LatencyPacket* packets;
+	size_t         packets_head;
+	size_t         packets_len;
+	size_t         packets_capacity;
+
+	// the events waiting for their first packet
+	LatencyEvent   event;              // the one being handled, sample is UINT64_MAX outside of a handler
+	bool           event_sent;
+	LatencyEvent*  unsent;             // events of this tick which queued their updates
+	size_t         unsent_len;
+	size_t         unsent_capacity;
+
+	LatencySeries  series[LATENCY_N_EVENT_TYPES];
+} LatencyModel;
+
+static LatencyModel latency_model;
+
+static const char* latency_event_type_names[LATENCY_N_EVENT_TYPES] = {
+	"note-off", "note-on", "aftertouch", "control", "program", "pressure", "pitchbend", "system",
+};
+
+
+static void* latency_grow(void* array, size_t* capacity, size_t element_size) {
+	*capacity = *capacity ? *capacity * 2 : 256;
+	void* grown = realloc(array, *capacity * element_size);
+	if (!grown) {
+		fprintf(stderr, "error: out of memory in the latency model\n");
+		exit(1);
+	}
+	return grown;
+}
+
+static void latency_record(byte type, uint64_t event_sample, uint64_t apply_sample) {
+	LatencySeries* series = &latency_model.series[type];
+	if (series->len == series->capacity) series->samples = latency_grow(series->samples, &series->capacity, sizeof(uint64_t));
+	series->samples[series->len++] = apply_sample - event_sample;
+}
+
+static int latency_compare(const void* a, const void* b) {
+	uint64_t x = *(const uint64_t*)a, y = *(const uint64_t*)b;
+	return (x > y) - (x < y);
+}
+
+
+// public interface:
+
+void latency_model_init(uint64_t spi_hz) {
+	memset(&latency_model, 0, sizeof(LatencyModel));
+	latency_model.spi_hz       = spi_hz;
+	latency_model.event.sample = UINT64_MAX;
+}
+
+// to be called before the microcontroller handles a midi event due at the given sample,
+// arrive_ns being when its last byte arrived over the uart
+void latency_model_begin_midi_event(uint64_t sample, uint64_t arrive_ns, const byte* data, size_t length) {
+	LatencyModel* model = &latency_model;
+	model->now_ns       = arrive_ns;
+	model->event.sample = sample;
+	model->event.type   = (data[0] >> 4) & (LATENCY_N_EVENT_TYPES - 1);
+	if ((data[0] >> 4) == 0x9 && length == 3 && data[2] == 0) model->event.type = 0; // a note-off in disguise
+	model->event_sent   = false;
+}
+
+// queued is whether the event queued a generator update, to be sent when the tick ends
+void latency_model_end_midi_event(bool queued) {
+	LatencyModel* model = &latency_model;
+	if (!model->event_sent && queued) {
+		if (model->unsent_len == model->unsent_capacity) model->unsent = latency_grow(model->unsent, &model->unsent_capacity, sizeof(LatencyEvent));
+		model->unsent[model->unsent_len++] = model->event;
+	}
+	model->event.sample = UINT64_MAX;
+}
+
+// to be called when the sample tick advances, after the coalesced packets are flushed
+void latency_model_end_tick() {
+	latency_model.unsent_len = 0; // the flush didn't send anything for them
+}
+
+// puts a packet on the SPI bus, instead of handing it to the FPGA
+void latency_model_send_spi_packet(const byte* data, size_t length) {
+	LatencyModel* model = &latency_model;
+	uint64_t      start = (model->now_ns > model->spi_free_ns) ? model->now_ns : model->spi_free_ns;
+	model->spi_free_ns  = start + (length * 8 * UART_INPUT_NS_PER_SECOND + model->spi_hz - 1) / model->spi_hz;
+
+	if (model->packets_head + model->packets_len == model->packets_capacity) {
+		if (model->packets_head) { // compact before growing
+			memmove(model->packets, model->packets + model->packets_head, model->packets_len * sizeof(LatencyPacket));
+			model->packets_head = 0;
+		} else {
+			model->packets = latency_grow(model->packets, &model->packets_capacity, sizeof(LatencyPacket));
+		}
+	}
+	LatencyPacket* packet = &model->packets[model->packets_head + model->packets_len++];
+	packet->apply_sample  = uart_input_ns_to_next_sample(model->spi_free_ns);
+	packet->length        = length;
+	packet->data          = malloc(length);
+	memcpy(packet->data, data, length);
+
+	// the queued updates go out with the first packet, also when an event flushes them
+	// before its own, like a pitch bend does with the global state update
+	for (size_t i = 0; i < model->unsent_len; i++) {
+		latency_record(model->unsent[i].type, model->unsent[i].sample, packet->apply_sample);
+	}
+	model->unsent_len = 0;
+	if (model->event.sample != UINT64_MAX) {
+		if (!model->event_sent) latency_record(model->event.type, model->event.sample, packet->apply_sample);
+		model->event_sent = true;
+	}
+}
+
+// the sample at which the next packet in flight is due, UINT64_MAX if there is none
+uint64_t latency_model_next_apply_sample() {
+	if (!latency_model.packets_len) return UINT64_MAX;
+	return latency_model.packets[latency_model.packets_head].apply_sample;
+}
+
+// the sample at which the last packet in flight is due, 0 if there is none
+uint64_t latency_model_last_apply_sample() {
+	if (!latency_model.packets_len) return 0;
+	return latency_model.packets[latency_model.packets_head + latency_model.packets_len - 1].apply_sample;
+}
+
+// hands the packets due at or before the given sample to the FPGA
+void latency_model_apply_due_packets(FPGA* fpga, uint64_t sample) {
+	LatencyModel* model = &latency_model;
+	while (model->packets_len && model->packets[model->packets_head].apply_sample <= sample) {
+		LatencyPacket* packet = &model->packets[model->packets_head++];
+		model->packets_len--;
+		fpga_handle_spi_packet(fpga, packet->data, packet->length);
+		free(packet->data);
+	}
+	if (!model->packets_len) model->packets_head = 0;
+}
+
+void latency_model_print_report() {
+	LatencyModel* model = &latency_model;
+	fprintf(stderr, "latency from midi status byte to the first affected sample, uart %d baud, spi %llu Hz:\n",
+		UART_INPUT_BAUD, (unsigned long long)model->spi_hz);
+	fprintf(stderr, "  %-10s %8s %10s %10s %10s   histogram in ms:", "event", "count", "p50 ms", "p99 ms", "max ms");
+	for (size_t b = 0; b < LATENCY_N_BUCKETS; b++) {
+		char label[16];
+		snprintf(label, sizeof(label), (b < LATENCY_N_BUCKETS - 1) ? "<%d" : ">=%d", 1 << (b < LATENCY_N_BUCKETS - 1 ? b : b - 1));
+		fprintf(stderr, " %7s", label);
+	}
+	fprintf(stderr, "\n");
+
+	for (size_t type = 0; type < LATENCY_N_EVENT_TYPES; type++) {
+		LatencySeries* series = &model->series[type];
+		if (!series->len) continue;
+		qsort(series->samples, series->len, sizeof(uint64_t), latency_compare);
+
+		size_t buckets[LATENCY_N_BUCKETS] = {0};
+		for (size_t i = 0; i < series->len; i++) {
+			double ms = series->samples[i] * 1000.0 / SAMPLE_RATE;
+			size_t b  = 0;
+			while (b < LATENCY_N_BUCKETS - 1 && ms >= (1 << b)) b++;
+			buckets[b]++;
+		}
+
+		#define LATENCY_PERCENTILE_MS(p) (series->samples[(series->len - 1) * (p) / 100] * 1000.0 / SAMPLE_RATE)
+		fprintf(stderr, "  %-10s %8zu %10.3f %10.3f %10.3f %18s", latency_event_type_names[type], series->len,
+			LATENCY_PERCENTILE_MS(50), LATENCY_PERCENTILE_MS(99), LATENCY_PERCENTILE_MS(100), "");
+		#undef LATENCY_PERCENTILE_MS
+		for (size_t b = 0; b < LATENCY_N_BUCKETS; b++) fprintf(stderr, " %7zu", buckets[b]);
+		fprintf(stderr, "\n");
+	}
+}
+
+// frees the packets which never made it across, when the render stopped before they were due
+void latency_model_close() {
+	LatencyModel* model = &latency_model;
+	for (size_t i = 0; i < model->packets_len; i++) free(model->packets[model->packets_head + i].data);
+	for (size_t type = 0; type < LATENCY_N_EVENT_TYPES; type++) free(model->series[type].samples);
+	free(model->packets);
+	free(model->unsent);
+	memset(model, 0, sizeof(LatencyModel));
+}
@@ -1,7 +1,24 @@
+#define _GNU_SOURCE // for O_DIRECT
 #include "../reference_implementation.c"
+#include "midi_file.c"
+#include "pcm_output.c"
+#include "uart_input.c"
+#include "latency_model.c"
+#include "spi_replay.c"
+#include "test_vector.c"
+#include "checkpoint.c"
+#include "simd_render.c"
+#include "threaded_render.c"
+#include "batch_render.c"
+#include "trace.c"
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
+#include <signal.h>
+#include <sys/wait.h>
+#include <sys/stat.h>
+#include <dirent.h>
+#include <time.h>
 
 // runtime flags:
 bool enable_spi_dump        = false;
@@ -10,32 +27,108 @@ bool enable_sample_dump     = false;
 bool enable_raw_sample_dump = false;
 bool enable_command_style_dump = false;
 bool enable_starting_silence_skip = false;
+const SimdRenderer* renderer    = NULL;
+const char* wav_filename        = NULL;
+PcmFormat wav_format            = PCM_WAV_S32;
+bool enable_direct_io           = false;
+size_t n_render_threads         = 1;
+bool enable_latency_model       = false;
+bool enable_spi_replay          = false;
+VoicePolicy voice_policy        = VOICE_POLICY_ROUND_ROBIN; // -a
+bool enable_coalescing          = false; // -B
+bool enable_trace               = false; // -e
+bool enable_uart_input          = false; // -u
+Instrument instrument           = SQUARE; // -i, for every generator
+uint64_t checkpoint_interval    = 10 * SAMPLE_RATE;
+uint64_t output_from            = 0; // -S, what comes before is only simulated
+uint64_t simulate_until         = UINT64_MAX; // -U
+size_t n_segment_processes      = 0; // -J
+size_t n_batch_threads          = 0; // -P, 0 for one per cpu
 
-// a print statement which is able to print even while outputting raw PCM data to stdout:
-#define print(...) {if (enable_raw_sample_dump) {fprintf(stderr, __VA_ARGS__); fflush(stderr);} else {printf(__VA_ARGS__);}}
+// -x: the stages the time of a render is split up into, see simulation_enter_stage().
+// Only measured with ENABLE_STATS, like the counters of the reference implementation
+enum SimulationStage {
+	STAGE_MIDI_FILE       = 0, // reading the song, and whatever isn't in the stages below
+	STAGE_MICROCONTROLLER = 1, // handling the midi events
+	STAGE_SPI             = 2, // the FPGA handling the SPI packets, the -s dump included
+	STAGE_RENDER          = 3,
+	STAGE_OUTPUT          = 4, // the samples written to -o, -r, -W and -V
+	N_SIMULATION_STAGES,
+};
+typedef byte SimulationStage;
+static const char* simulation_stage_names[N_SIMULATION_STAGES] = {"midi_file", "microcontroller", "spi", "render", "output"};
+
+// The state of one song being simulated, the microcontroller and the FPGA
+// included. The flags above are shared, everything which changes while a song
+// plays is in here, so that the batch renderer can run several at once
+typedef struct Simulation {
+	Microcontroller  mcu;
+	FPGA             fpga;
+	FILE*            text;                  // where -s, -n and -o print to
+	bool             skip_starting_silence; // -m, until the first sound
+	bool             enable_pcm_output;     // -r or -W
+	PcmOutput        pcm_output;
+	bool             enable_test_vector;    // -V
+	TestVectorWriter test_vector;
+	uint64_t         n_samples_generated;
+	uint64_t         n_midi_events_handled;
+	CheckpointFile   checkpoints;
+	bool             enable_checkpoint_writing; // -K without -S or -J
+	uint64_t         next_checkpoint;
+	FILE*            segment_output;        // where a -J worker puts its samples
+	SimulationStage  stage;                 // the stage running since stage_since, for -x
+	struct timespec  stage_since;
+	double           stage_seconds[N_SIMULATION_STAGES];
+} Simulation;
+
+// a print statement which is able to print even while outputting raw PCM data to stdout, text is stderr then:
+#define print(sim, ...) fprintf((sim)->text, __VA_ARGS__)
+
+// charges the time since the last switch to the stage which ran, and switches
+// to the given one. Returns the one which ran, to switch back to after a nested stage
+SimulationStage simulation_enter_stage(Simulation* sim, SimulationStage stage) {
+#if ENABLE_STATS
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	SimulationStage previous = sim->stage;
+	sim->stage_seconds[previous] += (now.tv_sec - sim->stage_since.tv_sec) + (now.tv_nsec - sim->stage_since.tv_nsec) * 1e-9;
+	sim->stage_since = now;
+	sim->stage       = stage;
+	return previous;
+#else
+	(void)sim;
+	return stage;
+#endif
+}
 
 // define missing functions in reference implementation:
 
 // hook the two parts of the reference implementation together:
-void microcontroller_send_spi_packet(const byte* data, size_t length) {
-	if (enable_spi_dump) {
+void simulation_send_spi_packet(void* user, const byte* data, size_t length) {
+	Simulation* sim = user;
+	SimulationStage stage = simulation_enter_stage(sim, STAGE_SPI);
+	if (enable_spi_dump && sim->n_samples_generated >= output_from) {
 		if (enable_command_style_dump) {
-			print("send_spi([");
+			print(sim, "send_spi([");
 			for (size_t i = 0; i < length; i++) {
-				if (i) print(", ");
-				print("0x%02X", data[i]);
+				if (i) print(sim, ", ");
+				print(sim, "0x%02X", data[i]);
 			}
-			print("])\n");
+			print(sim, "])\n");
 		} else {
-			print("SPI:");
+			print(sim, "SPI:");
 			for (size_t i = 0; i < length; i++) {
-				print(" %02X", data[i]);
+				print(sim, " %02X", data[i]);
 			}
-			print("\n");
+			print(sim, "\n");
 		}
 	}
 	fflush(stderr);
-	fpga_handle_spi_packet(data, length);
+	if (enable_spi_replay && !spi_replay_queue_packet(data, length)) exit(1);
+	if (sim->enable_test_vector && sim->n_samples_generated >= output_from && !test_vector_write_spi(&sim->test_vector, sim->n_samples_generated, data, length)) exit(1);
+	if (enable_latency_model) latency_model_send_spi_packet(data, length); // applied when it has crossed the bus
+	else                      fpga_handle_spi_packet(&sim->fpga, data, length);
+	simulation_enter_stage(sim, stage);
 }
 
 // no pcb buttons are pressed:
@@ -43,101 +136,874 @@ bool microcontroller_poll_pcb_button_state(uint button_id) {
 	return false; // no buttons are held down
 }
 
+// a fresh microcontroller and FPGA, fpga_init_roms() must have been called
+void simulation_init(Simulation* sim, FILE* text) {
+	memset(sim, 0, sizeof(Simulation));
+	sim->text                  = text;
+	sim->skip_starting_silence = enable_starting_silence_skip;
+	microcontroller_init(&sim->mcu, simulation_send_spi_packet, sim);
+	sim->mcu.voice_policy               = voice_policy;
+	sim->mcu.coalesce_generator_updates = enable_coalescing;
+	fpga_init(&sim->fpga);
+	STATS(clock_gettime(CLOCK_MONOTONIC, &sim->stage_since);)
+}
+
+// sets up the envelope and the instruments, before the song starts
+void simulation_setup(Simulation* sim) {
+	// hardcoded envelope settings for now
+
+	sim->mcu.global_generator_state.envelope.attack  = 0.0 * SAMPLE_RATE;
+	sim->mcu.global_generator_state.envelope.decay   = 0.0 * SAMPLE_RATE;
+	sim->mcu.global_generator_state.envelope.sustain = 1.0 * 0x7f;
+	sim->mcu.global_generator_state.envelope.release = 0.0 * SAMPLE_RATE;
+
+	//sim->mcu.global_generator_state.envelope.attack  = 0.025 * SAMPLE_RATE;
+	//sim->mcu.global_generator_state.envelope.decay   = 0.025 * SAMPLE_RATE;
+	//sim->mcu.global_generator_state.envelope.sustain = 0.6 * 0xff;
+	//sim->mcu.global_generator_state.envelope.release = 0.05 * SAMPLE_RATE;
+
+	sim->mcu.global_generator_state.master_volume = 0xFF >> 1;
+	microcontroller_send_global_state_update(&sim->mcu);
+
+	// just some code to visualize the current envelope when the note is held half a second
+	/*
+	FPGAGeneratorState* generator = &sim->fpga.generators[0];
+	generator->note_life = 0;
+	generator->data.enabled = true;
+	for (size_t i = 0; i < SAMPLE_RATE/3; i++) {
+		generator->note_life += NOTE_LIFE_COEFF*2;
+		if (i == SAMPLE_RATE/4) generator->data.enabled = false;
+		if (i == SAMPLE_RATE/4) generator->note_life = 0;
+		Sample s = fpga_apply_envelope(SAMPLE_MAX, generator);
+		printf("%d,\n", s);
+	}
+	return 0;
+	*/
+
+	// the same instrument for every generator for now, see -i
+
+	for (size_t i = 0; i < N_GENERATORS; i++) {
+		sim->mcu.generator_states[i].instrument = instrument;
+	}
+}
+
+// the statistics of the flags which report any, prefixed with the song in a batch
+void simulation_print_report(Simulation* sim, const char* prefix) {
+	if (sim->mcu.voice_stats.n_stolen || sim->mcu.voice_stats.n_dropped) {
+		fprintf(stderr, "%svoices: %zu notes stolen, %zu notes dropped\n", prefix,
+			sim->mcu.voice_stats.n_stolen, sim->mcu.voice_stats.n_dropped);
+	}
+	if (enable_latency_model) latency_model_print_report();
+	if (enable_uart_input) uart_input_print_report(&sim->mcu);
+	if (sim->mcu.coalesce_generator_updates) {
+		fprintf(stderr, "%sspi: %zu packets, %zu bytes on the wire, %zu bytes without coalescing\n", prefix,
+			sim->mcu.spi_stats.n_packets, sim->mcu.spi_stats.n_bytes, sim->mcu.spi_stats.n_uncoalesced_bytes);
+	}
+}
+
+// -x: the counters of ENABLE_STATS and the time spent in each stage, as json
+bool simulation_write_stats(Simulation* sim, const char* path) {
+	static const char* midi_event_names[16] = {
+		[0x8] = "note_off", [0x9] = "note_on", [0xA] = "aftertouch", [0xB] = "control_change",
+		[0xC] = "program_change", [0xD] = "channel_pressure", [0xE] = "pitch_bend", [0xF] = "system",
+	};
+	static const char* spi_packet_names[4] = {"unknown", "global_state", "generator", "multi_generator"};
+	const MicrocontrollerStats* stats = &sim->mcu.stats;
+
+	FILE* f = strcmp(path, "-") ? fopen(path, "w") : stderr;
+	if (!f) {
+		fprintf(stderr, "error: unable to write the stats to '%s'\n", path);
+		return false;
+	}
+	simulation_enter_stage(sim, sim->stage); // charge what ran up to now
+
+	size_t n_other = 0;
+	fprintf(f, "{\n\t\"midi_events\": {");
+	for (size_t type = 0; type < 16; type++) {
+		if (midi_event_names[type]) fprintf(f, "\"%s\": %zu, ", midi_event_names[type], stats->n_midi_events[type]);
+		else n_other += stats->n_midi_events[type];
+	}
+	fprintf(f, "\"without_status\": %zu, \"invalid\": %zu, \"drums\": %zu},\n", n_other, stats->n_invalid_midi_events, stats->n_drum_events);
+	fprintf(f, "\t\"voices\": {\"peak_held\": %zu, \"peak_sounding\": %zu, \"stolen\": %zu, \"dropped\": %zu},\n",
+		stats->peak_held_voices, sim->fpga.stats.peak_active_generators, sim->mcu.voice_stats.n_stolen, sim->mcu.voice_stats.n_dropped);
+	fprintf(f, "\t\"spi\": {");
+	for (size_t type = 1; type < 4; type++) {
+		fprintf(f, "\"%s\": {\"packets\": %zu, \"bytes\": %zu}, ", spi_packet_names[type], stats->n_spi_packets[type], stats->n_spi_bytes[type]);
+	}
+	fprintf(f, "\"packets\": %zu, \"bytes\": %zu},\n", sim->mcu.spi_stats.n_packets, sim->mcu.spi_stats.n_bytes);
+	fprintf(f, "\t\"samples\": {\"generated\": %llu, \"clipped\": %llu},\n",
+		(unsigned long long)sim->n_samples_generated, (unsigned long long)sim->fpga.stats.n_clipped_samples);
+	fprintf(f, "\t\"seconds\": {");
+	for (size_t stage = 0; stage < N_SIMULATION_STAGES; stage++) {
+		fprintf(f, "%s\"%s\": %.6f", stage ? ", " : "", simulation_stage_names[stage], sim->stage_seconds[stage]);
+	}
+	fprintf(f, "}\n}\n");
+	bool ok = !ferror(f);
+	if (f != stderr && fclose(f)) ok = false;
+	if (!ok) fprintf(stderr, "error: unable to write the stats to '%s'\n", path);
+	return ok;
+}
+
 
 // our simulator events:
 
+void simulate_midi_event(Simulation* sim, const byte* data, size_t length) {
+	if (enable_uart_input) { // it arrives byte by byte, see generate_samples()
+		uart_input_send_midi_event(sim->n_samples_generated, data, length);
+		return;
+	}
+	size_t n_queued = sim->mcu.spi_stats.n_queued_updates;
+	if (enable_latency_model) { // handled now, but timed as when its last byte arrives
+		uint64_t arrive_ns = uart_input_send_midi_event(sim->n_samples_generated, data, length);
+		latency_model_begin_midi_event(sim->n_samples_generated, arrive_ns, data, length);
+	}
+	if (enable_trace) trace_set_clock(sim->n_samples_generated);
+	SimulationStage stage = simulation_enter_stage(sim, STAGE_MICROCONTROLLER);
+	microcontroller_handle_midi_event(&sim->mcu, data, length);
+	simulation_enter_stage(sim, stage);
+	if (enable_latency_model) latency_model_end_midi_event(sim->mcu.spi_stats.n_queued_updates != n_queued);
+}
+
 #define midi_event(data, length) \
-	microcontroller_handle_midi_event((const byte*) data, length)
+	simulate_midi_event(sim, (const byte*) data, length)
 
-void generate_samples(size_t n) {
-	if (enable_n_samples_dump &&  enable_command_style_dump) print("step_n_samples(%d)\n", n);
-	if (enable_n_samples_dump && !enable_command_style_dump) print("Step: %d samples\n", n);
-	if (!enable_sample_dump && !enable_raw_sample_dump) return;
-	for (size_t i = 0; i < n; i++) {
-		WSample s = fpga_generate_sound_sample();
-		if (enable_starting_silence_skip && s == 0) continue;
-		enable_starting_silence_skip = false;
-		if (enable_sample_dump &&  enable_command_style_dump) print("expect_sample(%i)\n", s);
-		if (enable_sample_dump && !enable_command_style_dump) print("Sample: %i\n", s);
-		if (enable_raw_sample_dump) { // little endian 32bit signed output
-			printf("%c", *(((byte*)&s)+0));
-			printf("%c", *(((byte*)&s)+1));
-			printf("%c", *(((byte*)&s)+2));
-			printf("%c", *(((byte*)&s)+3));
+// hands n rendered samples to the outputs, index being the number of the first
+// one. NULL samples are silence, which is output in bulk
+void output_samples(Simulation* sim, uint64_t index, const WSample* samples, size_t n) {
+	static const WSample zeros[FPGA_BLOCK_SIZE];
+	if (index < output_from) { // rendered from a checkpoint up to -S, not output
+		size_t skip = (output_from - index < n) ? output_from - index : n;
+		index += skip;
+		n     -= skip;
+		if (samples) samples += skip;
+	}
+	if (sim->segment_output) {
+		for (size_t i = 0; i < n; i += FPGA_BLOCK_SIZE) {
+			size_t len = (n - i < FPGA_BLOCK_SIZE) ? n - i : FPGA_BLOCK_SIZE;
+			if (fwrite(samples ? samples + i : zeros, sizeof(WSample), len, sim->segment_output) != len) exit(1);
+		}
+		return;
+	}
+
+	size_t first = 0;
+	if (sim->skip_starting_silence) {
+		if (!samples) return;
+		while (first < n && samples[first] == 0) first++;
+		if (first == n) return;
+		sim->skip_starting_silence = false;
+	}
+	for (size_t i = first; i < n && enable_sample_dump; i++) {
+		if ( enable_command_style_dump) print(sim, "expect_sample(%i)\n", samples ? samples[i] : 0);
+		if (!enable_command_style_dump) print(sim, "Sample: %i\n", samples ? samples[i] : 0);
+	}
+	if (sim->enable_pcm_output) {
+		bool ok = samples ? pcm_output_write(&sim->pcm_output, samples + first, n - first) : pcm_output_write_silence(&sim->pcm_output, n);
+		if (!ok) exit(1);
+	}
+	for (size_t i = first; i < n && sim->enable_test_vector; i += FPGA_BLOCK_SIZE) {
+		size_t len = (n - i < FPGA_BLOCK_SIZE) ? n - i : FPGA_BLOCK_SIZE;
+		if (!test_vector_write_samples(&sim->test_vector, index + i, samples ? samples + i : zeros, len)) exit(1);
+	}
+}
+
+void write_checkpoint(Simulation* sim) {
+	if (!checkpoint_append(&sim->checkpoints, &sim->mcu, &sim->fpga, sim->n_samples_generated, sim->n_midi_events_handled)) exit(1);
+	sim->next_checkpoint += checkpoint_interval;
+}
+
+void render_samples(Simulation* sim, size_t n) {
+	uint64_t index = sim->n_samples_generated;
+	if (!enable_sample_dump && !sim->enable_pcm_output && !sim->enable_test_vector && !sim->enable_checkpoint_writing && !sim->segment_output && !enable_trace) {
+		sim->n_samples_generated += n;
+		return;
+	}
+	// no SPI packets arrive until we return, so we can render whole blocks at a time
+	WSample block[FPGA_BLOCK_SIZE];
+	while (n) {
+		size_t todo = n;
+		if (sim->enable_checkpoint_writing && todo > sim->next_checkpoint - index) todo = sim->next_checkpoint - index;
+
+		SimulationStage stage = simulation_enter_stage(sim, STAGE_RENDER);
+		size_t len = fpga_skip_silence(&sim->fpga, todo); // rests are fast-forwarded instead of rendered
+		if (len) {
+			simulation_enter_stage(sim, STAGE_OUTPUT);
+			output_samples(sim, index, NULL, len);
+		} else {
+			len = (todo < FPGA_BLOCK_SIZE) ? todo : FPGA_BLOCK_SIZE;
+			renderer->render(&sim->fpga, block, len);
+			simulation_enter_stage(sim, STAGE_OUTPUT);
+			output_samples(sim, index, block, len);
+		}
+		simulation_enter_stage(sim, stage);
+		index += len;
+		n     -= len;
+
+		sim->n_samples_generated = index;
+		if (sim->enable_checkpoint_writing && index == sim->next_checkpoint) write_checkpoint(sim);
+	}
+}
+
+void generate_samples(Simulation* sim, size_t n) {
+	if (enable_trace && !trace_drain()) exit(1); // the events of the tick before, a tick is far less than a ring
+	SimulationStage stage = simulation_enter_stage(sim, STAGE_MICROCONTROLLER);
+	microcontroller_flush_generator_updates(&sim->mcu); // the sample tick advances
+	simulation_enter_stage(sim, stage);
+	if (enable_spi_replay && !spi_replay_send_at(sim->n_samples_generated)) exit(1);
+	if (enable_n_samples_dump && sim->n_samples_generated >= output_from &&  enable_command_style_dump) print(sim, "step_n_samples(%d)\n", n);
+	if (enable_n_samples_dump && sim->n_samples_generated >= output_from && !enable_command_style_dump) print(sim, "Step: %d samples\n", n);
+	if (!enable_uart_input && !enable_latency_model) {
+		render_samples(sim, n);
+		return;
+	}
+
+	// render up to each byte which arrives and each packet which crosses the bus in the meantime
+	if (enable_latency_model) latency_model_end_tick();
+	while (n) {
+		uint64_t sample = sim->n_samples_generated;
+		uint64_t due    = UINT64_MAX;
+		if (enable_uart_input) {
+			UartInputByte received;
+			bool          any = false;
+			while (uart_input_receive(&sim->mcu, sample, &received)) { // the receive interrupt, then the main loop
+				bool   timed    = enable_latency_model && received.event_sample != UINT64_MAX; // the last byte of an event
+				size_t n_queued = sim->mcu.spi_stats.n_queued_updates;
+				if (timed) latency_model_begin_midi_event(received.event_sample, received.arrive_ns, received.event, received.event_length);
+				if (enable_trace) trace_set_clock(sample);
+				SimulationStage stage = simulation_enter_stage(sim, STAGE_MICROCONTROLLER);
+				microcontroller_poll_midi_input(&sim->mcu);
+				simulation_enter_stage(sim, stage);
+				if (timed) latency_model_end_midi_event(sim->mcu.spi_stats.n_queued_updates != n_queued);
+				any = true;
+			}
+			if (any) {
+				SimulationStage stage = simulation_enter_stage(sim, STAGE_MICROCONTROLLER);
+				microcontroller_flush_generator_updates(&sim->mcu);
+				simulation_enter_stage(sim, stage);
+				if (enable_latency_model) latency_model_end_tick();
+			}
+			due = uart_input_next_arrival_sample();
+		}
+		if (enable_latency_model) {
+			SimulationStage stage = simulation_enter_stage(sim, STAGE_SPI);
+			latency_model_apply_due_packets(&sim->fpga, sample);
+			simulation_enter_stage(sim, stage);
+			if (latency_model_next_apply_sample() < due) due = latency_model_next_apply_sample();
+		}
+		size_t len = (due - sample < n) ? due - sample : n;
+		render_samples(sim, len);
+		n -= len;
+	}
+}
+
+// stream the events of a standard midi file through the simulator, up to
+// simulate_until. When resuming from a checkpoint, the events it has handled
+// already are skipped
+bool simulate_midi_file(Simulation* sim, const char* path) {
+	MidiFile file;
+	if (!midi_file_open(&file, path)) return false;
+
+	MidiFileEvent event;
+	uint64_t n_samples = sim->n_samples_generated;
+	for (uint64_t i = 0; i < sim->n_midi_events_handled && midi_file_next_event(&file, &event); i++);
+	if (enable_uart_input) uart_input_set_tempo(file.tempo);
+	while (midi_file_next_event(&file, &event)) {
+		if (event.sample > n_samples) {
+			uint64_t until = (event.sample < simulate_until) ? event.sample : simulate_until;
+			if (until > n_samples) generate_samples(sim, until - n_samples);
+			if (until > n_samples) n_samples = until;
+			if (n_samples >= simulate_until) break;
+		}
+		if (event.is_midi) midi_event(event.data, event.length);
+		if (enable_uart_input && event.sysex_length) uart_input_send_sysex(n_samples, event.sysex_length);
+		if (enable_uart_input) uart_input_set_tempo(file.tempo);
+		sim->n_midi_events_handled++;
+	}
+	if (enable_uart_input && n_samples < simulate_until) { // the end of the song waits for what is still on the line
+		uint64_t until = uart_input_last_arrival_sample() + 1;
+		if (until > simulate_until) until = simulate_until;
+		if (until > n_samples) generate_samples(sim, until - n_samples);
+	}
+	if (enable_latency_model && sim->n_samples_generated < simulate_until) { // and for the packets still crossing the bus
+		microcontroller_flush_generator_updates(&sim->mcu);
+		uint64_t until = latency_model_last_apply_sample() + 1;
+		if (until > simulate_until) until = simulate_until;
+		if (until > sim->n_samples_generated) generate_samples(sim, until - sim->n_samples_generated);
+	}
+
+	midi_file_close(&file);
+	return true;
+}
+
+// Renders the segments between the checkpoints in worker processes, n_segment_processes
+// at a time, and outputs them in order. Every worker is a fork which restores its
+// checkpoint into its own copy of the simulation, which keeps the outputs of the
+// parent out of reach. The workers write their samples to a temporary file,
+// followed by a snapshot of the state they ended in. The one of the last segment
+// is restored at the end, for the statistics
+bool render_segments_in_parallel(Simulation* sim, const char* path) {
+	size_t first = checkpoint_find(&sim->checkpoints, output_from);
+	size_t n     = checkpoint_find(&sim->checkpoints, simulate_until) - first + 1;
+	pid_t*            pids   = calloc(n, sizeof(pid_t));
+	FILE**            files  = calloc(n, sizeof(FILE*));
+	uint64_t*         starts = calloc(n, sizeof(uint64_t));
+	CheckpointRecord* record = malloc(sizeof(CheckpointRecord));
+	if (!pids || !files || !starts || !record) return false;
+
+	bool   ok      = true;
+	size_t started = 0;
+	fflush(stdout);
+	fflush(stderr);
+	for (size_t i = 0; i < n && ok; i++) {
+		for (; started < n && started < i + n_segment_processes; started++) {
+			size_t index = first + started;
+			if (!checkpoint_read(&sim->checkpoints, index, record) || !(files[started] = tmpfile())) {
+				ok = false;
+				break;
+			}
+			starts[started] = record->sample;
+			pids[started]   = fork();
+			if (pids[started] < 0) {
+				perror("error: unable to start a segment worker");
+				fclose(files[started]);
+				ok = false;
+				break;
+			}
+			if (pids[started] == 0) {
+				checkpoint_restore(&record->state, &sim->mcu, &sim->fpga);
+				sim->n_samples_generated   = record->sample;
+				sim->n_midi_events_handled = record->n_events;
+				if (index + 1 < sim->checkpoints.n_checkpoints && (index + 1) * sim->checkpoints.header.interval < simulate_until) {
+					simulate_until = (index + 1) * sim->checkpoints.header.interval;
+				}
+				output_from         = 0; // the trimming is done when stitching
+				sim->segment_output = files[started];
+				bool worker_ok = simulate_midi_file(sim, path);
+				microcontroller_flush_generator_updates(&sim->mcu);
+				checkpoint_snapshot(&record->state, &sim->mcu, &sim->fpga);
+				worker_ok &= fwrite(&record->state, sizeof(EngineSnapshot), 1, sim->segment_output) == 1;
+				worker_ok &= fflush(sim->segment_output) == 0;
+				_exit(worker_ok ? 0 : 1);
+			}
+		}
+		if (!ok) break;
+
+		int status;
+		if (waitpid(pids[i], &status, 0) < 0 || !WIFEXITED(status) || WEXITSTATUS(status)) {
+			fprintf(stderr, "error: the worker of segment %zu failed\n", first + i);
+			ok = false;
+			break;
+		}
+		fseek(files[i], 0, SEEK_END);
+		long   size      = ftell(files[i]);
+		size_t n_samples = (size < (long)sizeof(EngineSnapshot)) ? 0 : (size - sizeof(EngineSnapshot)) / sizeof(WSample);
+		rewind(files[i]);
+
+		WSample  block[FPGA_BLOCK_SIZE];
+		uint64_t sample = starts[i];
+		for (size_t done = 0; done < n_samples;) {
+			size_t len = (n_samples - done < FPGA_BLOCK_SIZE) ? n_samples - done : FPGA_BLOCK_SIZE;
+			if (fread(block, sizeof(WSample), len, files[i]) != len) break;
+			output_samples(sim, sample, block, len);
+			sample += len;
+			done   += len;
+		}
+		if (i == n - 1) { // the state at the end of the song
+			ok = fread(&record->state, sizeof(EngineSnapshot), 1, files[i]) == 1;
+			checkpoint_restore(&record->state, &sim->mcu, &sim->fpga);
+			sim->n_samples_generated = sample;
+		}
+		fclose(files[i]);
+		files[i] = NULL;
+	}
+
+	for (size_t i = 0; i < started; i++) { // after a failure
+		if (!files[i]) continue;
+		kill(pids[i], SIGTERM);
+		waitpid(pids[i], NULL, 0);
+		fclose(files[i]);
+	}
+	free(pids);
+	free(files);
+	free(starts);
+	free(record);
+	return ok;
+}
+
+#ifdef SONG_C
+// load in hand written simulator events, compile with -DSONG_C='"envelope_song.c"'
+void simulate_song_c(Simulation* sim) {
+#define generate_samples(n) generate_samples(sim, n)
+#include SONG_C
+#undef generate_samples
+}
+#endif
+
+
+// measures the SINE lookup table against the float sine it replaced, for every note and position
+void print_sine_lut_error() {
+	int    max_error = 0;
+	double sum_error = 0;
+	size_t n         = 0;
+	const sbyte pitchwheels[] = {-128, 0, 127};
+	for (size_t p = 0; p < sizeof(pitchwheels); p++) {
+		for (size_t note = 0; note < N_MIDI_KEYS; note++) {
+			uint wavelength = fpga_calculate_wavelength(note, pitchwheels[p]);
+			uint reciprocal = ((1ull << 32) + wavelength - 1) / wavelength;
+			for (uint pos = 0; pos < wavelength; pos++) {
+				int expected = round(SAMPLE_MAX * sin(2 * PI * pos / wavelength));
+				int error    = abs(fpga_sine_lookup(pos * reciprocal) - expected);
+				if (error > max_error) max_error = error;
+				sum_error += error;
+				n++;
+			}
+		}
+	}
+	printf("SINE_LUT_BITS %d, SINE_LUT_INTERPOLATE %d\n", SINE_LUT_BITS, SINE_LUT_INTERPOLATE);
+	printf("worst case error: %d LSB (%.1f dBFS)\n", max_error, 20 * log10((double)max_error / SAMPLE_MAX));
+	printf("mean error:       %.3f LSB over %zu positions\n", sum_error / n, n);
+}
+
+
+// the ideal waveforms the generators approximate, at x periods in
+double ideal_waveform(Instrument instrument, double x) {
+	switch (instrument) {
+		case SQUARE:   return (x < 0.5) ? 1 : -1;
+		case TRIANGLE: return (x < 0.25) ? -4 * x : (x < 0.75) ? 4 * x - 2 : 4 - 4 * x;
+		case SAWTOOTH: return 2 * x - 1;
+		case SINE:     return sin(2 * PI * x);
+		default:       return 0;
+	}
+}
+
+// compares the wavelength_pos oscillator with the phase accumulator one (OSCILLATOR_DDS),
+// in frequency against the equal tempered pitch, and in shape against the ideal waveforms
+void print_oscillator_accuracy() {
+	static const char* model_names[2] = {"wavelength_pos", "phase (DDS)"};
+	printf("OSCILLATOR_DDS %d is what this simulator renders with\n\n", OSCILLATOR_DDS);
+
+	// the frequency, for every note and pitchwheel
+	double max_cents[2] = {0}, sum_cents[2] = {0};
+	size_t n = 0;
+	for (int pitchwheel = -128; pitchwheel < 128; pitchwheel++) {
+		for (size_t note = 0; note < N_MIDI_KEYS; note++) {
+			double target = MIDI_A3_FREQ * pow(2.0, ((int)note - MIDI_A3_INDEX) / 12.0)
+			              * (1 + pitchwheel * PITCHWHEEL_LINEAR_SCALE / 65536.0);
+			double freq[2] = {
+				(double)SAMPLE_RATE * NOTE_LIFE_COEFF / fpga_calculate_wavelength(note, pitchwheel),
+				fpga_calculate_phase_increment(note, pitchwheel) * (double)SAMPLE_RATE / 4294967296.0,
+			};
+			for (size_t model = 0; model < 2; model++) {
+				double cents = fabs(1200 * log2(freq[model] / target));
+				if (cents > max_cents[model]) max_cents[model] = cents;
+				sum_cents[model] += cents;
+			}
+			n++;
+		}
+	}
+	printf("frequency error over %zu notes and pitchwheels:\n", n);
+	for (size_t model = 0; model < 2; model++) {
+		printf("  %-16s worst %9.4f cents, mean %9.4f cents\n", model_names[model], max_cents[model], sum_cents[model] / n);
+	}
+
+	// the waveforms, over a second of every note, each at the phase of its own oscillator
+	printf("\nwaveform error over a second of every note:\n");
+	static const char* instrument_names[4] = {"square", "triangle", "sawtooth", "sine"};
+	for (Instrument instrument = SQUARE; instrument <= SINE; instrument++) {
+		int    max_error[2] = {0};
+		double sum_error[2] = {0};
+		size_t n_samples    = 0;
+		for (size_t note = 0; note < N_MIDI_KEYS; note++) {
+			uint wavelength = fpga_calculate_wavelength(note, 0);
+			uint reciprocal = ((1ull << 32) + wavelength - 1) / wavelength;
+			uint increment  = fpga_calculate_phase_increment(note, 0);
+			uint pos = 0, phase = 0;
+			for (size_t i = 0; i < SAMPLE_RATE; i++) {
+				Sample sample[2] = {
+					fpga_wavelength_waveform(pos, wavelength, reciprocal, instrument, 0),
+					fpga_phase_waveform(phase, instrument, 0),
+				};
+				double x[2] = {(double)pos / wavelength, phase / 4294967296.0};
+				for (size_t model = 0; model < 2; model++) {
+					int error = abs(sample[model] - (int)round(SAMPLE_MAX * ideal_waveform(instrument, x[model])));
+					if (error > max_error[model]) max_error[model] = error;
+					sum_error[model] += error;
+				}
+				n_samples++;
+				pos   += NOTE_LIFE_COEFF;
+				phase += increment;
+				if (pos >= wavelength) pos -= wavelength;
+			}
+		}
+		for (size_t model = 0; model < 2; model++) {
+			printf("  %-9s %-16s worst %6d LSB, mean %8.3f LSB\n", instrument_names[instrument], model_names[model],
+				max_error[model], sum_error[model] / n_samples);
 		}
 	}
 }
 
-// load in the events created by our python script
-void simulate() { // 2hacky4u
-#include "song.c"
+// the constants the output was generated for, at the top of the -s -n -o text
+void simulation_print_config(Simulation* sim, int argc, char const *argv[]) {
+	print(sim, "#generated with the flags:");
+	for (size_t i = 1; i < argc; i++) print(sim, " %s", argv[i]);
+	print(sim, "\n");
+
+	// add in these to avoid fuckups with differing configs. It has already saved me many times
+	// the tests in chisel will verify these values
+	print(sim, "#generated for SAMPLE_RATE     %d\n", SAMPLE_RATE);
+	print(sim, "#generated for FREQ_SHIFT      %d\n", FREQ_SHIFT);
+	print(sim, "#generated for NOTE_LIFE_COEFF %d\n", NOTE_LIFE_COEFF);
+	print(sim, "#generated for N_MIDI_KEYS     %d\n", N_MIDI_KEYS);
+	print(sim, "#generated for N_MIDI_CHANNELS %d\n", N_MIDI_CHANNELS);
+	print(sim, "#generated for MIDI_A3_INDEX   %d\n", MIDI_A3_INDEX);
+	print(sim, "#generated for MIDI_A3_FREQ    %f\n", MIDI_A3_FREQ);
+	print(sim, "#generated for VELOCITY_MAX    %d\n", VELOCITY_MAX);
+	print(sim, "#generated for SAMPLE_MAX      %d\n", SAMPLE_MAX);
+	print(sim, "#generated for N_GENERATORS    %d\n", N_GENERATORS);
+}
+
+
+// -d: every midi file in a directory is rendered to a wav file of the same
+// name in the output directory, with the text of -s -n -o next to it. Each
+// song is a Simulation of its own, rendered on the work-stealing pool of
+// batch_render.c. They share nothing but the flags and the ROMs
+typedef struct BatchSongs {
+	const char*  songs_dir;
+	const char*  out_dir;
+	char**       names;
+	bool*        ok;
+	int          argc;
+	char const** argv;
+} BatchSongs;
+
+static int batch_compare_names(const void* a, const void* b) {
+	return strcmp(*(char* const*)a, *(char* const*)b);
+}
+
+static char* batch_path(const char* dir, const char* name, const char* extension) {
+	size_t stem = strlen(name) - (extension ? 4 : 0); // without the ".mid"
+	char*  path = malloc(strlen(dir) + strlen(name) + 8);
+	if (path) sprintf(path, "%s/%.*s%s", dir, (int)stem, name, extension ? extension : "");
+	return path;
 }
 
+static void render_batch_song(void* user, size_t index) {
+	BatchSongs* batch     = user;
+	const char* name      = batch->names[index];
+	char*       midi_path = batch_path(batch->songs_dir, name, NULL);
+	char*       wav_path  = batch_path(batch->out_dir, name, ".wav");
+	char*       text_path = batch_path(batch->out_dir, name, ".txt");
+	Simulation* sim       = malloc(sizeof(Simulation));
+	bool        ok        = midi_path && wav_path && text_path && sim;
+
+	FILE* text = NULL;
+	if (ok && (enable_spi_dump || enable_n_samples_dump || enable_sample_dump)) {
+		ok = (text = fopen(text_path, "w"));
+		if (!ok) fprintf(stderr, "error: unable to write '%s'\n", text_path);
+	}
+	if (ok) {
+		simulation_init(sim, text);
+		if (text) simulation_print_config(sim, batch->argc, batch->argv);
+		ok = sim->enable_pcm_output = pcm_output_open(&sim->pcm_output, wav_path, wav_format, enable_direct_io);
+	}
+	if (ok) {
+		simulation_setup(sim);
+		ok = simulate_midi_file(sim, midi_path);
+		microcontroller_flush_generator_updates(&sim->mcu);
+		if (!pcm_output_close(&sim->pcm_output)) ok = false;
+
+		char prefix[512];
+		snprintf(prefix, sizeof(prefix), "%s: ", name);
+		simulation_print_report(sim, prefix);
+	}
+	if (text && fclose(text)) ok = false;
+	if (!ok) fprintf(stderr, "error: unable to render '%s'\n", name);
+	batch->ok[index] = ok;
+	free(midi_path);
+	free(wav_path);
+	free(text_path);
+	free(sim);
+}
+
+bool render_batch(const char* songs_dir, const char* out_dir, int argc, char const *argv[]) {
+	DIR* dir = opendir(songs_dir);
+	if (!dir) {
+		fprintf(stderr, "error: unable to open the directory '%s'\n", songs_dir);
+		return false;
+	}
+	BatchSongs batch = {.songs_dir = songs_dir, .out_dir = out_dir, .argc = argc, .argv = argv};
+	size_t     n     = 0;
+	size_t     cap   = 0;
+	for (struct dirent* entry; (entry = readdir(dir));) {
+		size_t len = strlen(entry->d_name);
+		if (len <= 4 || strcasecmp(entry->d_name + len - 4, ".mid")) continue;
+		if (n == cap) {
+			cap = cap ? 2 * cap : 64;
+			char** names = realloc(batch.names, cap * sizeof(char*));
+			if (!names) return false;
+			batch.names = names;
+		}
+		if (!(batch.names[n++] = strdup(entry->d_name))) return false;
+	}
+	closedir(dir);
+	if (!n) {
+		fprintf(stderr, "error: no midi files in '%s'\n", songs_dir);
+		return false;
+	}
+	qsort(batch.names, n, sizeof(char*), batch_compare_names);
+
+	// the longest songs should start first, the file size is a good enough guess
+	uint64_t* sizes = calloc(n, sizeof(uint64_t));
+	batch.ok        = calloc(n, sizeof(bool));
+	if (!sizes || !batch.ok) return false;
+	for (size_t i = 0; i < n; i++) {
+		char*       path = batch_path(songs_dir, batch.names[i], NULL);
+		struct stat st;
+		if (path && !stat(path, &st)) sizes[i] = st.st_size;
+		free(path);
+	}
+
+	BatchStats stats;
+	bool ok = batch_render(n, sizes, n_batch_threads, render_batch_song, &batch, &stats);
+	size_t n_failed = 0;
+	for (size_t i = 0; i < n; i++) n_failed += !batch.ok[i];
+	if (ok) {
+		fprintf(stderr, "batch: %zu songs on %zu threads, %zu of them stolen, %zu failed\n", n, stats.n_threads, stats.n_stolen, n_failed);
+	}
+
+	for (size_t i = 0; i < n; i++) free(batch.names[i]);
+	free(batch.names);
+	free(batch.ok);
+	free(sizes);
+	return ok && !n_failed;
+}
 
 int main(int argc, char const *argv[]) {
+	const char* midi_filename = NULL;
+	const char* renderer_name = "auto";
+	const char* spi_replay_path = NULL;
+	const char* test_vector_path = NULL;
+	const char* checkpoint_path = NULL;
+	const char* batch_songs_dir = NULL;
+	const char* stats_path      = NULL;
+	const char* trace_path      = NULL;
+	const char* batch_out_dir   = NULL;
+	fpga_init_roms();
 	for (size_t i = 1; i < argc; i++) {
-		/**/ if (!strcmp(argv[i], "-s")) enable_spi_dump        = true;
+		/**/ if (argv[i][0] != '-')      midi_filename          = argv[i];
+		else if (!strcmp(argv[i], "-s")) enable_spi_dump        = true;
 		else if (!strcmp(argv[i], "-n")) enable_n_samples_dump  = true;
 		else if (!strcmp(argv[i], "-o")) enable_sample_dump     = true;
 		else if (!strcmp(argv[i], "-r")) enable_raw_sample_dump = true;
 		else if (!strcmp(argv[i], "-c")) enable_command_style_dump = true;
 		else if (!strcmp(argv[i], "-m")) enable_starting_silence_skip = true;
+		else if (!strcmp(argv[i], "-k") && i+1 < argc) renderer_name = argv[++i];
+		else if (!strcmp(argv[i], "-j") && i+1 < argc) n_render_threads = atoi(argv[++i]);
+		else if (!strcmp(argv[i], "-W") && i+1 < argc) wav_filename     = argv[++i];
+		else if (!strcmp(argv[i], "-16"))              wav_format       = PCM_WAV_S16;
+		else if (!strcmp(argv[i], "-D"))               enable_direct_io = true;
+		else if (!strcmp(argv[i], "-B"))               enable_coalescing = true;
+		else if (!strcmp(argv[i], "-L") && i+1 < argc) {
+			enable_latency_model = true;
+			latency_model_init(strtoull(argv[++i], NULL, 10));
+			if (!latency_model.spi_hz) {
+				fprintf(stderr, "error: -L needs the spi clock in Hz\n");
+				return 1;
+			}
+		}
+		else if (!strcmp(argv[i], "-u"))               enable_uart_input = true;
+		else if (!strcmp(argv[i], "-V") && i+1 < argc) test_vector_path = argv[++i];
+		else if (!strcmp(argv[i], "-R") && i+1 < argc) {
+			enable_spi_replay = true;
+			spi_replay_path   = argv[++i];
+		}
+		else if (!strcmp(argv[i], "-a") && i+1 < argc) {
+			const char* policy = argv[++i];
+			/**/ if (!strcmp(policy, "round-robin"))    voice_policy = VOICE_POLICY_ROUND_ROBIN;
+			else if (!strcmp(policy, "oldest-release")) voice_policy = VOICE_POLICY_OLDEST_RELEASE;
+			else if (!strcmp(policy, "steal"))          voice_policy = VOICE_POLICY_STEAL;
+			else {
+				fprintf(stderr, "error: unknown voice allocation policy '%s'\n", policy);
+				return 1;
+			}
+		}
+		else if (!strcmp(argv[i], "-i") && i+1 < argc) {
+			static const char* instrument_names[] = {"square", "triangle", "sawtooth", "sine", "wavetable-square", "wavetable-triangle", "wavetable-sawtooth"};
+			const char* name = argv[++i];
+			size_t      n    = sizeof(instrument_names) / sizeof(*instrument_names);
+			for (instrument = 0; instrument < n && strcmp(name, instrument_names[instrument]); instrument++);
+			if (instrument == n) {
+				fprintf(stderr, "error: unknown instrument '%s'\n", name);
+				return 1;
+			}
+		}
+		else if (!strcmp(argv[i], "-K") && i+1 < argc) checkpoint_path     = argv[++i];
+		else if (!strcmp(argv[i], "-I") && i+1 < argc) checkpoint_interval = strtoull(argv[++i], NULL, 10);
+		else if (!strcmp(argv[i], "-S") && i+1 < argc) output_from         = strtoull(argv[++i], NULL, 10);
+		else if (!strcmp(argv[i], "-U") && i+1 < argc) simulate_until      = strtoull(argv[++i], NULL, 10);
+		else if (!strcmp(argv[i], "-J") && i+1 < argc) n_segment_processes = atoi(argv[++i]);
+		else if (!strcmp(argv[i], "-d") && i+2 < argc) {
+			batch_songs_dir = argv[++i];
+			batch_out_dir   = argv[++i];
+		}
+		else if (!strcmp(argv[i], "-P") && i+1 < argc) n_batch_threads = atoi(argv[++i]);
+		else if (!strcmp(argv[i], "-x") && i+1 < argc) stats_path      = argv[++i];
+		else if (!strcmp(argv[i], "-e") && i+1 < argc) trace_path      = argv[++i];
+		else if (!strcmp(argv[i], "-g") && i+2 < argc) {
+			if (!ENABLE_TRACE) fprintf(stderr, "warning: this build records no traces\n");
+			return trace_convert(argv[i+1], argv[i+2]) ? 0 : 1;
+		}
+		else if (!strcmp(argv[i], "-E")) {
+			print_sine_lut_error();
+			return 0;
+		}
+		else if (!strcmp(argv[i], "-O")) {
+			print_oscillator_accuracy();
+			return 0;
+		}
 	}
-	if (enable_spi_dump || enable_n_samples_dump || enable_sample_dump) {
-		print("#generated with the flags:");
-		for (size_t i = 1; i < argc; i++) print(" %s", argv[i]);
-		print("\n");
-
-		// add in these to avoid fuckups with differing configs. It has already saved me many times
-		// the tests in chisel will verify these values
-		print("#generated for SAMPLE_RATE     %d\n", SAMPLE_RATE);
-		print("#generated for FREQ_SHIFT      %d\n", FREQ_SHIFT);
-		print("#generated for NOTE_LIFE_COEFF %d\n", NOTE_LIFE_COEFF);
-		print("#generated for N_MIDI_KEYS     %d\n", N_MIDI_KEYS);
-		print("#generated for N_MIDI_CHANNELS %d\n", N_MIDI_CHANNELS);
-		print("#generated for MIDI_A3_INDEX   %d\n", MIDI_A3_INDEX);
-		print("#generated for MIDI_A3_FREQ    %f\n", MIDI_A3_FREQ);
-		print("#generated for VELOCITY_MAX    %d\n", VELOCITY_MAX);
-		print("#generated for SAMPLE_MAX      %d\n", SAMPLE_MAX);
-		print("#generated for N_GENERATORS    %d\n", N_GENERATORS);
+	if (trace_path) {
+		const char* error = NULL;
+		/**/ if (!ENABLE_TRACE)                          error = "-e needs the trace hooks, compile with -DENABLE_TRACE=1";
+		else if (batch_songs_dir || n_segment_processes) error = "-e can't be used with -d or -J";
+		if (error) {
+			fprintf(stderr, "error: %s\n", error);
+			return 1;
+		}
+	}
+	renderer = simd_select_renderer(renderer_name);
+	if (!renderer) {
+		fprintf(stderr, "error: renderer '%s' is unknown or not supported by this cpu\n", renderer_name);
+		return 1;
+	}
+	if (stats_path) {
+		const char* error = NULL;
+		/**/ if (!ENABLE_STATS)                     error = "-x needs the counters, compile with -DENABLE_STATS=1";
+		else if (batch_songs_dir || n_segment_processes) error = "-x can't be used with -d or -J";
+		if (error) {
+			fprintf(stderr, "error: %s\n", error);
+			return 1;
+		}
+	}
+	if (batch_songs_dir) {
+		const char* error = NULL;
+		/**/ if (midi_filename)                                    error = "-d renders the midi files in the directory, not '%s'";
+		else if (enable_raw_sample_dump || wav_filename)           error = "-d writes a wav file per song, it can't be used with -r or -W";
+		else if (test_vector_path || checkpoint_path || n_segment_processes) error = "-d can't be used with -V, -K or -J";
+		else if (enable_latency_model || enable_spi_replay || enable_uart_input) error = "-d can't be used with -L, -R or -u";
+		else if (n_render_threads != 1)                            error = "-d renders a song per thread, it can't be used with -j";
+		if (error) {
+			fprintf(stderr, "error: ");
+			fprintf(stderr, error, midi_filename);
+			fprintf(stderr, "\n");
+			return 1;
+		}
+		return render_batch(batch_songs_dir, batch_out_dir, argc, argv) ? 0 : 1;
+	}
+#ifndef SONG_C
+	if (!midi_filename) {
+		fprintf(stderr, "usage: %s <midifile> [flags]\n", argv[0]);
+		return 1;
+	}
+#endif
+	if (checkpoint_path || n_segment_processes) {
+		const char* error = NULL;
+		/**/ if (!midi_filename)                              error = "checkpoints need a midi file";
+		else if (!checkpoint_interval)                        error = "-I needs a number of samples";
+		else if (enable_latency_model || enable_spi_replay || enable_uart_input) error = "-K can't be used with -L, -R or -u";
+		else if (n_segment_processes && !checkpoint_path)     error = "-J needs the checkpoints of -K";
+		else if (n_segment_processes && n_render_threads != 1) error = "-J and -j can't be used together";
+		else if (n_segment_processes && (enable_spi_dump || enable_n_samples_dump || test_vector_path))
+			error = "-J only outputs samples, it can't be used with -s, -n or -V";
+		if (error) {
+			fprintf(stderr, "error: %s\n", error);
+			return 1;
+		}
+	}
+	if (enable_raw_sample_dump && wav_filename) {
+		fprintf(stderr, "error: -r and -W can't be used together\n");
+		return 1;
+	}
+	if (wav_filename && !strcmp(wav_filename, "-")) {
+		enable_raw_sample_dump = true; // the text output goes to stderr, like with -r
+	}
+	Simulation* sim = malloc(sizeof(Simulation));
+	if (!sim) return 1;
+	simulation_init(sim, enable_raw_sample_dump ? stderr : stdout);
+	if (enable_raw_sample_dump || wav_filename) {
+		PcmFormat format = wav_filename ? wav_format : PCM_RAW_S32;
+		if (!pcm_output_open(&sim->pcm_output, wav_filename, format, enable_direct_io)) return 1;
+		sim->enable_pcm_output = true;
+	}
+	if (n_render_threads != 1) { // the threads split the generators between them, each rendering like the scalar renderer
+		static const SimdRenderer threaded = {"threaded", threaded_generate_sound_block};
+		if (!threaded_render_init(n_render_threads)) return 1;
+		renderer = &threaded;
 	}
 
+	if (enable_spi_dump || enable_n_samples_dump || enable_sample_dump) {
+		simulation_print_config(sim, argc, argv);
+	}
+	if (test_vector_path) { // the same as above, in binary
+		char   flags[4096] = "";
+		size_t flags_len   = 0;
+		for (size_t i = 1; i < argc && flags_len < sizeof(flags); i++) {
+			flags_len += snprintf(flags + flags_len, sizeof(flags) - flags_len, "%s%s", i > 1 ? " " : "", argv[i]);
+		}
+		TestVectorHeader header = {
+			.sample_rate     = SAMPLE_RATE,
+			.freq_shift      = FREQ_SHIFT,
+			.note_life_coeff = NOTE_LIFE_COEFF,
+			.n_midi_keys     = N_MIDI_KEYS,
+			.n_midi_channels = N_MIDI_CHANNELS,
+			.midi_a3_index   = MIDI_A3_INDEX,
+			.midi_a3_freq    = MIDI_A3_FREQ,
+			.velocity_max    = VELOCITY_MAX,
+			.sample_max      = SAMPLE_MAX,
+			.n_generators    = N_GENERATORS,
+		};
+		if (!test_vector_writer_open(&sim->test_vector, test_vector_path, header, flags)) return 1;
+		sim->enable_test_vector = true;
+	}
 
-	// hardcoded envelope settings for now
-
-	microcontroller_global_generator_state.envelope.attack  = 0.0 * SAMPLE_RATE;
-	microcontroller_global_generator_state.envelope.decay   = 0.0 * SAMPLE_RATE;
-	microcontroller_global_generator_state.envelope.sustain = 1.0 * 0x7f;
-	microcontroller_global_generator_state.envelope.release = 0.0 * SAMPLE_RATE;
-
-	//microcontroller_global_generator_state.envelope.attack  = 0.025 * SAMPLE_RATE;
-	//microcontroller_global_generator_state.envelope.decay   = 0.025 * SAMPLE_RATE;
-	//microcontroller_global_generator_state.envelope.sustain = 0.6 * 0xff;
-	//microcontroller_global_generator_state.envelope.release = 0.05 * SAMPLE_RATE;
 
-	microcontroller_global_generator_state.master_volume = 0xFF >> 1;
-	microcontroller_send_global_state_update();
+	if (enable_spi_replay && !spi_replay_open(spi_replay_path)) return 1;
+	if (trace_path && !(enable_trace = trace_open(trace_path))) return 1;
+	if (enable_uart_input || enable_latency_model) uart_input_init(enable_uart_input);
+	simulation_setup(sim);
 
-	// just some code to visualize the current envelope when the note is held half a second
-	/*
-	fpga_generators[0].note_life = 0;
-	fpga_generators[0].data.enabled = true;
-	for (size_t i = 0; i < SAMPLE_RATE/3; i++) {
-		fpga_generators[0].note_life += NOTE_LIFE_COEFF*2;
-		if (i == SAMPLE_RATE/4) fpga_generators[0].data.enabled = false;
-		if (i == SAMPLE_RATE/4) fpga_generators[0].note_life = 0;
-		Sample s = fpga_apply_envelope(SAMPLE_MAX, &fpga_generators[0]);
-		printf("%d,\n", s);
+	bool ok = true;
+	if (checkpoint_path && !output_from && !n_segment_processes) { // the first render writes them
+		if (!checkpoint_create(&sim->checkpoints, checkpoint_path, &sim->mcu, checkpoint_interval)) return 1;
+		sim->enable_checkpoint_writing = true;
+		write_checkpoint(sim);
+	} else if (checkpoint_path) { // the later ones start from them
+		if (!checkpoint_open(&sim->checkpoints, checkpoint_path, &sim->mcu)) return 1;
 	}
-	return 0;
-	*/
-
-	// hardcoded instruments for now
-
-	for (size_t i = 0; i < N_GENERATORS; i++) {
-		microcontroller_generator_states[i].instrument = SQUARE;
+	if (checkpoint_path && output_from && !n_segment_processes) { // seek
+		CheckpointRecord* record = malloc(sizeof(CheckpointRecord));
+		if (!record || !checkpoint_read(&sim->checkpoints, checkpoint_find(&sim->checkpoints, output_from), record)) return 1;
+		checkpoint_restore(&record->state, &sim->mcu, &sim->fpga);
+		sim->n_samples_generated   = record->sample;
+		sim->n_midi_events_handled = record->n_events;
+		free(record);
 	}
 
-	simulate();
-	return 0;
+#ifdef SONG_C
+	if (!midi_filename) simulate_song_c(sim);
+#endif
+	/**/ if (n_segment_processes) ok = render_segments_in_parallel(sim, midi_filename);
+	else if (midi_filename)       ok = simulate_midi_file(sim, midi_filename);
+	microcontroller_flush_generator_updates(&sim->mcu);
+	if (enable_spi_replay && !spi_replay_send_at(sim->n_samples_generated)) ok = false;
+	threaded_render_close();
+	if (enable_trace && !trace_close()) ok = false;
+	if (sim->enable_pcm_output && !pcm_output_close(&sim->pcm_output)) ok = false;
+	if (sim->enable_test_vector && !test_vector_writer_close(&sim->test_vector)) ok = false;
+	if (checkpoint_path && !checkpoint_close(&sim->checkpoints)) ok = false;
+	simulation_print_report(sim, "");
+	if (stats_path && !simulation_write_stats(sim, stats_path)) ok = false;
+	if (enable_spi_replay) spi_replay_close();
+	if (enable_latency_model) latency_model_close();
+	free(sim);
+	return ok ? 0 : 1;
 }
@@ -0,0 +1,338 @@
+// A streaming Standard MIDI File (SMF) reader for the simulator.
+//
+// This replaces the old simulator.py -> song.c -> gcc round trip. Tracks are
+// read straight from disk through a small buffer each, and merged by their
+// absolute tick using a min-heap, so memory use only depends on the number of
+// tracks in the file, never on its length. This makes black midis feasible.
+//
+// The merge and timing rules mirror what mido did for us before:
+//   * events on the same tick keep track order, then file order
+//   * tempo changes apply from the delta time following the set_tempo event
+//   * end-of-track only advances time for the very last track to finish
+//   * sample positions are absolute (floor(t * SAMPLE_RATE)), to avoid
+//     accumulating rounding errors between events
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#define MIDI_FILE_TRACK_BUFFER_SIZE 512
+#define MIDI_FILE_DEFAULT_TEMPO     500000 /* microseconds per quarter note, 120 bpm */
+
+typedef struct MidiFileTrack {
+	off_t    pos;            // file offset of the next unbuffered byte
+	off_t    end;            // file offset where this track chunk ends
+	uint64_t tick;           // absolute tick of the pending event
+	byte     running_status; // 0 when there is no running status
+	bool     done;
+
+	byte     buffer[MIDI_FILE_TRACK_BUFFER_SIZE];
+	size_t   buffer_pos;
+	size_t   buffer_len;
+} MidiFileTrack;
+
+typedef struct MidiFile {
+	int            fd;
+	ushort         format;
+	short          division;      // ticks per quarter note, or SMPTE format if negative
+
+	MidiFileTrack* tracks;
+	size_t         n_tracks;
+
+	// min-heap of track indices ordered by (tick, track index)
+	uint*          heap;
+	size_t         heap_len;
+
+	// time keeping. Elapsed time is kept as an exact fraction of a second:
+	//     seconds = time_numerator / time_denominator
+	uint         tempo;
+	uint64_t     tick;
+	uint64_t     time_numerator;
+	uint64_t     time_denominator;
+} MidiFile;
+
+typedef struct MidiFileEvent {
+	uint64_t sample;        // absolute sample position of this event
+	bool     is_midi;       // false for meta and sysex events, which are consumed by the reader
+	byte     data[3];       // complete midi message, running status resolved
+	size_t   length;
+	uint     sysex_length;  // the bytes after 0xF0 of a sysex event, which are skipped. 0 for the others
+} MidiFileEvent;
+
+
+static int midi_file_track_read_byte(MidiFile* file, MidiFileTrack* track) {
+	if (track->buffer_pos >= track->buffer_len) {
+		if (track->pos >= track->end) return -1;
+		size_t want = track->end - track->pos;
+		if (want > MIDI_FILE_TRACK_BUFFER_SIZE) want = MIDI_FILE_TRACK_BUFFER_SIZE;
+		ssize_t got = pread(file->fd, track->buffer, want, track->pos);
+		if (got <= 0) return -1;
+		track->pos       += got;
+		track->buffer_len = got;
+		track->buffer_pos = 0;
+	}
+	return track->buffer[track->buffer_pos++];
+}
+
+static bool midi_file_track_read_varint(MidiFile* file, MidiFileTrack* track, uint* out) {
+	uint value = 0;
+	for (size_t i = 0; i < 4; i++) {
+		int c = midi_file_track_read_byte(file, track);
+		if (c < 0) return false;
+		value = (value << 7) | (c & 0x7F);
+		if (!(c & 0x80)) {
+			*out = value;
+			return true;
+		}
+	}
+	return false; // variable length quantities are at most 4 bytes
+}
+
+static bool midi_file_track_skip(MidiFileTrack* track, uint n) {
+	size_t buffered = track->buffer_len - track->buffer_pos;
+	if (n <= buffered) {
+		track->buffer_pos += n;
+		return true;
+	}
+	n -= buffered;
+	track->buffer_pos = track->buffer_len = 0;
+	if (n > track->end - track->pos) return false;
+	track->pos += n;
+	return true;
+}
+
+// reads the delta time of the next event, marks the track as done at the end of its chunk
+static void midi_file_track_advance(MidiFile* file, MidiFileTrack* track) {
+	uint delta;
+	if (track->done || !midi_file_track_read_varint(file, track, &delta)) {
+		track->done = true;
+		return;
+	}
+	track->tick += delta;
+}
+
+
+// the track heap:
+
+static bool midi_file_heap_less(MidiFile* file, uint a, uint b) {
+	if (file->tracks[a].tick != file->tracks[b].tick)
+		return file->tracks[a].tick < file->tracks[b].tick;
+	return a < b;
+}
+
+static void midi_file_heap_sift_down(MidiFile* file, size_t i) {
+	for (;;) {
+		size_t smallest = i;
+		size_t l = 2*i + 1;
+		size_t r = 2*i + 2;
+		if (l < file->heap_len && midi_file_heap_less(file, file->heap[l], file->heap[smallest])) smallest = l;
+		if (r < file->heap_len && midi_file_heap_less(file, file->heap[r], file->heap[smallest])) smallest = r;
+		if (smallest == i) return;
+		uint tmp = file->heap[i];
+		file->heap[i] = file->heap[smallest];
+		file->heap[smallest] = tmp;
+		i = smallest;
+	}
+}
+
+
+// time keeping:
+
+static void midi_file_advance_to_tick(MidiFile* file, uint64_t tick) {
+	if (tick <= file->tick) return;
+	uint64_t delta = tick - file->tick;
+	file->tick = tick;
+	if (file->division >= 0) { // delta * tempo / (division * 1e6) seconds
+		file->time_numerator += delta * file->tempo;
+	} else { // SMPTE: delta / (frames per second * ticks per frame) seconds
+		file->time_numerator += delta;
+	}
+}
+
+static uint64_t midi_file_current_sample(MidiFile* file) {
+	return file->time_numerator / file->time_denominator * SAMPLE_RATE
+		+ file->time_numerator % file->time_denominator * SAMPLE_RATE / file->time_denominator;
+}
+
+
+// public interface:
+
+void midi_file_close(MidiFile* file) {
+	if (file->fd >= 0) close(file->fd);
+	free(file->tracks);
+	free(file->heap);
+	memset(file, 0, sizeof(MidiFile));
+	file->fd = -1;
+}
+
+bool midi_file_open(MidiFile* file, const char* path) {
+	memset(file, 0, sizeof(MidiFile));
+	file->fd = open(path, O_RDONLY);
+	if (file->fd < 0) {
+		fprintf(stderr, "error: unable to open midi file '%s'\n", path);
+		return false;
+	}
+
+	byte header[14];
+	if (pread(file->fd, header, sizeof(header), 0) != sizeof(header) || memcmp(header, "MThd", 4)) {
+		fprintf(stderr, "error: '%s' is not a standard midi file\n", path);
+		midi_file_close(file);
+		return false;
+	}
+	uint   header_len = header[4] << 24 | header[5] << 16 | header[6] << 8 | header[7];
+	ushort n_tracks   = header[10] << 8 | header[11];
+	file->format      = header[8] << 8 | header[9];
+	file->division    = (short)(header[12] << 8 | header[13]);
+	file->tempo       = MIDI_FILE_DEFAULT_TEMPO;
+
+	if (file->division == 0) {
+		fprintf(stderr, "error: '%s' has a time division of zero\n", path);
+		midi_file_close(file);
+		return false;
+	}
+	if (file->division > 0) {
+		file->time_denominator = (uint64_t)file->division * 1000000;
+	} else {
+		uint fps             = -(sbyte)(file->division >> 8);
+		uint ticks_per_frame = file->division & 0xFF;
+		file->time_denominator = (uint64_t)fps * ticks_per_frame;
+		if (file->time_denominator == 0) file->time_denominator = 1;
+	}
+
+	file->tracks = calloc(n_tracks ? n_tracks : 1, sizeof(MidiFileTrack));
+	file->heap   = calloc(n_tracks ? n_tracks : 1, sizeof(uint));
+	if (!file->tracks || !file->heap) {
+		fprintf(stderr, "error: out of memory for the %d tracks of '%s'\n", n_tracks, path);
+		midi_file_close(file);
+		return false;
+	}
+
+	// locate the track chunks, skipping unknown chunk types
+	off_t pos = 8 + header_len;
+	while (file->n_tracks < n_tracks) {
+		byte chunk[8];
+		if (pread(file->fd, chunk, sizeof(chunk), pos) != sizeof(chunk)) break;
+		uint chunk_len = chunk[4] << 24 | chunk[5] << 16 | chunk[6] << 8 | chunk[7];
+		pos += 8;
+		if (!memcmp(chunk, "MTrk", 4)) {
+			MidiFileTrack* track = &file->tracks[file->n_tracks];
+			track->pos = pos;
+			track->end = pos + chunk_len;
+			midi_file_track_advance(file, track);
+			if (!track->done) file->heap[file->heap_len++] = file->n_tracks;
+			file->n_tracks++;
+		}
+		pos += chunk_len;
+	}
+	if (file->n_tracks < n_tracks) {
+		fprintf(stderr, "warning: '%s' contains %zu of %d tracks\n", path, file->n_tracks, n_tracks);
+	}
+
+	for (size_t i = file->heap_len; i-- > 0;) midi_file_heap_sift_down(file, i);
+	return true;
+}
+
+// Reads the next event in playback order. Returns false at the end of the file.
+// Meta and sysex events are handled here and returned with is_midi unset, so
+// that the caller still sees time advancing on them.
+bool midi_file_next_event(MidiFile* file, MidiFileEvent* event) {
+	while (file->heap_len) {
+		uint           track_index = file->heap[0];
+		MidiFileTrack* track       = &file->tracks[track_index];
+		uint64_t       tick        = track->tick;
+
+		event->is_midi      = false;
+		event->length       = 0;
+		event->sysex_length = 0;
+
+		bool end_of_track = false;
+		int  c            = midi_file_track_read_byte(file, track);
+		byte status       = c;
+		if (c < 0) {
+			end_of_track = true;
+		} else if (c < 0x80) { // running status
+			status = track->running_status;
+			if (!status) {
+				end_of_track = true; // corrupt track, no status to run with
+			} else {
+				event->data[0] = status;
+				event->data[1] = c;
+				event->length  = 2;
+			}
+		} else {
+			if (c < 0xF0) track->running_status = c;
+			else if (c < 0xF8) track->running_status = 0; // sysex and system common cancel running status
+			event->data[0] = c;
+			event->length  = 1;
+		}
+
+		if (!end_of_track && status == 0xFF) { // meta event
+			int  type = midi_file_track_read_byte(file, track);
+			uint len;
+			if (type < 0 || !midi_file_track_read_varint(file, track, &len)) {
+				end_of_track = true;
+			} else if (type == 0x2F) { // end of track
+				end_of_track = true;
+			} else if (type == 0x51 && len == 3) { // set tempo, applies to the next delta time
+				int a = midi_file_track_read_byte(file, track);
+				int b = midi_file_track_read_byte(file, track);
+				int d = midi_file_track_read_byte(file, track);
+				if (d < 0) end_of_track = true;
+				else {
+					midi_file_advance_to_tick(file, tick);
+					file->tempo = a << 16 | b << 8 | d;
+				}
+			} else if (!midi_file_track_skip(track, len)) {
+				end_of_track = true;
+			}
+			event->length = 0;
+		} else if (!end_of_track && (status == 0xF0 || status == 0xF7)) { // sysex
+			uint len;
+			if (!midi_file_track_read_varint(file, track, &len) || !midi_file_track_skip(track, len))
+				end_of_track = true;
+			else if (status == 0xF0)
+				event->sysex_length = len; // the continuations and escapes of 0xF7 are left out
+			event->length = 0;
+		} else if (!end_of_track) { // channel and system common messages
+			size_t length;
+			switch (status >> 4) {
+				break; case 0xC: case 0xD: length = 2;
+				break; case 0xF:           length = (status == 0xF2) ? 3 : (status == 0xF1 || status == 0xF3) ? 2 : 1;
+				break; default:            length = 3;
+			}
+			while (event->length < length) {
+				int d = midi_file_track_read_byte(file, track);
+				if (d < 0) {
+					end_of_track = true;
+					break;
+				}
+				event->data[event->length++] = d;
+			}
+			event->is_midi = !end_of_track;
+		}
+
+		if (end_of_track) {
+			// only the last track to end makes time advance, like mido's merged track
+			file->heap[0] = file->heap[--file->heap_len];
+			midi_file_heap_sift_down(file, 0);
+			if (file->heap_len) continue;
+			event->is_midi = false;
+			event->length  = 0;
+		} else {
+			midi_file_track_advance(file, track);
+			if (track->done) {
+				file->heap[0] = file->heap[--file->heap_len];
+			}
+			midi_file_heap_sift_down(file, 0);
+		}
+
+		midi_file_advance_to_tick(file, tick);
+		event->sample = midi_file_current_sample(file);
+		return true;
+	}
+	return false;
+}
@@ -0,0 +1,200 @@
+// Buffered PCM output for the simulator, as raw samples or as a WAV file.
+//
+// Samples are converted into a large buffer which is written out with a single
+// write() whenever it fills up, instead of a printf() per byte. The WAV writer
+// makes sox/lame unnecessary for getting a playable file.
+//
+// With direct set, the file is opened with O_DIRECT to keep long renders out of
+// the page cache. The buffer is then page aligned and only ever written in
+// whole multiples of PCM_OUTPUT_ALIGNMENT, the unaligned tail is written after
+// dropping O_DIRECT at close. Falls back to normal writes where O_DIRECT is
+// not supported.
+//
+// When the output can't be seeked (a pipe), the sizes in the WAV header are
+// left at 0xFFFFFFFF, which most readers take as "until the end of the stream".
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#define PCM_OUTPUT_BUFFER_SIZE (1 << 20)
+#define PCM_OUTPUT_ALIGNMENT   4096
+#define PCM_WAV_HEADER_SIZE    44
+
+enum PcmFormat {
+	PCM_RAW_S32 = 0, // little endian 32 bit signed, what -r has always output
+	PCM_WAV_S32 = 1,
+	PCM_WAV_S16 = 2, // the upper 16 bits of each sample
+};
+typedef byte PcmFormat;
+
+typedef struct PcmOutput {
+	int        fd;
+	PcmFormat  format;
+	bool       direct;            // fd is currently opened with O_DIRECT
+	bool       close_fd;          // false for stdout
+
+	byte*      buffer;
+	size_t     buffer_len;
+	uint64_t   n_samples;
+} PcmOutput;
+
+
+static size_t pcm_output_sample_size(PcmFormat format) {
+	return (format == PCM_WAV_S16) ? 2 : 4;
+}
+
+static bool pcm_output_write_all(int fd, const byte* data, size_t length) {
+	while (length) {
+		ssize_t written = write(fd, data, length);
+		if (written < 0 && errno == EINTR) continue;
+		if (written <= 0) {
+			perror("error: unable to write pcm output");
+			return false;
+		}
+		data   += written;
+		length -= written;
+	}
+	return true;
+}
+
+static void pcm_output_put32(byte* p, uint value) {
+	p[0] = value; p[1] = value >> 8; p[2] = value >> 16; p[3] = value >> 24;
+}
+
+// sizes_known unset writes the streaming placeholders. Files past 4GiB get the placeholders too
+static void pcm_output_wav_header(byte* header, PcmFormat format, uint64_t n_samples, bool sizes_known) {
+	uint sample_size = pcm_output_sample_size(format);
+	uint data_size   = 0xFFFFFFFF;
+	uint riff_size   = 0xFFFFFFFF;
+	if (sizes_known && n_samples * sample_size <= 0xFFFFFFFF - PCM_WAV_HEADER_SIZE) {
+		data_size = n_samples * sample_size;
+		riff_size = data_size + PCM_WAV_HEADER_SIZE - 8;
+	}
+
+	memcpy(header + 0, "RIFF", 4);
+	pcm_output_put32(header +  4, riff_size);
+	memcpy(header + 8, "WAVEfmt ", 8);
+	pcm_output_put32(header + 16, 16);                                      // fmt chunk size
+	pcm_output_put32(header + 20, 1 | 1 << 16);                             // PCM, mono
+	pcm_output_put32(header + 24, SAMPLE_RATE);
+	pcm_output_put32(header + 28, SAMPLE_RATE * sample_size);               // bytes per second
+	pcm_output_put32(header + 32, sample_size | (sample_size * 8) << 16);   // block align, bits per sample
+	memcpy(header + 36, "data", 4);
+	pcm_output_put32(header + 40, data_size);
+}
+
+// writes out the whole aligned part of the buffer, keeping the remainder
+static bool pcm_output_flush(PcmOutput* output) {
+	size_t length = output->buffer_len;
+	if (output->direct) length -= length % PCM_OUTPUT_ALIGNMENT;
+	if (!pcm_output_write_all(output->fd, output->buffer, length)) return false;
+	memmove(output->buffer, output->buffer + length, output->buffer_len - length);
+	output->buffer_len -= length;
+	return true;
+}
+
+
+// public interface:
+
+// opens path for writing, or stdout if path is NULL or "-"
+bool pcm_output_open(PcmOutput* output, const char* path, PcmFormat format, bool direct) {
+	memset(output, 0, sizeof(PcmOutput));
+	output->format = format;
+
+	if (!path || !strcmp(path, "-")) {
+		output->fd = STDOUT_FILENO;
+	} else {
+		int flags = O_WRONLY | O_CREAT | O_TRUNC;
+#ifdef O_DIRECT
+		if (direct) {
+			output->fd     = open(path, flags | O_DIRECT, 0644);
+			output->direct = output->fd >= 0;
+			if (!output->direct) fprintf(stderr, "warning: O_DIRECT is not supported for '%s', writing it normally\n", path);
+		}
+#endif
+		if (!output->direct) output->fd = open(path, flags, 0644);
+		if (output->fd < 0) {
+			fprintf(stderr, "error: unable to open '%s' for writing\n", path);
+			return false;
+		}
+		output->close_fd = true;
+	}
+
+	if (posix_memalign((void**)&output->buffer, PCM_OUTPUT_ALIGNMENT, PCM_OUTPUT_BUFFER_SIZE)) {
+		if (output->close_fd) close(output->fd);
+		return false;
+	}
+	if (format != PCM_RAW_S32) { // a placeholder, filled in at close if the file can be seeked
+		pcm_output_wav_header(output->buffer, format, 0, false);
+		output->buffer_len = PCM_WAV_HEADER_SIZE;
+	}
+	return true;
+}
+
+bool pcm_output_write(PcmOutput* output, const WSample* samples, size_t n) {
+	size_t sample_size = pcm_output_sample_size(output->format);
+	output->n_samples += n;
+	while (n) {
+		size_t room = (PCM_OUTPUT_BUFFER_SIZE - output->buffer_len) / sample_size;
+		size_t len  = (n < room) ? n : room;
+		byte*  p    = output->buffer + output->buffer_len;
+		if (sample_size == 4) {
+			for (size_t i = 0; i < len; i++) {
+				uint s = samples[i];
+				p[4*i+0] = s; p[4*i+1] = s >> 8; p[4*i+2] = s >> 16; p[4*i+3] = s >> 24;
+			}
+		} else {
+			for (size_t i = 0; i < len; i++) {
+				uint s = samples[i] >> 16;
+				p[2*i+0] = s; p[2*i+1] = s >> 8;
+			}
+		}
+		output->buffer_len += len * sample_size;
+		samples += len;
+		n       -= len;
+		if (PCM_OUTPUT_BUFFER_SIZE - output->buffer_len < sample_size && !pcm_output_flush(output)) return false;
+	}
+	return true;
+}
+
+// writes n samples of 0, without converting anything
+bool pcm_output_write_silence(PcmOutput* output, size_t n) {
+	size_t sample_size = pcm_output_sample_size(output->format);
+	output->n_samples += n;
+	while (n) {
+		size_t room = (PCM_OUTPUT_BUFFER_SIZE - output->buffer_len) / sample_size;
+		size_t len  = (n < room) ? n : room;
+		memset(output->buffer + output->buffer_len, 0, len * sample_size);
+		output->buffer_len += len * sample_size;
+		n -= len;
+		if (PCM_OUTPUT_BUFFER_SIZE - output->buffer_len < sample_size && !pcm_output_flush(output)) return false;
+	}
+	return true;
+}
+
+// flushes the rest, completes the WAV header and closes the file
+bool pcm_output_close(PcmOutput* output) {
+	bool ok = pcm_output_flush(output);
+#ifdef O_DIRECT
+	if (ok && output->direct) { // the unaligned tail
+		fcntl(output->fd, F_SETFL, fcntl(output->fd, F_GETFL) & ~O_DIRECT);
+		output->direct = false;
+		ok = pcm_output_flush(output);
+	}
+#endif
+	if (ok && output->format != PCM_RAW_S32 && lseek(output->fd, 0, SEEK_CUR) >= 0) {
+		byte header[PCM_WAV_HEADER_SIZE];
+		pcm_output_wav_header(header, output->format, output->n_samples, true);
+		ok = pwrite(output->fd, header, sizeof(header), 0) == sizeof(header);
+	}
+	if (output->close_fd) close(output->fd);
+	free(output->buffer);
+	output->buffer = NULL;
+	return ok;
+}
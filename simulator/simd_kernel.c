@@ -0,0 +1,222 @@
+// The generic SIMD kernel, included by simd_render.c once per instruction set.
+// SIMD_WIDTH is the number of 32 bit lanes, SIMD_NAME() suffixes every symbol.
+//
+// This mirrors fpga_step_generator() and fpga_generator_output() lane by lane.
+// The envelope registers are stepped with the carries and borrows of
+// fpga_render_span_as(), the ends of the phases those of fpga_step_envelope().
+// Branches become masks: comparisons give 0 or -1 per lane, and select() picks
+// between the results of both sides.
+
+#define vsi SIMD_NAME(vsi)
+#define vui SIMD_NAME(vui)
+#define vdf SIMD_NAME(vdf)
+
+typedef int    vsi __attribute__((vector_size(4 * SIMD_WIDTH)));
+typedef uint   vui __attribute__((vector_size(4 * SIMD_WIDTH)));
+typedef double vdf __attribute__((vector_size(8 * SIMD_WIDTH)));
+
+static inline __attribute__((always_inline)) vsi SIMD_NAME(select)(vsi mask, vsi a, vsi b) {
+    return (a & mask) | (b & ~mask);
+}
+
+static inline __attribute__((always_inline)) bool SIMD_NAME(any)(vsi mask) {
+    for (size_t lane = 0; lane < SIMD_WIDTH; lane++) if (mask[lane]) return true;
+    return false;
+}
+
+// the truncation when an int is stored in a Sample
+static inline __attribute__((always_inline)) vsi SIMD_NAME(to_sample)(vsi x) {
+    return ((vsi)((vui)x << 16)) >> 16;
+}
+
+// unsigned division. Lanes dividing by zero are never selected, they divide by one instead
+static inline __attribute__((always_inline)) vui SIMD_NAME(udiv)(vui a, vui b) {
+    b |= (vui)(b == 0) & 1;
+    return __builtin_convertvector(__builtin_convertvector(a, vdf) / __builtin_convertvector(b, vdf), vui);
+}
+
+static inline __attribute__((always_inline)) vsi SIMD_NAME(sdiv)(vsi a, vsi b) {
+    b |= (b == 0) & 1;
+    return __builtin_convertvector(__builtin_convertvector(a, vdf) / __builtin_convertvector(b, vdf), vsi);
+}
+
+// fpga_sine_lookup(), with the table reads done per lane since there is no portable gather
+static inline __attribute__((always_inline)) vsi SIMD_NAME(sine_lookup)(vui phase) {
+    const uint full = SINE_LUT_SIZE << SINE_INTERPOLATION_BITS;
+    vui quadrant = phase >> 30;
+    vui pos      = (phase >> (30 - SINE_LUT_BITS - SINE_INTERPOLATION_BITS)) & (full - 1);
+    pos = (vui)SIMD_NAME(select)((vsi)((quadrant & 1) != 0), (vsi)(full - pos), (vsi)pos);
+    vui index    = pos >> SINE_INTERPOLATION_BITS;
+    vsi fraction = (vsi)(pos & ((1 << SINE_INTERPOLATION_BITS) - 1));
+
+#if SINE_LUT_INTERPOLATE
+    vsi a, b;
+    for (size_t lane = 0; lane < SIMD_WIDTH; lane++) {
+        a[lane] = fpga_sine_table[index[lane]];
+        b[lane] = fpga_sine_table[index[lane] + 1];
+    }
+    vsi value = a + (((b - a) * fraction + (1 << (SINE_INTERPOLATION_BITS - 1))) >> SINE_INTERPOLATION_BITS);
+#else
+    index += (vui)(fraction >> (SINE_INTERPOLATION_BITS - 1));
+    vsi value;
+    for (size_t lane = 0; lane < SIMD_WIDTH; lane++) {
+        value[lane] = fpga_sine_table[index[lane]];
+    }
+#endif
+
+    return SIMD_NAME(select)((vsi)((quadrant & 2) != 0), -value, value);
+}
+
+// steps SIMD_WIDTH generators starting at generator index 'first' one sample, returns their outputs.
+// The lanes whose envelope phase changed are set in *changed
+static inline __attribute__((always_inline)) vsi SIMD_NAME(step_generators)(size_t first, const SimdEnvelope* env, uint instruments_present, bool sustained, vsi* changed) {
+    vui note_life  = *(vui*)&simd_bank.note_life[first]      + NOTE_LIFE_COEFF;
+    vui pos        = *(vui*)&simd_bank.wavelength_pos[first] + NOTE_LIFE_COEFF;
+    vui wavelength = *(vui*)&simd_bank.wavelength[first];
+    vsi enabled    = *(vsi*)&simd_bank.enabled[first];
+    *(vui*)&simd_bank.note_life[first] = note_life;
+
+    // fpga_step_envelope(), note_life doesn't wrap around within a block. Sustained lanes hold their level
+    vui env_phase = *(vui*)&simd_bank.envelope_phase[first];
+    vui effect    = *(vui*)&simd_bank.envelope_effect[first];
+    *changed      = (vsi){0};
+    if (!sustained) {
+        vui counter   = *(vui*)&simd_bank.envelope_counter[first];
+        vui remainder = *(vui*)&simd_bank.envelope_remainder[first];
+        vsi attacking = (vsi)(env_phase == ENVELOPE_ATTACK);
+        vsi decaying  = (vsi)(env_phase == ENVELOPE_DECAY);
+        vsi releasing = (vsi)(env_phase == ENVELOPE_RELEASE);
+        vsi stepping  = attacking | decaying | releasing;
+        counter       = (counter + (vui)stepping) & 0xffff;
+        vsi ending    = stepping & (vsi)(counter == 0);
+        attacking    &= ~ending;
+        decaying     &= ~ending;
+        releasing    &= ~ending;
+
+        if (SIMD_NAME(any)(attacking)) {
+            vui sum   = remainder + env->attack_step_remainder;
+            vsi carry = (vsi)(sum >= env->attack);
+            effect    = (vui)SIMD_NAME(select)(attacking, (vsi)(effect + env->attack_step - (vui)carry), (vsi)effect);
+            remainder = (vui)SIMD_NAME(select)(attacking, (vsi)(sum - (env->attack & (vui)carry)), (vsi)remainder);
+        }
+        if (SIMD_NAME(any)(decaying)) {
+            vsi borrow = (vsi)(remainder < env->decay_step_remainder);
+            effect     = (vui)SIMD_NAME(select)(decaying, (vsi)(effect - env->decay_step + (vui)borrow), (vsi)effect);
+            remainder  = (vui)SIMD_NAME(select)(decaying, (vsi)(remainder - env->decay_step_remainder + (env->decay & (vui)borrow)), (vsi)remainder);
+        }
+        if (SIMD_NAME(any)(releasing)) {
+            vui step     = *(vui*)&simd_bank.release_step[first];
+            vui step_rem = *(vui*)&simd_bank.release_remainder[first];
+            vsi borrow   = (vsi)(remainder < step_rem);
+            effect       = (vui)SIMD_NAME(select)(releasing, (vsi)(effect - step + (vui)borrow), (vsi)effect);
+            remainder    = (vui)SIMD_NAME(select)(releasing, (vsi)(remainder - step_rem + (env->release & (vui)borrow)), (vsi)remainder);
+        }
+        if (SIMD_NAME(any)(ending)) {
+            vsi attack_ends  = ending & (vsi)(env_phase == ENVELOPE_ATTACK);
+            vsi decay_ends   = ending & (vsi)(env_phase == ENVELOPE_DECAY);
+            vsi release_ends = ending & (vsi)(env_phase == ENVELOPE_RELEASE);
+            uint after_attack = env->decay ? ENVELOPE_DECAY : ENVELOPE_SUSTAIN;
+            uint peak         = env->decay ? 0xffff : env->scaled_sustain;
+            env_phase = (vui)SIMD_NAME(select)(attack_ends,  (vsi){0} + (int)after_attack,        (vsi)env_phase);
+            counter   = (vui)SIMD_NAME(select)(attack_ends,  (vsi){0} + (int)env->decay,          (vsi)counter);
+            effect    = (vui)SIMD_NAME(select)(attack_ends,  (vsi){0} + (int)peak,                (vsi)effect);
+            remainder = (vui)SIMD_NAME(select)(attack_ends,  (vsi){0},                            (vsi)remainder);
+            env_phase = (vui)SIMD_NAME(select)(decay_ends,   (vsi){0} + ENVELOPE_SUSTAIN,         (vsi)env_phase);
+            effect    = (vui)SIMD_NAME(select)(decay_ends,   (vsi){0} + (int)env->scaled_sustain, (vsi)effect);
+            env_phase = (vui)SIMD_NAME(select)(release_ends, (vsi){0} + ENVELOPE_DONE,            (vsi)env_phase);
+            effect    = (vui)SIMD_NAME(select)(release_ends, (vsi){0},                            (vsi)effect);
+            *(vui*)&simd_bank.envelope_phase[first] = env_phase;
+            *changed = ending;
+        }
+        effect &= 0xffff;
+        *(vui*)&simd_bank.envelope_counter[first]   = counter;
+        *(vui*)&simd_bank.envelope_effect[first]    = effect;
+        *(vui*)&simd_bank.envelope_remainder[first] = remainder & 0xffff;
+    }
+
+    // the return of fpga_step_generator()
+    vsi active = enabled | (vsi)(env_phase == ENVELOPE_RELEASE);
+    if (!SIMD_NAME(any)(active)) {
+        *(vui*)&simd_bank.wavelength_pos[first] = pos;
+        return (vsi){0};
+    }
+
+    pos -= wavelength & (vui)(active & (vsi)(pos >= wavelength));
+    *(vui*)&simd_bank.wavelength_pos[first] = pos;
+
+    // the waveforms, only the ones used by this group of generators are computed
+    vsi instrument = *(vsi*)&simd_bank.instrument[first];
+    vsi sample     = {0};
+    if (instruments_present & (1 << SQUARE)) {
+        vsi square = SIMD_NAME(select)((vsi)((pos << 1) >= wavelength), (vsi){0} - SAMPLE_MAX, (vsi){0} + SAMPLE_MAX);
+        sample = SIMD_NAME(select)(instrument == SQUARE, square, sample);
+    }
+    if (instruments_present & (1 << TRIANGLE)) {
+        vsi half     = (vsi)(wavelength >> 1);
+        vsi quarter  = (vsi)(wavelength >> 2);
+        vsi p        = SIMD_NAME(select)((vsi)(pos > (vui)(half + quarter)), (vsi)pos - half - quarter, (vsi)pos + quarter);
+        vsi distance = p - half;
+        distance     = SIMD_NAME(select)(distance < 0, -distance, distance);
+        vsi triangle = SIMD_NAME(to_sample)(SIMD_NAME(sdiv)((distance - quarter) * SAMPLE_MAX, quarter));
+        sample = SIMD_NAME(select)(instrument == TRIANGLE, triangle, sample);
+    }
+    if (instruments_present & (1 << SAWTOOTH)) {
+        vsi sawtooth = SIMD_NAME(to_sample)((vsi)SIMD_NAME(udiv)((pos * 2 - wavelength) * SAMPLE_MAX, wavelength));
+        sample = SIMD_NAME(select)(instrument == SAWTOOTH, sawtooth, sample);
+    }
+    if (instruments_present & (1 << SINE)) {
+        vui phase = pos * *(vui*)&simd_bank.wavelength_reciprocal[first];
+        sample = SIMD_NAME(select)(instrument == SINE, SIMD_NAME(sine_lookup)(phase), sample);
+    }
+    if (instruments_present & (((1u << N_WAVETABLE_INSTRUMENTS) - 1) << WAVETABLE_SQUARE)) {
+        vui phase = pos * *(vui*)&simd_bank.wavelength_reciprocal[first];
+        vsi value;
+        for (size_t lane = 0; lane < SIMD_WIDTH; lane++) {
+            value[lane] = fpga_wavetable_lookup(simd_bank.wavetable[first + lane], phase[lane]);
+        }
+        sample = SIMD_NAME(select)((vsi)((vui)(instrument - WAVETABLE_SQUARE) < N_WAVETABLE_INSTRUMENTS), value, sample);
+    }
+
+    // fpga_apply_envelope()
+    vui last = *(vui*)&simd_bank.envelope_level[first];
+    *(vui*)&simd_bank.envelope_level[first] = (vui)SIMD_NAME(select)(enabled, (vsi)effect, (vsi)last);
+
+    vsi out = SIMD_NAME(to_sample)((sample * (vsi)effect) >> 16) * *(vsi*)&simd_bank.velocity[first];
+    return out & active;
+}
+
+void SIMD_NAME(simd_generate_sound_block)(FPGA* fpga, WSample* out, size_t n) {
+    while (n) {
+        size_t len = fpga_begin_block(fpga, (n < FPGA_BLOCK_SIZE) ? n : FPGA_BLOCK_SIZE);
+        if (simd_bank_wraps(fpga, len)) { // once every couple of hours
+            fpga_generate_sound_block(fpga, out, len);
+            out += len;
+            n   -= len;
+            continue;
+        }
+        SimdEnvelope env;
+        simd_bank_load(fpga, &env);
+
+        for (size_t i = 0; i < len; i++) {
+            vsi sum = {0};
+            for (size_t first = 0; first < simd_bank.n_lanes; first += SIMD_WIDTH) {
+                size_t group = first / SIMD_MAX_WIDTH;
+                vsi    changed;
+                sum += SIMD_NAME(step_generators)(first, &env, simd_bank.instruments_present[group], simd_bank.group_sustained[group], &changed);
+                TRACE(if (SIMD_NAME(any)(changed)) simd_trace_envelope_phases(fpga, first, SIMD_WIDTH, (const int*)&changed, fpga->sample_count + i);)
+            }
+            WSample total = 0;
+            for (size_t lane = 0; lane < SIMD_WIDTH; lane++) total += sum[lane];
+            out[i] = fpga_mix_generators(fpga, total);
+        }
+
+        simd_bank_store(fpga);
+        fpga_end_block(fpga, len);
+        out += len;
+        n   -= len;
+    }
+}
+
+#undef vsi
+#undef vui
+#undef vdf
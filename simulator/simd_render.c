@@ -0,0 +1,248 @@
+// SIMD versions of fpga_generate_sound_block() for the simulator.
+//
+// The FPGA runs all of its generators in parallel, while the reference block
+// renderer walks them one by one through an array of packed structs. Here the
+// generator registers are mirrored into a structure of arrays, so that one
+// instruction can step 8 (AVX2) or 4 (SSE4.1) generators at a time. The
+// kernels are written once with GCC vector extensions in simd_kernel.c, and
+// compiled once per instruction set. The best one supported by the CPU is
+// picked at runtime, the reference block renderer is the scalar fallback and
+// takes over from the kernels while an attack, decay or release is set.
+//
+// All of this is bit-exact with the reference: every integer operation is
+// done with the same width and signedness as in fpga_generator_output() and
+// fpga_render_span_as(), the envelope registers included. The divisions of the
+// waveforms are done in doubles, which is exact for 32 bit operands.
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+
+#define SIMD_MAX_WIDTH  8
+#define SIMD_BANK_SIZE  ((N_GENERATORS + SIMD_MAX_WIDTH - 1) / SIMD_MAX_WIDTH * SIMD_MAX_WIDTH)
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__)) && !OSCILLATOR_DDS // the kernels only have the wavelength_pos oscillator
+#define SIMD_HAVE_X86_KERNELS 1
+#endif
+
+#ifdef SIMD_HAVE_X86_KERNELS // the bank and its helpers are only used by the kernels
+// The structure of arrays mirror of the active generators. It is loaded before
+// and stored after each block, the registers which can change inside a block
+// are note_life, wavelength_pos, last_active_envelope_effect and the envelope
+// registers. The idle generators are left out, like in the reference block renderer.
+typedef struct SimdGeneratorBank {
+    size_t n_lanes;                                                            // active generators, rounded up to SIMD_MAX_WIDTH
+    ushort generator_index     [SIMD_BANK_SIZE];
+    int  enabled               [SIMD_BANK_SIZE] __attribute__((aligned(32))); // 0 or -1, used as a mask
+    int  instrument            [SIMD_BANK_SIZE] __attribute__((aligned(32)));
+    int  velocity              [SIMD_BANK_SIZE] __attribute__((aligned(32))); // 0 in the padding lanes
+    uint wavelength            [SIMD_BANK_SIZE] __attribute__((aligned(32)));
+    uint wavelength_reciprocal [SIMD_BANK_SIZE] __attribute__((aligned(32)));
+    uint note_life             [SIMD_BANK_SIZE] __attribute__((aligned(32)));
+    uint wavelength_pos        [SIMD_BANK_SIZE] __attribute__((aligned(32)));
+    uint envelope_level        [SIMD_BANK_SIZE] __attribute__((aligned(32))); // last_active_envelope_effect
+    uint envelope_phase        [SIMD_BANK_SIZE] __attribute__((aligned(32)));
+    uint envelope_counter      [SIMD_BANK_SIZE] __attribute__((aligned(32)));
+    uint envelope_effect       [SIMD_BANK_SIZE] __attribute__((aligned(32)));
+    uint envelope_remainder    [SIMD_BANK_SIZE] __attribute__((aligned(32)));
+    uint release_step          [SIMD_BANK_SIZE] __attribute__((aligned(32))); // envelope_release_step
+    uint release_remainder     [SIMD_BANK_SIZE] __attribute__((aligned(32))); // envelope_release_step_remainder
+    ushort wavetable           [SIMD_BANK_SIZE];                              // read lane by lane, there is no gather
+
+    // which instruments each group of SIMD_MAX_WIDTH generators use, so that absent waveforms can be skipped
+    uint instruments_present   [SIMD_BANK_SIZE / SIMD_MAX_WIDTH];
+    // whether each generator holds its sustain level for the whole block, and whether a whole group does
+    bool sustained             [SIMD_BANK_SIZE];
+    bool group_sustained       [SIMD_BANK_SIZE / SIMD_MAX_WIDTH];
+} SimdGeneratorBank;
+
+// the global envelope and its steps, unpacked into the types the kernels work with
+typedef struct SimdEnvelope {
+    uint attack;
+    uint decay;
+    uint release;
+    uint scaled_sustain;
+    uint attack_step;
+    uint attack_step_remainder;
+    uint decay_step;
+    uint decay_step_remainder;
+} SimdEnvelope;
+
+static __thread SimdGeneratorBank simd_bank; // one per thread, for the batch renderer
+
+static void simd_bank_load(FPGA* fpga, SimdEnvelope* env) {
+    simd_bank.n_lanes = (fpga->n_active_generators + SIMD_MAX_WIDTH - 1) / SIMD_MAX_WIDTH * SIMD_MAX_WIDTH;
+    for (size_t i = 0; i < simd_bank.n_lanes; i++) {
+        if (i < fpga->n_active_generators) {
+            FPGAGeneratorState* generator = &fpga->generators[fpga->active_generators[i]];
+            simd_bank.generator_index[i]       = fpga->active_generators[i];
+            simd_bank.enabled[i]               = generator->data.enabled ? -1 : 0;
+            simd_bank.instrument[i]            = generator->data.instrument;
+            simd_bank.velocity[i]              = generator->data.velocity;
+            simd_bank.wavelength[i]            = generator->wavelength;
+            simd_bank.wavelength_reciprocal[i] = generator->wavelength_reciprocal;
+            simd_bank.note_life[i]             = generator->note_life;
+            simd_bank.wavelength_pos[i]        = generator->wavelength_pos;
+            simd_bank.envelope_level[i]        = generator->last_active_envelope_effect;
+            simd_bank.envelope_phase[i]        = generator->envelope_phase;
+            simd_bank.envelope_counter[i]      = generator->envelope_counter;
+            simd_bank.envelope_effect[i]       = generator->envelope_effect;
+            simd_bank.envelope_remainder[i]    = generator->envelope_remainder;
+            simd_bank.release_step[i]          = generator->envelope_release_step;
+            simd_bank.release_remainder[i]     = generator->envelope_release_step_remainder;
+            simd_bank.wavetable[i]             = generator->wavetable;
+            simd_bank.sustained[i]             = generator->data.enabled && generator->envelope_phase == ENVELOPE_SUSTAIN;
+        } else { // padding, silent whatever it does
+            simd_bank.enabled[i]               = 0;
+            simd_bank.instrument[i]            = SQUARE;
+            simd_bank.velocity[i]              = 0;
+            simd_bank.wavelength[i]            = 1;
+            simd_bank.wavelength_reciprocal[i] = 0;
+            simd_bank.note_life[i]             = 0;
+            simd_bank.wavelength_pos[i]        = 0;
+            simd_bank.envelope_level[i]        = 0;
+            simd_bank.envelope_phase[i]        = ENVELOPE_DONE;
+            simd_bank.envelope_counter[i]      = 0;
+            simd_bank.envelope_effect[i]       = 0;
+            simd_bank.envelope_remainder[i]    = 0;
+            simd_bank.release_step[i]          = 0;
+            simd_bank.release_remainder[i]     = 0;
+            simd_bank.wavetable[i]             = 0;
+            simd_bank.sustained[i]             = true;
+        }
+    }
+    for (size_t g = 0; g < simd_bank.n_lanes / SIMD_MAX_WIDTH; g++) {
+        simd_bank.instruments_present[g] = 0;
+        simd_bank.group_sustained[g]     = true;
+        for (size_t i = g * SIMD_MAX_WIDTH; i < (g+1) * SIMD_MAX_WIDTH && i < fpga->n_active_generators; i++) {
+            simd_bank.instruments_present[g] |= 1u << (simd_bank.instrument[i] & 31);
+            simd_bank.group_sustained[g]     &= simd_bank.sustained[i];
+        }
+    }
+
+    Envelope e = fpga->global_state.envelope;
+    const FPGAEnvelopeSteps* steps = &fpga->envelope_steps;
+    env->attack                = e.attack;
+    env->decay                 = e.decay;
+    env->release               = e.release;
+    env->scaled_sustain        = steps->scaled_sustain;
+    env->attack_step           = steps->attack_step;
+    env->attack_step_remainder = steps->attack_step_remainder;
+    env->decay_step            = steps->decay_step;
+    env->decay_step_remainder  = steps->decay_step_remainder;
+}
+
+static void simd_bank_store(FPGA* fpga) {
+    for (size_t i = 0; i < fpga->n_active_generators; i++) {
+        FPGAGeneratorState* generator = &fpga->generators[simd_bank.generator_index[i]];
+        generator->note_life                   = simd_bank.note_life[i];
+        generator->wavelength_pos              = simd_bank.wavelength_pos[i];
+        generator->last_active_envelope_effect = simd_bank.envelope_level[i];
+        generator->envelope_phase              = simd_bank.envelope_phase[i];
+        generator->envelope_counter            = simd_bank.envelope_counter[i];
+        generator->envelope_effect             = simd_bank.envelope_effect[i];
+        generator->envelope_remainder          = simd_bank.envelope_remainder[i];
+    }
+}
+
+// whether the note_life of an active generator wraps around within the next n samples,
+// which reloads its envelope. The kernels leave that to the reference block renderer
+static bool simd_bank_wraps(const FPGA* fpga, size_t n) {
+    for (size_t i = 0; i < fpga->n_active_generators; i++) {
+        if (fpga->generators[fpga->active_generators[i]].note_life > UINT32_MAX - NOTE_LIFE_COEFF * n) return true;
+    }
+    return false;
+}
+
+#if ENABLE_TRACE
+// traces the generators of the lanes whose envelope phase changed on the given sample
+static void simd_trace_envelope_phases(FPGA* fpga, size_t first, size_t width, const int* changed, uint64_t sample) {
+    for (size_t lane = 0; lane < width; lane++) {
+        if (!changed[lane] || first + lane >= fpga->n_active_generators) continue;
+        const FPGAGeneratorState* generator = &fpga->generators[simd_bank.generator_index[first + lane]];
+        trace_fpga_event(sample, TRACE_ENVELOPE_PHASE, simd_bank.generator_index[first + lane],
+            generator->data.channel_index, generator->data.note_index, simd_bank.envelope_phase[first + lane], 0);
+    }
+}
+#endif
+#endif
+
+
+#ifdef SIMD_HAVE_X86_KERNELS
+
+#pragma GCC push_options
+#pragma GCC target("avx2")
+#define SIMD_WIDTH   8
+#define SIMD_NAME(x) x##_avx2
+#include "simd_kernel.c"
+#undef SIMD_WIDTH
+#undef SIMD_NAME
+#pragma GCC pop_options
+
+#pragma GCC push_options
+#pragma GCC target("sse4.1")
+#define SIMD_WIDTH   4
+#define SIMD_NAME(x) x##_sse4
+#include "simd_kernel.c"
+#undef SIMD_WIDTH
+#undef SIMD_NAME
+#pragma GCC pop_options
+#endif
+
+
+// runtime selection:
+
+typedef void (*RenderBlockFunction)(FPGA* fpga, WSample* out, size_t n);
+
+typedef struct SimdRenderer {
+    const char*         name;
+    RenderBlockFunction render;
+} SimdRenderer;
+
+#ifdef SIMD_HAVE_X86_KERNELS
+// The kernels step every lane of a group on every sample, where the reference
+// block renderer steps a generator through its attack, decay and release in
+// spans. With such an envelope set the reference is the faster one on songs
+// with many short notes, so "auto" only uses the kernels while the envelope is
+// sustain-only. The envelope is checked per call, since the knobs can change it
+static RenderBlockFunction simd_auto_kernel = fpga_generate_sound_block;
+
+static void simd_generate_sound_block_auto(FPGA* fpga, WSample* out, size_t n) {
+    Envelope env = fpga->global_state.envelope;
+    if (env.attack || env.decay || env.release) fpga_generate_sound_block(fpga, out, n);
+    else simd_auto_kernel(fpga, out, n);
+}
+#endif
+
+// returns the renderer with the given name, or for "auto" the fastest one the cpu supports for the envelope
+// returns NULL when the name is unknown or not supported by this cpu
+const SimdRenderer* simd_select_renderer(const char* name) {
+    static const SimdRenderer scalar = {"scalar", fpga_generate_sound_block};
+#ifdef SIMD_HAVE_X86_KERNELS
+    static const SimdRenderer avx2      = {"avx2",      simd_generate_sound_block_avx2};
+    static const SimdRenderer sse4      = {"sse4",      simd_generate_sound_block_sse4};
+    static const SimdRenderer auto_avx2 = {"auto-avx2", simd_generate_sound_block_auto};
+    static const SimdRenderer auto_sse4 = {"auto-sse4", simd_generate_sound_block_auto};
+    __builtin_cpu_init();
+    bool have_avx2 = __builtin_cpu_supports("avx2");
+    bool have_sse4 = __builtin_cpu_supports("sse4.1");
+
+    if (!strcmp(name, "auto")) {
+        if (have_avx2) {
+            simd_auto_kernel = simd_generate_sound_block_avx2;
+            return &auto_avx2;
+        }
+        if (have_sse4) {
+            simd_auto_kernel = simd_generate_sound_block_sse4;
+            return &auto_sse4;
+        }
+        return &scalar;
+    }
+    if (!strcmp(name, "avx2")) return have_avx2 ? &avx2 : NULL;
+    if (!strcmp(name, "sse4")) return have_sse4 ? &sse4 : NULL;
+#else
+    if (!strcmp(name, "auto")) return &scalar;
+#endif
+    if (!strcmp(name, "scalar")) return &scalar;
+    return NULL;
+}
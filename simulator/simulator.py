@@ -1,12 +1,10 @@
 #!/usr/bin/env python3
 from functools import partial
-from mido import MidiFile
+import os
 from shlex import split, quote
 import subprocess
 import sys
 
-SAMPLERATE = 44100
-
 print_status = partial(print, file=sys.stderr)
 
 def run(cmd, *args, **kwargs):
@@ -15,60 +13,32 @@ def run(cmd, *args, **kwargs):
 	print_status(f"+ {' '.join(map(quote, cmd))}")
 	return subprocess.run(cmd, *args, check=True, **kwargs)
 
-def convert_midi_to_c_simulator_events(filename):
-	t = 0
-	n_samples = 0
-	for msg in MidiFile(filename):
-		if msg.time > 0: # round-about way of tracking time to avoid cumulating rounding errors
-			t += msg.time
-			n = int(t * SAMPLERATE)
-			yield f"generate_samples({n - n_samples});\n"
-			n_samples = n
-
-		if msg.is_meta: continue
-
-		data = "".join(f"\\x{i:02X}" for i in msg.bytes())
-		yield f"midi_event(\"{data}\", {len(msg.bytes())});\n"
-
-def convert_black_midi_to_c_simulator_events(filename):
-	# this won't cause gcc to balloon up to use 20+ GB of RAM on black midis
-	yield "struct asd {const char* data; unsigned char len; unsigned int n_samples;};\n"
-	yield "static const struct asd data[] = {\n"
-
-	t = 0
-	n_samples = 0
-	prev_n_samples = 0
-	for msg in MidiFile(filename):
-		if msg.time > 0: # round-about way of tracking time to avoid cumulating rounding errors
-			t += msg.time
-			n_samples = int(t * SAMPLERATE)
-
-		if msg.is_meta: continue
-
-		data = "".join(f"\\x{i:02X}" for i in msg.bytes())
-		yield f"\t{{\"{data}\", {len(msg.bytes())}, {n_samples - prev_n_samples}}},\n"
-		prev_n_samples = n_samples
-
-	yield "};\n\n"
-	yield "for (size_t i = 0; i < sizeof(data)/sizeof(struct asd); i++) {\n"
-	yield "\tif (data[i].n_samples) generate_samples(data[i].n_samples);\n"
-	yield "\tmidi_event(data[i].data, data[i].len);\n"
-	yield "}\n"
+def compile_simulator():
+	# the simulator reads midi files by itself, so it only needs to be rebuilt when the code changes
+	sources = ["main.c", "midi_file.c", "simd_render.c", "simd_kernel.c", "threaded_render.c", "pcm_output.c", "latency_model.c", "spi_replay.c", "test_vector.c", "checkpoint.c", "batch_render.c", "trace.c", "uart_input.c", "../reference_implementation.c"]
+	if os.path.exists("main.out") and all(os.path.getmtime(i) <= os.path.getmtime("main.out") for i in sources):
+		return
+	print_status("Compiling simulator...")
+	run("gcc main.c -lm -lpthread -o main.out -O2")
 
-def write_song_c(lines):
-	with open("song.c", "w") as f:
-		f.writelines(lines)
+def run_benchmark(flags):
+	sources = ["benchmark.c", "midi_file.c", "simd_render.c", "simd_kernel.c", "../reference_implementation.c"]
+	if not os.path.exists("benchmark.out") or any(os.path.getmtime(i) > os.path.getmtime("benchmark.out") for i in sources):
+		print_status("Compiling benchmark...")
+		run("gcc benchmark.c -lm -lpthread -o benchmark.out -O2")
+	print_status("Running benchmark...")
+	run(["./benchmark.out", *flags])
 
 def show_help():
 	print()
 	print(" "*3, __file__, "<midifile> [flags]\n")
-	print("I will convert the provided midi file into simulator events and")
-	print("write them to song.c, then compile main.c, then run it.")
+	print("I will compile main.c if needed, then run it on the provided midi file.")
+	print("With 'benchmark' instead of a midi file I will run benchmark.c, passing on the flags.")
 	print("")
 	print("flags:")
 	print("\t-h   show this")
 	print("\t-p   play output (using APLAY)")
-	print("\t-w   make wav (using SOX)")
+	print("\t-w   make wav")
 	print("\t-3   make mp3 (using LAME)")
 	print("\t-T   short for -s -o -m, used for making test data")
 	print("\t-C   short for -c -s -n, used for playback from RPi")
@@ -77,12 +47,41 @@ def show_help():
 	print("\t-n   enable n samples dump")
 	print("\t-o   enable sample dump")
 	print("\t-r   enable raw sample dump")
+	print("\t-W   <file> write a wav file, '-' for stdout")
+	print("\t-16  make the wav 16 bit instead of 32 bit")
+	print("\t-D   write the wav with O_DIRECT, bypassing the page cache")
+	print("\t-V   <file> write the spi packets and samples as a binary test vector, see test_vector.c")
 	print("\t-m   skip silence at beginning (intended for -o)")
-	print("\t-b   write song.c in compiler-friendly format")
+	print("\t-E   print the worst case error of the SINE lookup table and exit")
+	print("\t-O   compare the accuracy of the wavelength_pos and the phase accumulator oscillators and exit")
+	print("\t-k   <scalar|sse4|avx2|auto> select the block renderer, auto picks the fastest one the cpu supports, the scalar one while an attack, decay or release is set")
+	print("\t-j   <threads> split the generators across this many render threads")
+	print("\t-B   send the generator updates of each sample tick as one SPI packet, reports the bytes saved")
+	print("\t-u   send the midi events to the microcontroller byte by byte at 31250 baud, with running status, sysex and a midi clock, reports the delay")
+	print("\t-L   <spi hz> model the midi uart and the spi bus at this clock, delays the packets and reports the latency, through the byte parser with -u")
+	print("\t-R   <spidev> send the spi packets in real time, e.g. /dev/spidev0.0, reports the timing jitter")
+	print("\t-a   <round-robin|oldest-release|steal> select the voice allocation policy, round-robin drops notes when all generators are held")
+	print("\t-i   <square|triangle|sawtooth|sine|wavetable-square|wavetable-triangle|wavetable-sawtooth> the instrument of every generator, square by default")
+	print("\t-K   <file> write checkpoints of the engine state while rendering, or with -S and -J start from them")
+	print("\t-I   <samples> take a checkpoint every this many samples, 10 seconds by default")
+	print("\t-S   <sample> start the output at this sample, from the last checkpoint before it with -K")
+	print("\t-U   <sample> stop at this sample")
+	print("\t-J   <processes> render the segments between the checkpoints of -K in parallel")
+	print("\t-d   <songs dir> <output dir> render every midi file in a directory to a wav file each, many at once, instead of a midi file")
+	print("\t-P   <threads> the songs of -d rendered at once, one per cpu by default")
+	print("\t-x   <file> write the hot path counters and the time of each stage as json at exit, '-' for stderr. Needs a build with -DENABLE_STATS=1")
+	print("\t-e   <file> record the note, voice allocation, envelope and spi events of the generators as a binary trace. Needs a build with -DENABLE_TRACE=1")
+	print("\t-g   <trace> <json> convert a trace of -e to the json of the Chrome trace viewer and Perfetto, instead of a midi file")
 	print(f"\nExample usage for making chisel tests:\n\t{__file__} my_midi_file.mid -T | head -n 4000 > test_data.txt\n")
+	print(f"\nExample usage for rendering a whole directory of songs:\n\t{__file__} -d songs/ out/ -16\n")
+	print(f"\nExample usage for tracking the render speed:\n\t{__file__} benchmark -t 1 > results.json\n")
 	print(f"\nExample usage for RPi:\n\t{__file__} my_midi_file.mid -C | ssh pi.local python3\n")
+	print(f"\nOr on the RPi itself, without python in the loop:\n\t{__file__} my_midi_file.mid -R /dev/spidev0.0\n")
 
 def main():
+	if len(sys.argv) >= 2 and sys.argv[1] == "benchmark":
+		run_benchmark(sys.argv[2:])
+		return
 	if len(sys.argv) <= 2:
 		show_help()
 		return
@@ -94,21 +93,7 @@ def main():
 		show_help()
 		return
 
-	if filename != "-":
-		print_status("Parsing", filename, "into c...")
-		if "-b" in flags:
-			events = convert_black_midi_to_c_simulator_events(sys.argv[1])
-		else:
-			events = convert_midi_to_c_simulator_events(sys.argv[1])
-		print_status("Writing song.c...")
-		write_song_c(events)
-
-	print_status("Compiling simulator...")
-	# compile
-	if "-b" in flags:
-		run("gcc main.c -lm -o main.out")
-	else:
-		run("gcc main.c -lm -o main.out -O0")
+	compile_simulator()
 
 	if "-T" in flags:
 		#flags = [i for i in flags if i != "-T"] + ["-s", "-n", "-o", "-m"]
@@ -145,17 +130,17 @@ def main():
 		sys.stdout.flush()
 
 	print_status("Running simulator...")
-	cmd_flags = " ".join(flags)
+	cmd_flags = " ".join([quote(filename), *flags])
 	if "-p" in flags:
 		run(["bash", "-c", f"./main.out -r {cmd_flags} | aplay -c 1 -f S32_LE -r 44100"])
 	elif "-w" in flags:
-		run(["bash", "-c", f"./main.out -r {cmd_flags} | sox -t raw -r 44100 -e signed -b 32 -c 1 - -r 44100 {quote(filename+'.wav')}"])
+		run(["./main.out", filename, *flags, "-W", filename+".wav"])
 		print_status(f"output written to {filename+'.wav'}")
 	elif "-3" in flags:
 		run(["bash", "-c", f"./main.out -r {cmd_flags} | lame -r -s 44.1 --bitwidth 32 --signed -m mono - {quote(filename+'.mp3')}"])
 		print_status(f"output written to {filename+'.mp3'}")
 	else:
-		run(["./main.out", *flags])
+		run(["./main.out", filename, *flags])
 
 if __name__ == "__main__":
 	main()
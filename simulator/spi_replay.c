@@ -0,0 +1,189 @@
+// Real time replay of the SPI packet stream, for driving the FPGA from a RPi.
+//
+// This replaces the python script made by -C, which slept between every packet
+// and printed each of them. Here the packets of each sample tick are batched,
+// and sent when the tick is due on an absolute CLOCK_MONOTONIC schedule:
+//     start + n_samples / SAMPLE_RATE
+// Sleeping to absolute deadlines means the jitter of one wakeup doesn't add up
+// over the song, and a late batch is sent right away to catch up.
+//
+// On a spidev device a batch is a single SPI_IOC_MESSAGE ioctl, with chip select
+// toggled between the packets like separate transfers would. Anything else
+// (a file or a pipe, as a stand-in for testing) gets the batch in one write().
+//
+// At the end the lateness of the batches is reported, measured as when the
+// batch was sent compared to when it was due.
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <linux/spi/spidev.h>
+
+#define SPI_REPLAY_SPEED_HZ        100000 // what the RPi script used
+#define SPI_REPLAY_MAX_TRANSFERS   256    // per ioctl, SPI_IOC_MESSAGE is limited in size
+#define SPI_REPLAY_BUFFER_SIZE     (1 << 16)
+#define SPI_REPLAY_NS_PER_SECOND   1000000000ll
+
+typedef struct SpiReplay {
+	int             fd;
+	bool            is_spidev;
+	struct timespec start;
+
+	// the packets of the current tick, back to back
+	byte            buffer[SPI_REPLAY_BUFFER_SIZE];
+	size_t          buffer_len;
+	ushort          packet_lengths[SPI_REPLAY_MAX_TRANSFERS];
+	size_t          n_packets;
+
+	// lateness of every batch, in nanoseconds
+	int64_t*        lateness;
+	size_t          n_batches;
+	size_t          capacity;
+	size_t          n_packets_sent;
+	size_t          n_writes;
+} SpiReplay;
+
+static SpiReplay spi_replay;
+
+
+static int64_t spi_replay_ns(const struct timespec* t) {
+	return t->tv_sec * SPI_REPLAY_NS_PER_SECOND + t->tv_nsec;
+}
+
+static bool spi_replay_write_batch() {
+	SpiReplay* replay = &spi_replay;
+	if (!replay->n_packets) return true;
+
+	if (replay->is_spidev) {
+		struct spi_ioc_transfer transfers[SPI_REPLAY_MAX_TRANSFERS];
+		memset(transfers, 0, sizeof(transfers));
+		size_t offset = 0;
+		for (size_t i = 0; i < replay->n_packets; i++) {
+			transfers[i].tx_buf        = (uintptr_t)(replay->buffer + offset);
+			transfers[i].len           = replay->packet_lengths[i];
+			transfers[i].speed_hz      = SPI_REPLAY_SPEED_HZ;
+			transfers[i].bits_per_word = 8;
+			transfers[i].cs_change     = i + 1 < replay->n_packets; // a packet per chip select
+			offset += replay->packet_lengths[i];
+		}
+		if (ioctl(replay->fd, SPI_IOC_MESSAGE(replay->n_packets), transfers) < 0) {
+			perror("error: spi transfer failed");
+			return false;
+		}
+	} else {
+		for (size_t written = 0; written < replay->buffer_len;) {
+			ssize_t n = write(replay->fd, replay->buffer + written, replay->buffer_len - written);
+			if (n < 0 && errno == EINTR) continue;
+			if (n <= 0) {
+				perror("error: unable to write the spi replay");
+				return false;
+			}
+			written += n;
+		}
+	}
+	replay->n_writes++;
+	replay->n_packets_sent += replay->n_packets;
+	replay->buffer_len = 0;
+	replay->n_packets  = 0;
+	return true;
+}
+
+static int spi_replay_compare(const void* a, const void* b) {
+	int64_t x = *(const int64_t*)a, y = *(const int64_t*)b;
+	return (x > y) - (x < y);
+}
+
+
+// public interface:
+
+// opens a spidev device, or any file to write the packets to. The schedule starts now
+bool spi_replay_open(const char* path) {
+	SpiReplay* replay = &spi_replay;
+	memset(replay, 0, sizeof(SpiReplay));
+	replay->fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (replay->fd < 0) {
+		fprintf(stderr, "error: unable to open '%s' for the spi replay\n", path);
+		return false;
+	}
+
+	byte mode = SPI_MODE_0 | SPI_CS_HIGH;
+	uint speed = SPI_REPLAY_SPEED_HZ;
+	replay->is_spidev = ioctl(replay->fd, SPI_IOC_WR_MODE, &mode) == 0;
+	if (replay->is_spidev) {
+		byte bits = 8;
+		ioctl(replay->fd, SPI_IOC_WR_BITS_PER_WORD, &bits);
+		ioctl(replay->fd, SPI_IOC_WR_MAX_SPEED_HZ, &speed);
+	}
+
+	// flush whatever state the FPGA's SPI receiver is in
+	byte zeros[32] = {0};
+	memcpy(replay->buffer, zeros, sizeof(zeros));
+	replay->buffer_len        = sizeof(zeros);
+	replay->packet_lengths[0] = sizeof(zeros);
+	replay->n_packets         = 1;
+	if (!spi_replay_write_batch()) return false;
+	replay->n_writes = replay->n_packets_sent = 0;
+
+	clock_gettime(CLOCK_MONOTONIC, &replay->start);
+	return true;
+}
+
+// adds a packet to the batch of the current tick
+bool spi_replay_queue_packet(const byte* data, size_t length) {
+	SpiReplay* replay = &spi_replay;
+	if (replay->n_packets == SPI_REPLAY_MAX_TRANSFERS || replay->buffer_len + length > SPI_REPLAY_BUFFER_SIZE) {
+		if (!spi_replay_write_batch()) return false; // a huge tick, send what we have now
+	}
+	memcpy(replay->buffer + replay->buffer_len, data, length);
+	replay->buffer_len += length;
+	replay->packet_lengths[replay->n_packets++] = length;
+	return true;
+}
+
+// sleeps until the given sample is due, then sends the batch
+bool spi_replay_send_at(uint64_t sample) {
+	SpiReplay* replay = &spi_replay;
+	if (!replay->n_packets) return true;
+
+	int64_t due_ns = spi_replay_ns(&replay->start) + (int64_t)(sample * SPI_REPLAY_NS_PER_SECOND / SAMPLE_RATE);
+	struct timespec due = {due_ns / SPI_REPLAY_NS_PER_SECOND, due_ns % SPI_REPLAY_NS_PER_SECOND};
+	while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &due, NULL) == EINTR);
+
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	if (replay->n_batches == replay->capacity) {
+		replay->capacity = replay->capacity ? replay->capacity * 2 : 1024;
+		replay->lateness = realloc(replay->lateness, replay->capacity * sizeof(int64_t));
+		if (!replay->lateness) return false;
+	}
+	replay->lateness[replay->n_batches++] = spi_replay_ns(&now) - due_ns;
+	return spi_replay_write_batch();
+}
+
+void spi_replay_close() {
+	SpiReplay* replay = &spi_replay;
+	spi_replay_write_batch();
+	close(replay->fd);
+
+	fprintf(stderr, "spi replay: %zu packets in %zu transfers%s\n",
+		replay->n_packets_sent, replay->n_writes, replay->is_spidev ? " over spidev" : "");
+	if (replay->n_batches) {
+		qsort(replay->lateness, replay->n_batches, sizeof(int64_t), spi_replay_compare);
+		double sum = 0;
+		for (size_t i = 0; i < replay->n_batches; i++) sum += replay->lateness[i];
+		#define SPI_REPLAY_PERCENTILE_US(p) (replay->lateness[(replay->n_batches - 1) * (p) / 100] / 1000.0)
+		fprintf(stderr, "scheduling jitter over %zu ticks: mean %.1f us, p50 %.1f us, p99 %.1f us, max %.1f us\n",
+			replay->n_batches, sum / replay->n_batches / 1000.0,
+			SPI_REPLAY_PERCENTILE_US(50), SPI_REPLAY_PERCENTILE_US(99), SPI_REPLAY_PERCENTILE_US(100));
+		#undef SPI_REPLAY_PERCENTILE_US
+	}
+	free(replay->lateness);
+	replay->lateness = NULL;
+}
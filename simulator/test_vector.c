@@ -0,0 +1,415 @@
+// A compact binary format for the test vectors, the -T text made smaller.
+//
+// The text format prints a line per SPI packet and per sample, which makes
+// long vectors huge, and slow to both write and parse. This format stores the
+// same thing, and is read by memory mapping the file.
+//
+// Everything is little endian. The file starts with a TestVectorHeader, with the
+// constants the text version prints as "#generated for" lines, then the flags
+// it was generated with. A sequence of records follows, each starting with a tag:
+//   * TEST_VECTOR_SPI:     varint samples since the previous SPI packet, varint
+//                          length, then the packet. It is handled by the FPGA
+//                          before the sample with that index is generated
+//   * TEST_VECTOR_SAMPLES: varint index of the first sample, varint number of
+//                          samples, varint payload length, u32 checksum, then the
+//                          payload: the difference of each sample from the one
+//                          before (the first from 0) as zigzag varints. The
+//                          checksum is the CRC-32 of the decoded samples as
+//                          little endian int32, like zlib computes it
+//   * TEST_VECTOR_END:     varint total number of samples, varint number of SPI
+//                          packets. A file without it was cut short
+// Records are in time order, the samples may start late when skipping silence.
+//
+// This file has no dependencies besides libc, so a test harness can include it
+// for the reader. Compiled with -DTEST_VECTOR_MAIN it converts a vector back to
+// the text format of -s -o:
+//     gcc -DTEST_VECTOR_MAIN test_vector.c -o test_vector.out && ./test_vector.out vector.bin
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#define TEST_VECTOR_MAGIC             "SYNTHVEC"
+#define TEST_VECTOR_VERSION           1
+#define TEST_VECTOR_BLOCK_SIZE        4096     // samples per TEST_VECTOR_SAMPLES record, at most
+#define TEST_VECTOR_BUFFER_SIZE       (1 << 20)
+#define TEST_VECTOR_MAX_VARINT_LENGTH 10
+
+enum TestVectorTag {
+	TEST_VECTOR_END     = 0,
+	TEST_VECTOR_SPI     = 1,
+	TEST_VECTOR_SAMPLES = 2,
+	TEST_VECTOR_ERROR   = 0xFF, // returned by the reader for a corrupt or truncated file
+};
+
+typedef struct TestVectorHeader {
+	char     magic[8];
+	uint16_t version;
+	uint16_t header_size;      // including the flags which follow
+	uint32_t sample_rate;
+	uint32_t freq_shift;
+	uint32_t note_life_coeff;
+	uint32_t n_midi_keys;
+	uint32_t n_midi_channels;
+	uint32_t midi_a3_index;
+	double   midi_a3_freq;
+	uint32_t velocity_max;
+	uint32_t sample_max;
+	uint32_t n_generators;
+	uint16_t flags_length;     // the flags are not null terminated
+} __attribute__((packed)) TestVectorHeader;
+
+static uint32_t test_vector_crc_table[256];
+
+static uint32_t test_vector_crc32(uint32_t crc, const uint8_t* data, size_t length) {
+	if (!test_vector_crc_table[1]) {
+		for (uint32_t i = 0; i < 256; i++) {
+			uint32_t c = i;
+			for (size_t bit = 0; bit < 8; bit++) c = (c & 1) ? 0xEDB88320 ^ (c >> 1) : c >> 1;
+			test_vector_crc_table[i] = c;
+		}
+	}
+	crc = ~crc;
+	for (size_t i = 0; i < length; i++) crc = test_vector_crc_table[(crc ^ data[i]) & 0xFF] ^ (crc >> 8);
+	return ~crc;
+}
+
+static uint32_t test_vector_crc32_sample(uint32_t crc, int32_t sample) {
+	const uint8_t bytes[4] = {sample, (uint32_t)sample >> 8, (uint32_t)sample >> 16, (uint32_t)sample >> 24};
+	return test_vector_crc32(crc, bytes, 4);
+}
+
+static size_t test_vector_put_varint(uint8_t* p, uint64_t value) {
+	size_t length = 0;
+	do {
+		p[length++] = (value & 0x7F) | ((value >= 0x80) ? 0x80 : 0);
+		value >>= 7;
+	} while (value);
+	return length;
+}
+
+static uint64_t test_vector_zigzag(int64_t value) {
+	return ((uint64_t)value << 1) ^ (uint64_t)(value >> 63);
+}
+
+
+// the writer:
+
+typedef struct TestVectorWriter {
+	int      fd;
+	uint8_t* buffer;
+	size_t   buffer_len;
+	bool     ok;
+
+	uint64_t last_spi_sample;
+	uint64_t n_samples;
+	uint64_t n_spi_packets;
+
+	// the samples block being collected
+	int32_t  block[TEST_VECTOR_BLOCK_SIZE];
+	size_t   block_len;
+	uint64_t block_first;
+} TestVectorWriter;
+
+static void test_vector_flush_buffer(TestVectorWriter* writer) {
+	for (size_t written = 0; writer->ok && written < writer->buffer_len;) {
+		ssize_t n = write(writer->fd, writer->buffer + written, writer->buffer_len - written);
+		if (n < 0 && errno == EINTR) continue;
+		if (n <= 0) {
+			perror("error: unable to write the test vector");
+			writer->ok = false;
+			break;
+		}
+		written += n;
+	}
+	writer->buffer_len = 0;
+}
+
+// returns room for length bytes in the buffer
+static uint8_t* test_vector_reserve(TestVectorWriter* writer, size_t length) {
+	if (writer->buffer_len + length > TEST_VECTOR_BUFFER_SIZE) test_vector_flush_buffer(writer);
+	return writer->buffer + writer->buffer_len;
+}
+
+static void test_vector_write_block(TestVectorWriter* writer) {
+	if (!writer->block_len) return;
+	// the header, then the payload after room for the longest header
+	uint8_t* p       = test_vector_reserve(writer, 1 + 4 + 3 * TEST_VECTOR_MAX_VARINT_LENGTH + writer->block_len * 5);
+	uint8_t* payload = p + 1 + 4 + 3 * TEST_VECTOR_MAX_VARINT_LENGTH;
+	size_t   length  = 0;
+	uint32_t crc     = 0;
+	int32_t  last    = 0;
+	for (size_t i = 0; i < writer->block_len; i++) {
+		length += test_vector_put_varint(payload + length, test_vector_zigzag((int64_t)writer->block[i] - last));
+		crc     = test_vector_crc32_sample(crc, writer->block[i]);
+		last    = writer->block[i];
+	}
+
+	size_t header_len = 0;
+	p[header_len++] = TEST_VECTOR_SAMPLES;
+	header_len += test_vector_put_varint(p + header_len, writer->block_first);
+	header_len += test_vector_put_varint(p + header_len, writer->block_len);
+	header_len += test_vector_put_varint(p + header_len, length);
+	for (size_t i = 0; i < 4; i++) p[header_len++] = crc >> (8 * i);
+	memmove(p + header_len, payload, length);
+	writer->buffer_len += header_len + length;
+	writer->block_len   = 0;
+}
+
+// opens path for writing, and writes the header, whose magic, version and sizes are filled in
+bool test_vector_writer_open(TestVectorWriter* writer, const char* path, TestVectorHeader header, const char* flags) {
+	memset(writer, 0, sizeof(TestVectorWriter));
+	writer->fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (writer->fd < 0) {
+		fprintf(stderr, "error: unable to open '%s' for writing\n", path);
+		return false;
+	}
+	writer->buffer = malloc(TEST_VECTOR_BUFFER_SIZE);
+	if (!writer->buffer) {
+		close(writer->fd);
+		return false;
+	}
+	writer->ok = true;
+
+	size_t flags_length = strlen(flags);
+	if (flags_length > 0xFFFF - sizeof(TestVectorHeader)) flags_length = 0xFFFF - sizeof(TestVectorHeader);
+	memcpy(header.magic, TEST_VECTOR_MAGIC, sizeof(header.magic));
+	header.version      = TEST_VECTOR_VERSION;
+	header.header_size  = sizeof(TestVectorHeader) + flags_length;
+	header.flags_length = flags_length;
+	uint8_t* p = test_vector_reserve(writer, header.header_size);
+	memcpy(p, &header, sizeof(TestVectorHeader));
+	memcpy(p + sizeof(TestVectorHeader), flags, flags_length);
+	writer->buffer_len += header.header_size;
+	return true;
+}
+
+// the packet is handled before the sample with the given index
+bool test_vector_write_spi(TestVectorWriter* writer, uint64_t sample, const uint8_t* data, size_t length) {
+	test_vector_write_block(writer); // samples before it go first
+	uint8_t* p = test_vector_reserve(writer, 1 + 2 * TEST_VECTOR_MAX_VARINT_LENGTH + length);
+	size_t   n = 0;
+	p[n++] = TEST_VECTOR_SPI;
+	n += test_vector_put_varint(p + n, sample - writer->last_spi_sample);
+	n += test_vector_put_varint(p + n, length);
+	memcpy(p + n, data, length);
+	writer->buffer_len     += n + length;
+	writer->last_spi_sample = sample;
+	writer->n_spi_packets++;
+	return writer->ok;
+}
+
+// the samples starting at the given index
+bool test_vector_write_samples(TestVectorWriter* writer, uint64_t first, const int32_t* samples, size_t n) {
+	if (writer->block_len && writer->block_first + writer->block_len != first) test_vector_write_block(writer);
+	writer->n_samples += n;
+	while (n) {
+		if (!writer->block_len) writer->block_first = first;
+		size_t len = TEST_VECTOR_BLOCK_SIZE - writer->block_len;
+		if (len > n) len = n;
+		memcpy(writer->block + writer->block_len, samples, len * sizeof(int32_t));
+		writer->block_len += len;
+		if (writer->block_len == TEST_VECTOR_BLOCK_SIZE) test_vector_write_block(writer);
+		first   += len;
+		samples += len;
+		n       -= len;
+	}
+	return writer->ok;
+}
+
+bool test_vector_writer_close(TestVectorWriter* writer) {
+	test_vector_write_block(writer);
+	uint8_t* p = test_vector_reserve(writer, 1 + 2 * TEST_VECTOR_MAX_VARINT_LENGTH);
+	size_t   n = 0;
+	p[n++] = TEST_VECTOR_END;
+	n += test_vector_put_varint(p + n, writer->n_samples);
+	n += test_vector_put_varint(p + n, writer->n_spi_packets);
+	writer->buffer_len += n;
+	test_vector_flush_buffer(writer);
+	close(writer->fd);
+	free(writer->buffer);
+	writer->buffer = NULL;
+	return writer->ok;
+}
+
+
+// the reader:
+
+typedef struct TestVector {
+	const uint8_t*          data;
+	size_t                  size;
+	const TestVectorHeader* header;
+	const char*             flags;       // flags_length long, not null terminated
+	size_t                  pos;
+	uint64_t                spi_sample;
+} TestVector;
+
+typedef struct TestVectorRecord {
+	uint8_t        tag;
+	uint64_t       sample;   // of the SPI packet, or the first of the samples
+	size_t         length;   // bytes of the SPI packet, or number of samples
+	const uint8_t* data;     // the SPI packet, or the encoded samples
+	size_t         data_length;
+	uint32_t       checksum;
+} TestVectorRecord;
+
+static bool test_vector_get_varint(TestVector* vector, uint64_t* value) {
+	*value = 0;
+	for (size_t shift = 0; shift < 64 && vector->pos < vector->size; shift += 7) {
+		uint8_t b = vector->data[vector->pos++];
+		*value |= (uint64_t)(b & 0x7F) << shift;
+		if (!(b & 0x80)) return true;
+	}
+	return false;
+}
+
+// memory maps the vector at path and checks its header
+bool test_vector_open(TestVector* vector, const char* path) {
+	memset(vector, 0, sizeof(TestVector));
+	int fd = open(path, O_RDONLY);
+	struct stat st;
+	if (fd < 0 || fstat(fd, &st) < 0) {
+		fprintf(stderr, "error: unable to open '%s'\n", path);
+		if (fd >= 0) close(fd);
+		return false;
+	}
+	vector->size = st.st_size;
+	vector->data = (vector->size) ? mmap(NULL, vector->size, PROT_READ, MAP_PRIVATE, fd, 0) : MAP_FAILED;
+	close(fd);
+	if (vector->data == MAP_FAILED) {
+		fprintf(stderr, "error: unable to map '%s'\n", path);
+		return false;
+	}
+	madvise((void*)vector->data, vector->size, MADV_SEQUENTIAL);
+
+	vector->header = (const TestVectorHeader*)vector->data;
+	if (vector->size < sizeof(TestVectorHeader)
+	|| memcmp(vector->header->magic, TEST_VECTOR_MAGIC, sizeof(vector->header->magic))
+	|| vector->header->version != TEST_VECTOR_VERSION
+	|| vector->header->header_size > vector->size
+	|| vector->header->header_size < sizeof(TestVectorHeader) + vector->header->flags_length) {
+		fprintf(stderr, "error: '%s' is not a version %d test vector\n", path, TEST_VECTOR_VERSION);
+		munmap((void*)vector->data, vector->size);
+		return false;
+	}
+	vector->flags = (const char*)vector->data + sizeof(TestVectorHeader);
+	vector->pos   = vector->header->header_size;
+	return true;
+}
+
+// reads the next record, returning its tag. Returns TEST_VECTOR_ERROR at the end of a truncated file
+uint8_t test_vector_next(TestVector* vector, TestVectorRecord* record) {
+	memset(record, 0, sizeof(TestVectorRecord));
+	record->tag = TEST_VECTOR_ERROR;
+	if (vector->pos >= vector->size) return TEST_VECTOR_ERROR;
+
+	uint8_t  tag = vector->data[vector->pos++];
+	uint64_t a, b, c;
+	switch (tag) {
+		break; case TEST_VECTOR_SPI:
+			if (!test_vector_get_varint(vector, &a) || !test_vector_get_varint(vector, &b)) return TEST_VECTOR_ERROR;
+			if (b > vector->size - vector->pos) return TEST_VECTOR_ERROR;
+			vector->spi_sample  += a;
+			record->sample       = vector->spi_sample;
+			record->length       = b;
+			record->data         = vector->data + vector->pos;
+			record->data_length  = b;
+			vector->pos         += b;
+		break; case TEST_VECTOR_SAMPLES:
+			if (!test_vector_get_varint(vector, &a) || !test_vector_get_varint(vector, &b) || !test_vector_get_varint(vector, &c)) return TEST_VECTOR_ERROR;
+			if (c > vector->size - vector->pos || 4 > vector->size - vector->pos - c) return TEST_VECTOR_ERROR;
+			record->sample       = a;
+			record->length       = b;
+			for (size_t i = 0; i < 4; i++) record->checksum |= (uint32_t)vector->data[vector->pos++] << (8 * i);
+			record->data         = vector->data + vector->pos;
+			record->data_length  = c;
+			vector->pos         += c;
+		break; case TEST_VECTOR_END:
+			if (!test_vector_get_varint(vector, &a) || !test_vector_get_varint(vector, &b)) return TEST_VECTOR_ERROR;
+			record->sample       = a;
+			record->length       = b;
+		break; default:
+			return TEST_VECTOR_ERROR;
+	}
+	record->tag = tag;
+	return tag;
+}
+
+// decodes the record->length samples of a TEST_VECTOR_SAMPLES record, false if they don't match the checksum
+bool test_vector_decode_samples(const TestVectorRecord* record, int32_t* out) {
+	TestVector payload = {.data = record->data, .size = record->data_length};
+	uint32_t   crc     = 0;
+	int32_t    last    = 0;
+	for (size_t i = 0; i < record->length; i++) {
+		uint64_t zigzag;
+		if (!test_vector_get_varint(&payload, &zigzag)) return false;
+		last   = (int32_t)((int64_t)last + (int64_t)((zigzag >> 1) ^ -(zigzag & 1)));
+		out[i] = last;
+		crc    = test_vector_crc32_sample(crc, last);
+	}
+	return payload.pos == payload.size && crc == record->checksum;
+}
+
+void test_vector_close(TestVector* vector) {
+	munmap((void*)vector->data, vector->size);
+	vector->data = NULL;
+}
+
+
+#ifdef TEST_VECTOR_MAIN
+int main(int argc, char const *argv[]) {
+	TestVector vector;
+	if (argc != 2) {
+		fprintf(stderr, "usage: %s <vector>\n", argv[0]);
+		return 1;
+	}
+	if (!test_vector_open(&vector, argv[1])) return 1;
+
+	const TestVectorHeader* h = vector.header;
+	printf("#generated with the flags:%s%.*s\n", h->flags_length ? " " : "", h->flags_length, vector.flags);
+	printf("#generated for SAMPLE_RATE     %u\n", h->sample_rate);
+	printf("#generated for FREQ_SHIFT      %u\n", h->freq_shift);
+	printf("#generated for NOTE_LIFE_COEFF %u\n", h->note_life_coeff);
+	printf("#generated for N_MIDI_KEYS     %u\n", h->n_midi_keys);
+	printf("#generated for N_MIDI_CHANNELS %u\n", h->n_midi_channels);
+	printf("#generated for MIDI_A3_INDEX   %u\n", h->midi_a3_index);
+	printf("#generated for MIDI_A3_FREQ    %f\n", h->midi_a3_freq);
+	printf("#generated for VELOCITY_MAX    %u\n", h->velocity_max);
+	printf("#generated for SAMPLE_MAX      %u\n", h->sample_max);
+	printf("#generated for N_GENERATORS    %u\n", h->n_generators);
+
+	static int32_t   samples[TEST_VECTOR_BLOCK_SIZE];
+	TestVectorRecord record;
+	bool             ok = false;
+	while (true) {
+		uint8_t tag = test_vector_next(&vector, &record);
+		if (tag == TEST_VECTOR_SPI) {
+			printf("SPI:");
+			for (size_t i = 0; i < record.length; i++) printf(" %02X", record.data[i]);
+			printf("\n");
+		} else if (tag == TEST_VECTOR_SAMPLES) {
+			if (record.length > TEST_VECTOR_BLOCK_SIZE || !test_vector_decode_samples(&record, samples)) {
+				fprintf(stderr, "error: the samples at %llu don't match their checksum\n", (unsigned long long)record.sample);
+				break;
+			}
+			for (size_t i = 0; i < record.length; i++) printf("Sample: %i\n", samples[i]);
+		} else if (tag == TEST_VECTOR_END) {
+			fprintf(stderr, "%llu samples, %zu spi packets\n", (unsigned long long)record.sample, record.length);
+			ok = true;
+			break;
+		} else {
+			fprintf(stderr, "error: the vector is corrupt or was cut short\n");
+			break;
+		}
+	}
+	test_vector_close(&vector);
+	return ok ? 0 : 1;
+}
+#endif
@@ -0,0 +1,140 @@
+// A multi-threaded version of fpga_generate_sound_block() for the simulator.
+//
+// The generators are independent of each other until the adder sums them, so
+// the active generators are split into one contiguous slice per thread. Every
+// thread renders the partial sum of its slice for the whole block, then the
+// calling thread adds the partial sums together and does the master volume mix
+// of fpga_mix_generators(). The adder is integer addition, so the order the
+// partial sums are added in doesn't matter and the output is bit-identical to
+// the single-threaded renderers.
+//
+// SPI packets are only ever handled between calls to render(), which is at a
+// block boundary, so the workers never see the registers change under them.
+//
+// The calling thread does a slice of its own. Blocks with too few active
+// generators to be worth waking the workers for are rendered on the calling
+// thread alone.
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define THREADED_MAX_THREADS          256
+#define THREADED_MIN_GENERATORS_EACH  8 // fewer active generators per thread than this isn't worth the wakeup
+
+typedef struct ThreadedWorker {
+    pthread_t thread;
+    size_t    index;
+    WSample   acc[FPGA_BLOCK_SIZE]; // this thread's partial sum
+} __attribute__((aligned(64))) ThreadedWorker;
+
+typedef struct ThreadedPool {
+    ThreadedWorker*   workers;   // workers[0] is the calling thread
+    size_t            n_threads;
+    pthread_barrier_t start;     // all threads wait here until a block is ready
+    pthread_barrier_t done;      // and here until every slice is rendered
+
+    // the job, written by the calling thread before 'start'
+    FPGA*             fpga;
+    size_t            len;
+    size_t            n_active;
+    size_t            n_busy;    // threads which got a slice of this block
+    bool              quit;
+} ThreadedPool;
+
+static ThreadedPool threaded_pool;
+
+static void threaded_render_slice(ThreadedWorker* worker) {
+    ThreadedPool* pool  = &threaded_pool;
+    size_t        first = pool->n_active *  worker->index      / pool->n_busy;
+    size_t        last  = pool->n_active * (worker->index + 1) / pool->n_busy;
+
+    memset(worker->acc, 0, pool->len * sizeof(WSample));
+    for (size_t i = first; i < last; i++) {
+        fpga_accumulate_generator_block(pool->fpga, pool->fpga->active_generators[i], worker->acc, pool->len);
+    }
+}
+
+static void* threaded_worker_main(void* arg) {
+    ThreadedWorker* worker = arg;
+    for (;;) {
+        pthread_barrier_wait(&threaded_pool.start);
+        if (threaded_pool.quit) return NULL;
+        if (worker->index < threaded_pool.n_busy) threaded_render_slice(worker);
+        pthread_barrier_wait(&threaded_pool.done);
+    }
+}
+
+// starts n_threads-1 workers, the calling thread being worker 0. Returns false on failure
+bool threaded_render_init(size_t n_threads) {
+    ThreadedPool* pool = &threaded_pool;
+    if (n_threads < 1 || n_threads > THREADED_MAX_THREADS) {
+        fprintf(stderr, "error: the thread count must be between 1 and %d\n", THREADED_MAX_THREADS);
+        return false;
+    }
+    pool->workers = aligned_alloc(64, n_threads * sizeof(ThreadedWorker));
+    if (!pool->workers) return false;
+    pool->n_threads = n_threads;
+    pool->quit      = false;
+    pthread_barrier_init(&pool->start, NULL, n_threads);
+    pthread_barrier_init(&pool->done,  NULL, n_threads);
+
+    for (size_t i = 0; i < n_threads; i++) {
+        pool->workers[i].index = i;
+        if (i && pthread_create(&pool->workers[i].thread, NULL, threaded_worker_main, &pool->workers[i])) {
+            fprintf(stderr, "error: unable to start render thread %zu\n", i);
+            exit(1); // the barriers are sized for all of them, there is no going back
+        }
+    }
+    return true;
+}
+
+// stops the workers
+void threaded_render_close() {
+    ThreadedPool* pool = &threaded_pool;
+    if (!pool->workers) return;
+    pool->quit = true;
+    pthread_barrier_wait(&pool->start);
+    for (size_t i = 1; i < pool->n_threads; i++) pthread_join(pool->workers[i].thread, NULL);
+    pthread_barrier_destroy(&pool->start);
+    pthread_barrier_destroy(&pool->done);
+    free(pool->workers);
+    memset(pool, 0, sizeof(ThreadedPool));
+}
+
+// renders n samples into out, equivalent to fpga_generate_sound_block()
+void threaded_generate_sound_block(FPGA* fpga, WSample* out, size_t n) {
+    ThreadedPool* pool = &threaded_pool;
+    while (n) {
+        size_t len  = fpga_begin_block(fpga, (n < FPGA_BLOCK_SIZE) ? n : FPGA_BLOCK_SIZE);
+        size_t busy = fpga->n_active_generators / THREADED_MIN_GENERATORS_EACH;
+        if (busy > pool->n_threads) busy = pool->n_threads;
+        if (busy < 1) busy = 1;
+
+        pool->fpga     = fpga;
+        pool->len      = len;
+        pool->n_active = fpga->n_active_generators;
+        pool->n_busy   = busy;
+        if (busy > 1) {
+            pthread_barrier_wait(&pool->start);
+            threaded_render_slice(&pool->workers[0]);
+            pthread_barrier_wait(&pool->done);
+        } else {
+            threaded_render_slice(&pool->workers[0]);
+        }
+
+        // the reduction, then the adder's master volume
+        WSample* acc = pool->workers[0].acc;
+        for (size_t t = 1; t < busy; t++) {
+            const WSample* partial = pool->workers[t].acc;
+            for (size_t i = 0; i < len; i++) acc[i] += partial[i];
+        }
+        for (size_t i = 0; i < len; i++) {
+            out[i] = fpga_mix_generators(fpga, acc[i]);
+        }
+        fpga_end_block(fpga, len);
+
+        out += len;
+        n   -= len;
+    }
+}
@@ -0,0 +1,308 @@
+// Binary tracing of what the generators go through in a song: the note events,
+// the voice allocation of the microcontroller, the envelope phases on the FPGA
+// and the SPI packets it handles. This is for looking at voice allocation and
+// release tails on a timeline, trace_convert() turns a trace into the JSON of
+// the Chrome trace viewer, which Perfetto opens as well.
+//
+// The events come from the hooks of ENABLE_TRACE in the reference
+// implementation, on whichever thread they happen. The threaded renderer steps
+// generators on several. Every thread gets a ring buffer of its own the first
+// time it records, so an event costs a store of a fixed size record and a
+// release store of the head, without locks. Each ring has a single consumer,
+// trace_drain(), which the simulator calls between ticks to move what the
+// rings hold into the trace file. A full ring drops the event rather than
+// wait. The header of the file has the count.
+//
+// The events are stamped with the sample they happened on. The microcontroller
+// doesn't know the sample clock, so the simulator sets the one its events get
+// with trace_set_clock(). The FPGA passes its own, which differs with -L.
+//
+// The file is a TraceHeader followed by TraceRecords, in the order they were
+// drained. The converter sorts them by sample.
+
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define TRACE_MAGIC     "SYNTHTRC"
+#define TRACE_VERSION   1
+#define TRACE_RING_SIZE (1 << 16) // records per thread between two drains, a power of two
+
+typedef struct TraceRecord {
+	uint64_t sample;    // the sample it happened on
+	byte     type;      // TraceEventType
+	byte     channel;
+	byte     note;
+	byte     value;     // the velocity, the envelope phase or the SPI packet type
+	ushort   generator; // TRACE_NO_GENERATOR for none
+	ushort   length;    // of an SPI packet
+} TraceRecord;
+
+typedef struct TraceHeader {
+	char     magic[8];
+	uint32_t version;
+	uint32_t record_size;
+	uint32_t sample_rate;
+	uint32_t n_generators;
+	uint64_t n_records;
+	uint64_t n_dropped;        // events lost to full rings
+} TraceHeader;
+
+typedef struct TraceRing {
+	TraceRecord       records[TRACE_RING_SIZE];
+	_Atomic size_t    head;    // only written by the thread recording
+	_Atomic size_t    tail;    // only written by trace_drain()
+	struct TraceRing* next;    // all of the rings, newest first
+} TraceRing;
+
+static struct {
+	FILE*               file;
+	_Atomic bool        enabled;
+	_Atomic(TraceRing*) rings;
+	_Atomic uint64_t    n_dropped;
+	uint64_t            n_records;
+} trace;
+
+static __thread TraceRing* trace_ring;  // the one of this thread, they stay allocated
+static __thread uint64_t   trace_clock; // the sample the microcontroller events of this thread get
+
+static TraceRing* trace_new_ring(void) {
+	TraceRing* ring = aligned_alloc(64, sizeof(TraceRing));
+	if (!ring) return NULL;
+	atomic_init(&ring->head, 0);
+	atomic_init(&ring->tail, 0);
+	ring->next = atomic_load(&trace.rings);
+	while (!atomic_compare_exchange_weak(&trace.rings, &ring->next, ring));
+	return ring;
+}
+
+static void trace_record(TraceRecord record) {
+	if (!atomic_load_explicit(&trace.enabled, memory_order_relaxed)) return;
+	TraceRing* ring = trace_ring;
+	if (!ring) ring = trace_ring = trace_new_ring();
+
+	size_t head = ring ? atomic_load_explicit(&ring->head, memory_order_relaxed) : 0;
+	if (!ring || head - atomic_load_explicit(&ring->tail, memory_order_acquire) == TRACE_RING_SIZE) {
+		atomic_fetch_add_explicit(&trace.n_dropped, 1, memory_order_relaxed);
+		return;
+	}
+	ring->records[head % TRACE_RING_SIZE] = record;
+	atomic_store_explicit(&ring->head, head + 1, memory_order_release);
+}
+
+static void trace_write_header(void) {
+	TraceHeader header = {
+		.version      = TRACE_VERSION,
+		.record_size  = sizeof(TraceRecord),
+		.sample_rate  = SAMPLE_RATE,
+		.n_generators = N_GENERATORS,
+		.n_records    = trace.n_records,
+		.n_dropped    = atomic_load(&trace.n_dropped),
+	};
+	memcpy(header.magic, TRACE_MAGIC, sizeof(header.magic));
+	fwrite(&header, sizeof(TraceHeader), 1, trace.file);
+}
+
+
+// the hooks of the reference implementation:
+
+void trace_microcontroller_event(TraceEventType type, uint generator_index, byte channel, byte note, byte velocity) {
+	trace_record((TraceRecord){trace_clock, type, channel, note, velocity, generator_index, 0});
+}
+
+void trace_fpga_event(uint64_t sample, TraceEventType type, uint generator_index, byte channel, byte note, byte value, ushort length) {
+	trace_record((TraceRecord){sample, type, channel, note, value, generator_index, length});
+}
+
+
+// public interface:
+
+// starts recording into a new trace file, once per process
+bool trace_open(const char* path) {
+	trace.file = fopen(path, "wb");
+	if (!trace.file) {
+		fprintf(stderr, "error: unable to write the trace to '%s'\n", path);
+		return false;
+	}
+	trace_write_header(); // written again with the counts by trace_close()
+	atomic_store(&trace.enabled, true);
+	return true;
+}
+
+// the sample the microcontroller events recorded on this thread are stamped with from now on
+void trace_set_clock(uint64_t sample) {
+	trace_clock = sample;
+}
+
+// moves the recorded events of every thread into the trace file. Only one thread may drain
+bool trace_drain(void) {
+	bool ok = true;
+	for (TraceRing* ring = atomic_load_explicit(&trace.rings, memory_order_acquire); ring; ring = ring->next) {
+		size_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+		size_t head = atomic_load_explicit(&ring->head, memory_order_acquire);
+		while (tail != head) { // in at most two pieces, around the end
+			size_t first = tail % TRACE_RING_SIZE;
+			size_t n     = (head - tail < TRACE_RING_SIZE - first) ? head - tail : TRACE_RING_SIZE - first;
+			if (fwrite(&ring->records[first], sizeof(TraceRecord), n, trace.file) != n) ok = false;
+			trace.n_records += n;
+			tail += n;
+		}
+		atomic_store_explicit(&ring->tail, tail, memory_order_release);
+	}
+	return ok;
+}
+
+// stops recording and finishes the file. Reports the events dropped, if any
+bool trace_close(void) {
+	atomic_store(&trace.enabled, false);
+	bool ok = trace_drain();
+	if (fseek(trace.file, 0, SEEK_SET)) ok = false;
+	trace_write_header();
+	if (ferror(trace.file)) ok = false;
+	if (fclose(trace.file)) ok = false;
+	if (!ok) perror("error: unable to write the trace");
+	uint64_t n_dropped = atomic_load(&trace.n_dropped);
+	if (n_dropped) fprintf(stderr, "trace: %llu events dropped, the rings were full\n", (unsigned long long)n_dropped);
+	return ok;
+}
+
+
+// The converter. Every generator is a thread of the "fpga" process, with its
+// envelope phases as slices named after the note, and the voice allocation of
+// the microcontroller as instant events on it. A counter follows the number of
+// generators sounding. The note events and the SPI packets are instant events
+// on tracks of their own.
+
+typedef struct TraceSortedRecord {
+	TraceRecord record;
+	uint64_t    index; // in the file, to keep the order of the events of a sample
+} TraceSortedRecord;
+
+typedef struct TraceSlice {
+	bool     open;
+	byte     phase;
+	byte     channel;
+	byte     note;
+	uint64_t since;
+} TraceSlice;
+
+static int trace_compare_records(const void* a, const void* b) {
+	const TraceSortedRecord* x = a;
+	const TraceSortedRecord* y = b;
+	if (x->record.sample != y->record.sample) return (x->record.sample > y->record.sample) - (x->record.sample < y->record.sample);
+	return (x->index > y->index) - (x->index < y->index);
+}
+
+static const char* trace_note_name(byte note, char buffer[8]) {
+	static const char* names[12] = {"C", "C#", "D", "D#", "E", "F", "F#", "G", "G#", "A", "A#", "B"};
+	snprintf(buffer, 8, "%s%d", names[note % 12], note / 12 - 1);
+	return buffer;
+}
+
+static void trace_write_slice(FILE* f, const TraceHeader* header, uint generator, const TraceSlice* slice, uint64_t until) {
+	static const char* phase_names[] = {"attack", "decay", "sustain", "release"};
+	char note[8];
+	fprintf(f, ",\n{\"name\": \"%s %s\", \"ph\": \"X\", \"pid\": 2, \"tid\": %u, \"ts\": %.3f, \"dur\": %.3f, "
+		"\"args\": {\"channel\": %u, \"note\": %u}}",
+		trace_note_name(slice->note, note), phase_names[slice->phase & 3], generator,
+		slice->since * 1e6 / header->sample_rate, (until - slice->since) * 1e6 / header->sample_rate,
+		slice->channel, slice->note);
+}
+
+// converts a trace written with -e into Chrome trace JSON
+bool trace_convert(const char* trace_path, const char* json_path) {
+	static const char* event_names[N_TRACE_EVENT_TYPES] = {
+		"note on", "note off", "allocate", "steal", "drop", "release", "envelope", "spi",
+	};
+	FILE* in = fopen(trace_path, "rb");
+	TraceHeader header;
+	if (!in || fread(&header, sizeof(TraceHeader), 1, in) != 1
+	|| memcmp(header.magic, TRACE_MAGIC, sizeof(header.magic)) || header.version != TRACE_VERSION
+	|| header.record_size != sizeof(TraceRecord) || !header.sample_rate) {
+		fprintf(stderr, "error: '%s' is not a trace written by -e\n", trace_path);
+		if (in) fclose(in);
+		return false;
+	}
+	TraceSortedRecord* records = malloc((header.n_records ? header.n_records : 1) * sizeof(TraceSortedRecord));
+	TraceSlice*        slices  = calloc(TRACE_NO_GENERATOR, sizeof(TraceSlice));
+	bool*              named   = calloc(TRACE_NO_GENERATOR, sizeof(bool));
+	FILE*              f       = (records && slices && named) ? fopen(json_path, "w") : NULL;
+	uint64_t n = 0;
+	while (records && n < header.n_records && fread(&records[n].record, sizeof(TraceRecord), 1, in) == 1) {
+		records[n].index = n;
+		n++;
+	}
+	fclose(in);
+	if (!f) {
+		fprintf(stderr, "error: unable to write '%s'\n", json_path);
+		free(records); free(slices); free(named);
+		return false;
+	}
+	if (n != header.n_records) fprintf(stderr, "warning: '%s' was cut short, converting the %llu events it has\n", trace_path, (unsigned long long)n);
+	if (header.n_dropped) fprintf(stderr, "warning: %llu events were dropped while tracing\n", (unsigned long long)header.n_dropped);
+	qsort(records, n, sizeof(TraceSortedRecord), trace_compare_records);
+
+	fprintf(f, "{\"displayTimeUnit\": \"ms\", \"traceEvents\": [\n");
+	fprintf(f, "{\"name\": \"process_name\", \"ph\": \"M\", \"pid\": 1, \"args\": {\"name\": \"microcontroller\"}},\n");
+	fprintf(f, "{\"name\": \"thread_name\", \"ph\": \"M\", \"pid\": 1, \"tid\": 0, \"args\": {\"name\": \"midi\"}},\n");
+	fprintf(f, "{\"name\": \"process_name\", \"ph\": \"M\", \"pid\": 2, \"args\": {\"name\": \"fpga\"}},\n");
+	fprintf(f, "{\"name\": \"thread_name\", \"ph\": \"M\", \"pid\": 2, \"tid\": %u, \"args\": {\"name\": \"spi\"}}", TRACE_NO_GENERATOR);
+
+	size_t   n_sounding = 0;
+	uint64_t last       = 0;
+	for (uint64_t i = 0; i < n; i++) {
+		const TraceRecord* record = &records[i].record;
+		double ts = record->sample * 1e6 / header.sample_rate;
+		const char* name = (record->type < N_TRACE_EVENT_TYPES) ? event_names[record->type] : "unknown";
+		char note[8];
+		last = record->sample;
+
+		uint generator = record->generator;
+		if (generator != TRACE_NO_GENERATOR && !named[generator]) {
+			named[generator] = true;
+			fprintf(f, ",\n{\"name\": \"thread_name\", \"ph\": \"M\", \"pid\": 2, \"tid\": %u, \"args\": {\"name\": \"generator %u\"}}", generator, generator);
+			fprintf(f, ",\n{\"name\": \"thread_sort_index\", \"ph\": \"M\", \"pid\": 2, \"tid\": %u, \"args\": {\"sort_index\": %u}}", generator, generator);
+		}
+
+		switch (record->type) {
+			break; case TRACE_ENVELOPE_PHASE: {
+				TraceSlice* slice = &slices[generator];
+				size_t was_sounding = n_sounding;
+				if (slice->open) {
+					trace_write_slice(f, &header, generator, slice, record->sample);
+					n_sounding--;
+				}
+				*slice = (TraceSlice){record->value < ENVELOPE_DONE, record->value, record->channel, record->note, record->sample};
+				n_sounding += slice->open;
+				if (n_sounding != was_sounding) {
+					fprintf(f, ",\n{\"name\": \"sounding generators\", \"ph\": \"C\", \"pid\": 2, \"ts\": %.3f, \"args\": {\"generators\": %zu}}", ts, n_sounding);
+				}
+			}
+			break; case TRACE_SPI_APPLY:
+				fprintf(f, ",\n{\"name\": \"%s %u\", \"ph\": \"i\", \"s\": \"t\", \"pid\": 2, \"tid\": %u, \"ts\": %.3f, \"args\": {\"type\": %u, \"length\": %u}}",
+					name, record->value, TRACE_NO_GENERATOR, ts, record->value, record->length);
+			break; default: { // the microcontroller, on its own track or on the one of the generator it picked
+				bool on_generator = generator != TRACE_NO_GENERATOR;
+				fprintf(f, ",\n{\"name\": \"%s %s\", \"ph\": \"i\", \"s\": \"t\", \"pid\": %d, \"tid\": %u, \"ts\": %.3f, "
+					"\"args\": {\"channel\": %u, \"note\": %u, \"velocity\": %u}}",
+					name, trace_note_name(record->note, note), on_generator ? 2 : 1, on_generator ? generator : 0, ts,
+					record->channel, record->note, record->value);
+			}
+		}
+	}
+	for (uint generator = 0; generator < TRACE_NO_GENERATOR; generator++) { // still sounding at the end
+		if (slices[generator].open) trace_write_slice(f, &header, generator, &slices[generator], last);
+	}
+	fprintf(f, "\n]}\n");
+
+	bool ok = !ferror(f);
+	if (fclose(f)) ok = false;
+	if (!ok) fprintf(stderr, "error: unable to write '%s'\n", json_path);
+	free(records);
+	free(slices);
+	free(named);
+	return ok;
+}
@@ -0,0 +1,216 @@
+// The midi cable into the microcontroller, for the simulator. It is the one
+// model of the midi uart: with -u the microcontroller receives the events as
+// raw bytes from it, instead of having them handed over whole, and with -L the
+// latency model takes the arrival times of the events from it.
+//
+// The events are put on the line the way a sequencer would send them:
+//   * with running status, a channel message leaves out its status byte when
+//     it is the same as the one before
+//   * the sysex events of the midi file, as 0xF0, filler data bytes of the
+//     length the file gives, and 0xF7. The reader skips their contents, and
+//     the parser skips them either way
+//   * a midi clock, 0xF8 24 times per quarter note at the tempo of the file.
+//     A clock byte goes out when it is due, between the bytes of another
+//     message if need be, which the parser has to cope with
+// Every byte takes 10 bits at 31250 baud, and the bytes queue up behind each
+// other when the events are closer together than the line can carry them.
+//
+// A byte is handed to microcontroller_uart_receive_byte() at the first sample
+// tick after its stop bit, like the receive interrupt would. The main loop
+// polls the input on that tick, and sends the generator updates of what it
+// parsed. The rendering is split up at those ticks, so the delay of the cable
+// ends up in the audio. Without -u the bytes are only timed, not kept.
+//
+// Time is kept in nanoseconds.
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define UART_INPUT_BAUD          31250
+#define UART_INPUT_BITS_PER_BYTE 10   // start bit, 8 data bits, stop bit
+#define UART_INPUT_NS_PER_BYTE   (UART_INPUT_BITS_PER_BYTE * 1000000000ull / UART_INPUT_BAUD)
+#define UART_INPUT_NS_PER_SECOND 1000000000ull
+#define UART_INPUT_CLOCKS        24   // per quarter note
+#define UART_INPUT_SYSEX_FILLER  0x00
+
+typedef struct UartInputByte {
+	uint64_t arrive_ns;     // when its stop bit is in
+	uint64_t arrive_sample; // the tick it is received on
+	uint64_t event_sample;  // for the last byte of a midi event, when the midi file says it starts. UINT64_MAX for the others
+	byte     event[3];      // and the event itself, for the latency model
+	byte     event_length;
+	byte     value;
+} UartInputByte;
+
+typedef struct UartInput {
+	bool           receive;        // whether the bytes are kept for the microcontroller, or only timed
+	uint64_t       free_ns;        // when the line is done sending what it has
+	uint64_t       next_clock_ns;
+	uint64_t       clock_ns;       // between two clock bytes
+	byte           running_status;
+
+	// the bytes on the line, in order
+	UartInputByte* bytes;
+	size_t         head;
+	size_t         len;
+	size_t         capacity;
+
+	size_t         n_bytes;
+	size_t         n_status_bytes_saved;
+	size_t         n_clock_bytes;
+	size_t         n_sysex_bytes;
+	size_t         n_events;
+	uint64_t       total_delay;    // from when the midi file says an event starts to when its last byte arrives, in samples
+	uint64_t       max_delay;
+} UartInput;
+
+static UartInput uart_input;
+
+
+static uint64_t uart_input_sample_to_ns(uint64_t sample) {
+	return sample * UART_INPUT_NS_PER_SECOND / SAMPLE_RATE;
+}
+
+static uint64_t uart_input_ns_to_next_sample(uint64_t ns) { // rounding up
+	return (ns * SAMPLE_RATE + UART_INPUT_NS_PER_SECOND - 1) / UART_INPUT_NS_PER_SECOND;
+}
+
+// puts a byte on the line as soon as it is free, and no earlier than the given time.
+// Returns when it arrives
+static uint64_t uart_input_put(uint64_t earliest_ns, byte value) {
+	UartInput* uart  = &uart_input;
+	uint64_t   start = (earliest_ns > uart->free_ns) ? earliest_ns : uart->free_ns;
+	uart->free_ns = start + UART_INPUT_NS_PER_BYTE;
+	uart->n_bytes++;
+	if (!uart->receive) return uart->free_ns;
+
+	if (uart->head + uart->len == uart->capacity) {
+		if (uart->head) { // compact before growing
+			memmove(uart->bytes, uart->bytes + uart->head, uart->len * sizeof(UartInputByte));
+			uart->head = 0;
+		} else {
+			uart->capacity = uart->capacity ? uart->capacity * 2 : 256;
+			uart->bytes    = realloc(uart->bytes, uart->capacity * sizeof(UartInputByte));
+			if (!uart->bytes) {
+				fprintf(stderr, "error: out of memory in the uart input\n");
+				exit(1);
+			}
+		}
+	}
+	UartInputByte* slot = &uart->bytes[uart->head + uart->len++];
+	slot->arrive_ns     = uart->free_ns;
+	slot->arrive_sample = uart_input_ns_to_next_sample(uart->free_ns);
+	slot->event_sample  = UINT64_MAX;
+	slot->value         = value;
+	return slot->arrive_ns;
+}
+
+// sends the clock bytes due by the time the line is free to send a byte due at the given time
+static void uart_input_send_clocks(uint64_t ns) {
+	UartInput* uart = &uart_input;
+	while (uart->clock_ns && uart->next_clock_ns <= ((ns > uart->free_ns) ? ns : uart->free_ns)) {
+		uart_input_put(uart->next_clock_ns, 0xF8);
+		uart->next_clock_ns += uart->clock_ns;
+		uart->n_clock_bytes++;
+	}
+}
+
+static uint64_t uart_input_send_byte(uint64_t ns, byte value) {
+	uart_input_send_clocks(ns);
+	return uart_input_put(ns, value);
+}
+
+
+// public interface:
+
+// receive is whether the microcontroller gets the bytes through uart_input_receive() (-u),
+// rather than the events whole with only their timing from here (-L)
+void uart_input_init(bool receive) {
+	memset(&uart_input, 0, sizeof(UartInput));
+	uart_input.receive = receive;
+}
+
+// the tempo of the midi file in microseconds per quarter note, for the clock. It
+// starts with the first call, and is kept up to date with every event after
+void uart_input_set_tempo(uint tempo) {
+	uart_input.clock_ns = (uint64_t)tempo * 1000 / UART_INPUT_CLOCKS;
+}
+
+// puts a midi event due at the given sample on the line. Returns when its last byte arrives
+uint64_t uart_input_send_midi_event(uint64_t sample, const byte* data, size_t length) {
+	UartInput* uart = &uart_input;
+	uint64_t   ns   = uart_input_sample_to_ns(sample);
+	size_t     i    = 0;
+	if (data[0] < 0xF0 && data[0] == uart->running_status) {
+		uart->n_status_bytes_saved++;
+		i++;
+	} else if (data[0] < 0xF8) {
+		uart->running_status = (data[0] < 0xF0) ? data[0] : 0;
+	}
+	uint64_t arrive_ns = ns;
+	for (; i < length; i++) arrive_ns = uart_input_send_byte(ns, data[i]);
+
+	if (uart->receive && length <= sizeof(uart->bytes->event)) { // the clock bytes go out before a byte, never after
+		UartInputByte* last = &uart->bytes[uart->head + uart->len - 1];
+		last->event_sample = sample;
+		last->event_length = length;
+		memcpy(last->event, data, length);
+	}
+	uint64_t arrive = uart_input_ns_to_next_sample(arrive_ns);
+	uart->n_events++;
+	uart->total_delay += arrive - sample;
+	if (arrive - sample > uart->max_delay) uart->max_delay = arrive - sample;
+	return arrive_ns;
+}
+
+// puts a sysex event due at the given sample on the line, length being the bytes after
+// its 0xF0 in the midi file, the 0xF7 at the end included
+void uart_input_send_sysex(uint64_t sample, uint length) {
+	UartInput* uart = &uart_input;
+	uint64_t   ns   = uart_input_sample_to_ns(sample);
+	uart->running_status = 0;
+	uart_input_send_byte(ns, 0xF0);
+	for (uint i = 1; i < length; i++) uart_input_send_byte(ns, UART_INPUT_SYSEX_FILLER);
+	uart_input_send_byte(ns, 0xF7);
+	uart->n_sysex_bytes += length ? length + 1 : 2;
+}
+
+// hands the next byte which arrives by the given sample to the receive interrupt of
+// the microcontroller, and copies it to received. Returns false when there is none
+bool uart_input_receive(Microcontroller* mcu, uint64_t sample, UartInputByte* received) {
+	UartInput* uart = &uart_input;
+	uart_input_send_clocks(uart_input_sample_to_ns(sample));
+	if (!uart->len || uart->bytes[uart->head].arrive_sample > sample) return false;
+	*received = uart->bytes[uart->head++];
+	if (!--uart->len) uart->head = 0;
+	microcontroller_uart_receive_byte(mcu, received->value);
+	return true;
+}
+
+// the sample the next byte arrives on, the next clock byte included. UINT64_MAX if there is none
+uint64_t uart_input_next_arrival_sample() {
+	UartInput* uart = &uart_input;
+	if (uart->len) return uart->bytes[uart->head].arrive_sample;
+	if (!uart->clock_ns) return UINT64_MAX;
+	uint64_t start = (uart->next_clock_ns > uart->free_ns) ? uart->next_clock_ns : uart->free_ns;
+	return uart_input_ns_to_next_sample(start + UART_INPUT_NS_PER_BYTE);
+}
+
+// the sample the last byte of the events sent so far arrives on, the clock aside
+uint64_t uart_input_last_arrival_sample() {
+	UartInput* uart = &uart_input;
+	return uart->len ? uart->bytes[uart->head + uart->len - 1].arrive_sample : 0;
+}
+
+void uart_input_print_report(const Microcontroller* mcu) {
+	UartInput* uart = &uart_input;
+	fprintf(stderr, "uart: %zu bytes at %d baud, %zu status bytes saved by running status, %zu clock bytes, %zu sysex bytes\n",
+		uart->n_bytes, UART_INPUT_BAUD, uart->n_status_bytes_saved, uart->n_clock_bytes, uart->n_sysex_bytes);
+	fprintf(stderr, "uart: %zu events delayed %.3f ms on average, %.3f ms at most\n", uart->n_events,
+		uart->n_events ? uart->total_delay * 1000.0 / SAMPLE_RATE / uart->n_events : 0.0, uart->max_delay * 1000.0 / SAMPLE_RATE);
+	fprintf(stderr, "uart: %zu bytes parsed, %zu skipped, %zu dropped by a full ring\n",
+		mcu->midi_input_stats.n_bytes, mcu->midi_input_stats.n_skipped_bytes, mcu->midi_input_stats.n_dropped_bytes);
+}